@@ -18,6 +18,11 @@ macro(define_plaform_settings)
 
 	add_compile_options(/Gy)
 	add_compile_options(/fp:fast)
+	# The LEB matrix tables are generated in constant expressions
+	add_compile_options(/constexpr:steps100000000)
+	if (ENABLE_AVX2)
+		add_compile_options(/arch:AVX2)
+	endif()
 	replace_compile_flags("/GR" "/GR-")
 
 	add_compile_options(/W4)
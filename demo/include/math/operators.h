@@ -125,4 +125,8 @@
 
 uint32_t find_msb(uint32_t x);
 uint32_t find_msb_64(uint64_t x);
-int32_t round_up_power2(uint32_t v);
\ No newline at end of file
+int32_t round_up_power2(uint32_t v);
+
+// Conversions between float and IEEE half (round to nearest even, same result as F16C)
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t value);
\ No newline at end of file
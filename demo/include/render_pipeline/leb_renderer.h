@@ -10,6 +10,7 @@
 #include "render_pipeline/sky.h"
 #include "render_pipeline/grid_renderer.h"
 #include "volume/leb_volume_gpu.h"
+#include "volume/point_locator.h"
 
 // System includes
 #include <string>
@@ -55,6 +56,7 @@ private:
     // Volume CPU data
     LEBVolumeGPU m_Volume = LEBVolumeGPU();
     MortonCache m_MortonCache = MortonCache();
+    PointLocator m_PointLocator = PointLocator();
     std::vector<std::string> m_ShaderDefines;
     Sampler m_LinearClampSampler = 0;
     uint32_t m_NumOutsideElements = 0;
@@ -0,0 +1,54 @@
+#pragma once
+
+// External includes
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+// Array that stores its elements in fixed size chunks, growing it never moves the existing elements
+template<typename T, uint32_t ChunkSizeLog2 = 16>
+class ChunkedArray
+{
+public:
+    // Number of elements per chunk
+    static const uint64_t chunkSize = 1ull << ChunkSizeLog2;
+    static const uint64_t chunkMask = chunkSize - 1;
+
+public:
+    // Cst & Dst
+    ChunkedArray() = default;
+    ~ChunkedArray() = default;
+
+    // Move only, a copy would duplicate every chunk
+    ChunkedArray(ChunkedArray&&) = default;
+    ChunkedArray& operator=(ChunkedArray&&) = default;
+    ChunkedArray(const ChunkedArray&) = delete;
+    ChunkedArray& operator=(const ChunkedArray&) = delete;
+
+    // Element access
+    T& operator[](uint64_t index) { return m_Chunks[index >> ChunkSizeLog2][index & chunkMask]; }
+    const T& operator[](uint64_t index) const { return m_Chunks[index >> ChunkSizeLog2][index & chunkMask]; }
+
+    // Size management
+    uint64_t size() const { return m_Size; }
+    uint64_t capacity() const { return m_Chunks.size() * chunkSize; }
+    bool empty() const { return m_Size == 0; }
+
+    // Allocates the chunks required to store numElements, existing elements are not moved
+    void reserve(uint64_t numElements);
+
+    // Changes the number of elements, new elements are value initialized
+    void resize(uint64_t numElements);
+
+    // Releases all the elements and chunks
+    void clear();
+
+    // Releases the chunks that are not used by any element
+    void shrink_to_fit();
+
+private:
+    std::vector<std::unique_ptr<T[]>> m_Chunks;
+    uint64_t m_Size = 0;
+};
+
+#include "chunked_array.inl"
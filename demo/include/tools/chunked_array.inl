@@ -0,0 +1,43 @@
+template<typename T, uint32_t ChunkSizeLog2>
+void ChunkedArray<T, ChunkSizeLog2>::reserve(uint64_t numElements)
+{
+    // Only the table of chunks can be reallocated, the chunks themselves never move
+    uint64_t numChunks = (numElements + chunkMask) >> ChunkSizeLog2;
+    if (numChunks > m_Chunks.size())
+        m_Chunks.reserve(numChunks);
+    while (m_Chunks.size() < numChunks)
+        m_Chunks.push_back(std::unique_ptr<T[]>(new T[chunkSize]));
+}
+
+template<typename T, uint32_t ChunkSizeLog2>
+void ChunkedArray<T, ChunkSizeLog2>::resize(uint64_t numElements)
+{
+    // Grow by whole chunks
+    if (numElements > capacity())
+    {
+        uint64_t numChunks = (numElements + chunkMask) >> ChunkSizeLog2;
+        uint64_t growth = m_Chunks.size() + m_Chunks.size() / 2;
+        m_Chunks.reserve(numChunks > growth ? numChunks : growth);
+        reserve(numElements);
+    }
+
+    // Value initialize the new elements (like std::vector does)
+    for (uint64_t eleIdx = m_Size; eleIdx < numElements; ++eleIdx)
+        (*this)[eleIdx] = T();
+    m_Size = numElements;
+}
+
+template<typename T, uint32_t ChunkSizeLog2>
+void ChunkedArray<T, ChunkSizeLog2>::clear()
+{
+    m_Chunks.clear();
+    m_Size = 0;
+}
+
+template<typename T, uint32_t ChunkSizeLog2>
+void ChunkedArray<T, ChunkSizeLog2>::shrink_to_fit()
+{
+    uint64_t numChunks = (m_Size + chunkMask) >> ChunkSizeLog2;
+    m_Chunks.resize(numChunks);
+    m_Chunks.shrink_to_fit();
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// External includes
+#include <stdint.h>
+
+// Number of threads used by the parallel loops, the LEB3D_NUM_THREADS environment variable overrides the default (every logical core)
+uint32_t parallel_num_threads();
+
+// Overrides the number of threads of the parallel loops (0 restores the default)
+void set_parallel_num_threads(uint32_t numThreads);
@@ -23,4 +23,7 @@ namespace grid_volume
 
     // Import a packed mesh from disk
     void import_grid_volume(const char* path, GridVolume& gridVolume);
+
+    // Hash of the content of the grid, identifies the files derived from it
+    uint64_t hash_grid_volume(const GridVolume& gridVolume);
 }
\ No newline at end of file
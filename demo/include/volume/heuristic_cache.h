@@ -6,26 +6,121 @@
 // External includes
 #include <stdint.h>
 
+// Memory layout of the cells of a cache level
+enum class CacheLayout
+{
+	// x-major rows of cells
+	Linear = 0,
+	// x-major bricks of Morton ordered cells (the brick is the largest power of two that fits the level), so that neighboring cells stay close in memory
+	Morton,
+	// Morton ordered bricks of 4x4x4 cells that are only stored if they cover a non zero voxel
+	Sparse,
+	Count
+};
+
+// Storage of the moments of a cell
+enum class CachePrecision
+{
+	// float4 moments
+	Float32 = 0,
+	// half4 moments, half the footprint (the mean of the squares saturates to infinity above a density of 256)
+	Float16,
+	Count
+};
+
+// Read-only view of a memory-mapped file, unmapped when the owner is released or destroyed (move only)
+struct MappedFile
+{
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+	~MappedFile();
+
+	const char* view = nullptr;
+	uint64_t size = 0;
+};
+
 // Structure that allows us to evalute our heuristic
 struct HeuristicCache
 {
+	// Layout of the cells in every level
+	CacheLayout layout;
+	// Storage of the moments
+	CachePrecision precision;
 	// Number of levels in our cache
 	uint32_t numLevels;
-	// Top resolution of our grid (assume it's cubic texture, but doesn't have to be)
-	uint32_t resolution;
-	// Per level resolution of our grid
-	std::vector<uint32_t> resolutions;
-	// Per level offsets to access the heuristic cache
+	// Level read by the coarsest elements
+	uint32_t baseLevel;
+	// Resolution of the source grid, a cell of level l covers up to 2^(l + 1) voxels along every axis
+	uint3 gridResolution;
+	// Per level resolution of our grid (every axis is halved and rounded up)
+	std::vector<uint3> resolutions;
+	// Per level size of the Morton bricks (log2)
+	std::vector<uint32_t> brickSizesLog2;
+	// Per level offsets to access the heuristic cache (zero for the sparse layout)
 	std::vector<uint64_t> offsets;
-	// Global moment buffer
+	// Per level offsets in the brick table (sparse layout)
+	std::vector<uint64_t> brickOffsets;
+	// Slot of every brick in the moment buffer, all the empty bricks share the zero brick of slot 0 (sparse layout)
+	std::vector<uint32_t> brickTable;
+	// Global moment buffer (full precision)
 	std::vector<float4> momentArray;
+	// Global moment buffer (half precision), indexed like the full precision one
+	std::vector<half4> packedMomentArray;
+	// File of a cache imported from disk, its moment buffer is read in place from mappedMomentOffset (the moment arrays are left empty)
+	MappedFile mappedFile;
+	uint64_t mappedMomentOffset = 0;
+	uint64_t numMappedCells = 0;
+	// Summed-area tables of the density and squared density of the levels from summedFirstLevel (empty until built)
+	uint32_t summedFirstLevel = 0;
+	std::vector<uint64_t> summedOffsets;
+	std::vector<double2> summedArray;
 };
 
 namespace heuristic_cache
 {
 	// Build the cache
-	void build_heuristic_cache(const GridVolume& volume, HeuristicCache& cache);
+	void build_heuristic_cache(const GridVolume& volume, HeuristicCache& cache, CacheLayout layout = CacheLayout::Linear, CachePrecision precision = CachePrecision::Float32);
+
+	// Index of a cell of a given level in the moment buffer
+	uint64_t cell_index(const HeuristicCache& cache, uint32_t level, uint32_t x, uint32_t y, uint32_t z);
+
+	// Write the cache to disk, tagged with the hash of the grid it was built from
+	void export_heuristic_cache(const HeuristicCache& cache, uint64_t gridHash, const char* path);
+
+	// Memory-map a cache written by export_heuristic_cache, returns false if the file is missing, invalid or built from another grid
+	bool import_heuristic_cache(const char* path, uint64_t gridHash, HeuristicCache& cache);
+
+	// Unmap the file of an imported cache
+	void release_heuristic_cache(HeuristicCache& cache);
+
+	// Number of cells in the moment buffer
+	uint64_t num_cells(const HeuristicCache& cache);
+
+	// Moment buffer of the cache (full or half precision), in the memory-mapped file for an imported cache
+	const float4* moment_buffer(const HeuristicCache& cache);
+	const half4* packed_moment_buffer(const HeuristicCache& cache);
+
+	// Moments of a cell from its index in the moment buffer (decoded for the half precision storage)
+	float4 cell_moments(const HeuristicCache& cache, uint64_t cellIdx);
+
+	// Does the cell cover a non zero voxel (always true for the dense layouts)
+	bool cell_occupied(const HeuristicCache& cache, uint32_t level, uint32_t x, uint32_t y, uint32_t z);
+
+	// Level of the cache used to evaluate the elements of a given depth
+	uint32_t cache_level(const HeuristicCache& cache, uint32_t depth);
 
 	// Sample the cache
 	float4 sample_cache(const HeuristicCache& cache, const float3& position, uint32_t depth);
+
+	// Does the cell sampled at this position cover a non zero voxel (the empty cells never request a split unless the AABB of the element is evaluated)
+	bool sample_occupancy(const HeuristicCache& cache, const float3& position, uint32_t depth);
+
+	// Build the summed-area tables of the levels from firstLevel (the finer levels are answered at firstLevel)
+	void build_summed_area_tables(HeuristicCache& cache, uint32_t firstLevel = 0);
+
+	// Mean and variance of the voxels of the cells that overlap an axis aligned box, at the level read by a given depth (constant time, requires the summed-area tables)
+	float2 sample_box_statistics(const HeuristicCache& cache, const float3& boxMin, const float3& boxMax, uint32_t depth);
 }
\ No newline at end of file
@@ -4,17 +4,20 @@
 #include "math/types.h"
 
 // External includes
-#include <vector>
+#include <stdint.h>
 
+// Matrices of the nodes of the first levels of the LEB tree for every base type, the tables are generated at
+// compile time and live in read-only memory shared by all the instances, so constructing one is free
 class Leb3DCache
 {
 public:
     // Cst & Dst
     Leb3DCache();
     ~Leb3DCache();
-    const float4x4* get_cache() const{ return m_Cache.data(); }
 
-private:
-    uint32_t m_CacheDepth = 0;
-    std::vector<float4x4> m_Cache = {};
+    // Matrices of the cached nodes (type major, LEB_CACHE_MATRIX_COUNT matrices per base type)
+    const float4x4* get_cache() const;
+
+    // Type of the children of the cached nodes, indexed like the matrices
+    const uint8_t* get_types() const;
 };
@@ -8,20 +8,36 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
-
-// LEB cache size
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// LEB cache size (depth of the cached sub trees, the tables of Leb3DCache are generated at compile time for this depth)
+#ifndef LEB_CACHE_SIZE
 #define LEB_CACHE_SIZE 9
+#endif
 
-static uint32_t leb__FindMSB(uint64_t x)
-{
-    uint32_t depth = 0;
+// Number of matrices per base type in the cache
+#define LEB_CACHE_MATRIX_COUNT (2u << LEB_CACHE_SIZE)
 
-    while (x > 1u) {
-        ++depth;
-        x>>= 1u;
-    }
+// Number of types of tetrahedrons
+#define LEB_NUM_TYPES 4
+
+// Fixed point precision of the lattice weights (a node of depth d needs ceil(d / 3) bits, so 22 covers every 64 bit heapID)
+#define LEB_LATTICE_BITS 22
 
-    return depth;
+static uint32_t leb__FindMSB(uint64_t x)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    return _BitScanReverse64(&index, x) ? (uint32_t)index : 0u;
+#else
+    return x > 1u ? 63u - (uint32_t)__builtin_clzll(x) : 0u;
+#endif
 }
 
 static uint64_t leb__GetBitValue(const uint64_t bitField, int64_t bitID)
@@ -38,23 +54,11 @@ static void leb__IdentityMatrix4x4(float4x4& m)
 }
 
 
-/*******************************************************************************
- * TransposeMatrix4x4 -- Transposes a 4x4 matrix
- *
- */
-static void leb__TransposeMatrix4x4(const float4x4& m, float4x4& out)
-{
-    for (int64_t i = 0; i < 4; ++i)
-    for (int64_t j = 0; j < 4; ++j)
-        out.rc[i][j] = m.rc[j][i];
-}
-
-
 /*******************************************************************************
  * DotProduct -- Returns the dot product of two vectors
  *
  */
-static float leb__DotProduct(int64_t argSize, const float *x, const float *y)
+static constexpr float leb__DotProduct(int64_t argSize, const float *x, const float *y)
 {
     float dp = 0.0f;
 
@@ -66,86 +70,117 @@ static float leb__DotProduct(int64_t argSize, const float *x, const float *y)
 
 
 /*******************************************************************************
- * MulMatrix4x4 -- Computes the product of two 4x4 matrices
+ * MulMatrix4x4 -- Computes the product of two 4x4 matrices (row major arrays,
+ * usable in constant expressions)
  *
  */
+static constexpr void
+leb__Matrix4x4Product(
+    const float m1[16],
+    const float m2[16],
+    float out[16]
+) {
+    float tra[16] = {};
+    for (int64_t i = 0; i < 4; ++i)
+    for (int64_t j = 0; j < 4; ++j)
+        tra[i * 4 + j] = m2[j * 4 + i];
+
+    for (int64_t j = 0; j < 4; ++j)
+    for (int64_t i = 0; i < 4; ++i)
+        out[j * 4 + i] = leb__DotProduct(4, m1 + j * 4, tra + i * 4);
+}
+
 static void
 leb__Matrix4x4Product(
     const float4x4& m1,
     const float4x4& m2,
     float4x4& out
 ) {
-    float4x4 tra;
-    leb__TransposeMatrix4x4(m2, tra);
-
-    for (int64_t j = 0; j < 4; ++j)
-    for (int64_t i = 0; i < 4; ++i)
-        out.rc[j][i] = leb__DotProduct(4, m1.rc[j], tra.rc[i]);
+    leb__Matrix4x4Product(m1.m, m2.m, out.m);
 }
 
 
 /*******************************************************************************
- * SplittingMatrix -- Computes a LEB splitting matrix from a split bit
+ * SplittingCoefficients -- Computes the coefficients of a LEB splitting
+ * matrix from a split bit (row major)
  *
  */
-static void
-leb__SplittingMatrix(float4x4& matrix, uint64_t bitValue, uint8_t type)
+static constexpr void
+leb__SplittingCoefficients(uint64_t bitValue, uint8_t type, float splitMatrix[16])
 {
     float b = (float)bitValue;
     float c = 1.0f - b;
 
-    if (type == 0)
+    if (type == 0 || type == 3)
     {
-        const float4x4 splitMatrix = {
+        const float coefficients[16] = {
             0.0f, 1.0f, 0.0f, 0.0f,
             0.0f, 0.0f, 0.5f, 0.5f,
             b, 0.0f, c, 0.0,
             c, 0.0f, 0.0f, b
         };
-        float4x4 tmp;
-        memcpy(tmp.rc, matrix.rc, sizeof(tmp));
-        leb__Matrix4x4Product(splitMatrix, tmp, matrix);
-    }
-    if (type == 3)
-    {
-        const float4x4 splitMatrix = {
-            0.0f, 1.0f, 0.0f, 0.0f,
-            0.0f, 0.0f, 0.5f, 0.5f,
-            b, 0.0f, c, 0.0,
-            c, 0.0f, 0.0f, b
-        };
-        float4x4 tmp;
-        memcpy(tmp.rc, matrix.rc, sizeof(tmp));
-        leb__Matrix4x4Product(splitMatrix, tmp, matrix);
+        for (int64_t i = 0; i < 16; ++i)
+            splitMatrix[i] = coefficients[i];
     }
     else if (type == 1)
     {
-        const float4x4 splitMatrix = {
+        const float coefficients[16] = {
             b, c, 0.0f, 0.0f,
             0.0f, 0.0f, 0.5f, 0.5f,
             0.0f, 0.0f, c, b,
             c, b, 0.0f, 0.0f
         };
-
-        float4x4 tmp;
-        memcpy(tmp.rc, matrix.rc, sizeof(tmp));
-        leb__Matrix4x4Product(splitMatrix, tmp, matrix);
+        for (int64_t i = 0; i < 16; ++i)
+            splitMatrix[i] = coefficients[i];
     }
     else if (type == 2)
     {
-        const float4x4 splitMatrix = {
+        const float coefficients[16] = {
             c, b, 0.0f, 0.0f,
             0.0f, 0.0f, 0.5f, 0.5f,
             b, c, 0.0f, 0.0f,
             0.0f, 0.0f, c, b
         };
+        for (int64_t i = 0; i < 16; ++i)
+            splitMatrix[i] = coefficients[i];
+    }
+}
 
-        float4x4 tmp;
-        memcpy(tmp.rc, matrix.rc, sizeof(tmp));
-        leb__Matrix4x4Product(splitMatrix, tmp, matrix);
+
+/*******************************************************************************
+ * ChildType -- Type of the child of a node from its split bit
+ *
+ */
+static constexpr uint8_t
+leb__ChildType(uint8_t type, uint64_t bitValue)
+{
+    switch (type)
+    {
+    case 0:
+        return bitValue == 0 ? 1 : 2;
+    case 1:
+    case 2:
+        return 3;
+    default:
+        return 0;
     }
 }
 
+
+/*******************************************************************************
+ * SplittingMatrix -- Computes a LEB splitting matrix from a split bit
+ *
+ */
+static void
+leb__SplittingMatrix(float4x4& matrix, uint64_t bitValue, uint8_t type)
+{
+    float4x4 splitMatrix;
+    leb__SplittingCoefficients(bitValue, type, splitMatrix.m);
+    float4x4 tmp;
+    memcpy(tmp.rc, matrix.rc, sizeof(tmp));
+    leb__Matrix4x4Product(splitMatrix, tmp, matrix);
+}
+
 /*******************************************************************************
  * DecodeTransformationMatrix -- Computes the matrix associated to a LEB
  * node
@@ -162,48 +197,58 @@ leb__DecodeTransformationMatrix(
 
     for (int64_t bitID = depth - 1; bitID >= 0; --bitID) {
         uint64_t bitValue = leb__GetBitValue(heapID, bitID);
-        leb__SplittingMatrix(matrix, leb__GetBitValue(heapID, bitID), currentType);
-        switch (currentType)
-        {
-        case 0:
-            currentType = bitValue == 0 ? 1 : 2;
-            break;
-        case 1:
-        case 2:
-            currentType = 3;
-            break;
-        case 3:
-            currentType = 0;
-            break;
-        }
+        leb__SplittingMatrix(matrix, bitValue, currentType);
+        currentType = leb__ChildType(currentType, bitValue);
     }
 }
 
-static void leb__DecodeTransformationMatrix(uint64_t heapID, uint8_t, float4x4& matrix, const float4x4* matrixCache)
+/*******************************************************************************
+ * CacheIndices -- Splits a heapID into the indices of its cached matrices (the
+ * lowest bits come first), the indices are offset to the table of the type each
+ * chunk starts with. Returns the number of chunks.
+ *
+ */
+static uint32_t leb__CacheIndices(uint64_t heapID, uint8_t baseType, const uint8_t* typeCache, uint32_t indices[64 / LEB_CACHE_SIZE + 1])
 {
-    leb__IdentityMatrix4x4(matrix);
     const uint64_t msb = (1ULL << LEB_CACHE_SIZE);
     const uint64_t mask = ~(~0ULL << LEB_CACHE_SIZE);
-    uint64_t depth = leb__FindMSB(heapID);
-    uint32_t remainder = depth % LEB_CACHE_SIZE;
+    uint32_t remainder = leb__FindMSB(heapID) % LEB_CACHE_SIZE;
+    uint32_t numChunks = 0;
 
     // Align on the power
     if (remainder != 0)
     {
-        uint32_t index = (heapID & ((1ULL << remainder) - 1)) | (1ULL << remainder);
-        float4x4 tmp;
-        memcpy(tmp.rc, matrix.rc, sizeof(tmp));
-        leb__Matrix4x4Product(tmp, matrixCache[index], matrix);
+        indices[numChunks++] = uint32_t((heapID & ((1ULL << remainder) - 1)) | (1ULL << remainder));
         heapID >>= remainder;
     }
-
     while (heapID > mask)
     {
-        uint32_t index = uint32_t((heapID & mask) | msb);
+        indices[numChunks++] = uint32_t((heapID & mask) | msb);
+        heapID >>= LEB_CACHE_SIZE;
+    }
+
+    // The chunks are applied from the top of the tree, each one starts with the type the previous one ends with
+    uint8_t type = baseType;
+    for (uint32_t chunkIdx = numChunks; chunkIdx > 0; --chunkIdx)
+    {
+        const uint32_t index = type * LEB_CACHE_MATRIX_COUNT + indices[chunkIdx - 1];
+        type = typeCache[index];
+        indices[chunkIdx - 1] = index;
+    }
+    return numChunks;
+}
+
+static void leb__DecodeTransformationMatrix(uint64_t heapID, uint8_t baseType, float4x4& matrix, const float4x4* matrixCache, const uint8_t* typeCache)
+{
+    uint32_t indices[64 / LEB_CACHE_SIZE + 1];
+    const uint32_t numChunks = leb__CacheIndices(heapID, baseType, typeCache, indices);
+
+    leb__IdentityMatrix4x4(matrix);
+    for (uint32_t chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
+    {
         float4x4 tmp;
         memcpy(tmp.rc, matrix.rc, sizeof(tmp));
-        leb__Matrix4x4Product(tmp, matrixCache[index], matrix);
-        heapID >>= LEB_CACHE_SIZE;
+        leb__Matrix4x4Product(tmp, matrixCache[indices[chunkIdx]], matrix);
     }
 }
 
@@ -215,13 +260,14 @@ inline void leb_DecodeNodeAttributeArray(
     uint64_t heapID,
     uint8_t baseType,
     const float4x4* cache,
+    const uint8_t* typeCache,
     float4 attributeArray[3]
 ) {
     float4x4 m;
     float attributeVector[4];
 
     // Evaluate the global matrix
-    leb__DecodeTransformationMatrix(heapID, baseType, m, cache);
+    leb__DecodeTransformationMatrix(heapID, baseType, m, cache, typeCache);
 
     // Apply it to each dimension
     for (int64_t i = 0; i < 3; ++i)
@@ -254,4 +300,569 @@ inline void leb_DecodeNodeAttributeArray(
         attributeArray[i].z = leb__DotProduct(4, m.rc[2], attributeVector);
         attributeArray[i].w = leb__DotProduct(4, m.rc[3], attributeVector);
     }
-}
\ No newline at end of file
+}
+
+#if defined(__AVX2__)
+/*******************************************************************************
+ * LoadMatrices8 -- Load the cached matrices of 8 lanes, one register per
+ * coefficient (two 8x8 transposes of the rows of the matrices)
+ *
+ */
+static void leb__LoadMatrices8(const float4x4* cache, const uint32_t indices[8], __m256 matrix[16])
+{
+    for (uint32_t half = 0; half < 2; ++half)
+    {
+        __m256 rows[8];
+        for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+            rows[laneIdx] = _mm256_loadu_ps(&cache[indices[laneIdx]].rc[2 * half][0]);
+        const __m256 t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+        const __m256 t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+        const __m256 t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+        const __m256 t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+        const __m256 t4 = _mm256_unpacklo_ps(rows[4], rows[5]);
+        const __m256 t5 = _mm256_unpackhi_ps(rows[4], rows[5]);
+        const __m256 t6 = _mm256_unpacklo_ps(rows[6], rows[7]);
+        const __m256 t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+        const __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        const __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        const __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        const __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        const __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+        const __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+        const __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+        const __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256* coefficients = matrix + 8 * half;
+        coefficients[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+        coefficients[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+        coefficients[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+        coefficients[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+        coefficients[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+        coefficients[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+        coefficients[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+        coefficients[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+    }
+}
+
+/*******************************************************************************
+ * DecodeNodeAttributeArray8 -- Compute the attributes of 8 nodes of the same
+ * depth at once, the matrices are stored as one register per coefficient
+ *
+ */
+static void leb__DecodeNodeAttributeArray8(
+    const uint64_t heapIDs[8],
+    const uint8_t baseTypes[8],
+    const float4x4* cache,
+    const uint8_t* typeCache,
+    float4* attributeArrays[8]
+) {
+    // Indices of the cached matrices of every step (all the lanes share the depth, so they take the same steps)
+    uint32_t numSteps = 0;
+    uint32_t indices[64 / LEB_CACHE_SIZE + 1][8];
+    for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+    {
+        uint32_t laneIndices[64 / LEB_CACHE_SIZE + 1];
+        numSteps = leb__CacheIndices(heapIDs[laneIdx], baseTypes[laneIdx], typeCache, laneIndices);
+        for (uint32_t stepIdx = 0; stepIdx < numSteps; ++stepIdx)
+            indices[stepIdx][laneIdx] = laneIndices[stepIdx];
+    }
+
+    // The first step only reads its matrix (the cached matrices are non negative, so the product with the identity is exact)
+    __m256 matrix[16];
+    if (numSteps == 0)
+    {
+        for (uint32_t coeffIdx = 0; coeffIdx < 16; ++coeffIdx)
+            matrix[coeffIdx] = _mm256_set1_ps((coeffIdx % 5) == 0 ? 1.0f : 0.0f);
+    }
+    else
+        leb__LoadMatrices8(cache, indices[0], matrix);
+
+    // Then every step multiplies the matrix on the right, in the same order as leb__Matrix4x4Product
+    for (uint32_t stepIdx = 1; stepIdx < numSteps; ++stepIdx)
+    {
+        __m256 step[16];
+        leb__LoadMatrices8(cache, indices[stepIdx], step);
+
+        __m256 product[16];
+        for (uint32_t row = 0; row < 4; ++row)
+        {
+            for (uint32_t col = 0; col < 4; ++col)
+            {
+                __m256 dp = _mm256_mul_ps(matrix[row * 4], step[col]);
+                dp = _mm256_add_ps(dp, _mm256_mul_ps(matrix[row * 4 + 1], step[4 + col]));
+                dp = _mm256_add_ps(dp, _mm256_mul_ps(matrix[row * 4 + 2], step[8 + col]));
+                product[row * 4 + col] = _mm256_add_ps(dp, _mm256_mul_ps(matrix[row * 4 + 3], step[12 + col]));
+            }
+        }
+        memcpy(matrix, product, sizeof(matrix));
+    }
+
+    // Apply it to each dimension, in the same order as leb__DotProduct
+    alignas(32) float attributes[3][4][8];
+    for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+    {
+        for (uint32_t dim = 0; dim < 3; ++dim)
+        {
+            attributes[dim][0][laneIdx] = attributeArrays[laneIdx][dim].x;
+            attributes[dim][1][laneIdx] = attributeArrays[laneIdx][dim].y;
+            attributes[dim][2][laneIdx] = attributeArrays[laneIdx][dim].z;
+            attributes[dim][3][laneIdx] = attributeArrays[laneIdx][dim].w;
+        }
+    }
+    for (uint32_t dim = 0; dim < 3; ++dim)
+    {
+        __m256 vector[4];
+        for (uint32_t coord = 0; coord < 4; ++coord)
+            vector[coord] = _mm256_load_ps(attributes[dim][coord]);
+        for (uint32_t row = 0; row < 4; ++row)
+        {
+            __m256 dp = _mm256_add_ps(_mm256_setzero_ps(), _mm256_mul_ps(matrix[row * 4], vector[0]));
+            dp = _mm256_add_ps(dp, _mm256_mul_ps(matrix[row * 4 + 1], vector[1]));
+            dp = _mm256_add_ps(dp, _mm256_mul_ps(matrix[row * 4 + 2], vector[2]));
+            dp = _mm256_add_ps(dp, _mm256_mul_ps(matrix[row * 4 + 3], vector[3]));
+            _mm256_store_ps(attributes[dim][row], dp);
+        }
+    }
+    for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+    {
+        for (uint32_t dim = 0; dim < 3; ++dim)
+            attributeArrays[laneIdx][dim] = { attributes[dim][0][laneIdx], attributes[dim][1][laneIdx], attributes[dim][2][laneIdx], attributes[dim][3][laneIdx] };
+    }
+}
+#endif
+
+/*******************************************************************************
+ * DecodeNodeAttributeArrays -- Compute the triangle attributes of many nodes,
+ * same result as leb_DecodeNodeAttributeArray on each of them
+ *
+ */
+inline void leb_DecodeNodeAttributeArrays(
+    uint32_t numNodes,
+    const uint64_t* heapIDs,
+    const uint8_t* baseTypes,
+    const float4x4* cache,
+    const uint8_t* typeCache,
+    float4* attributeArrays
+) {
+#if defined(__AVX2__)
+    // Group the nodes by depth (counting sort), so that the 8 lanes of a batch take the same number of steps
+    uint32_t depthOffsets[65] = { 0 };
+    for (uint32_t nodeIdx = 0; nodeIdx < numNodes; ++nodeIdx)
+        depthOffsets[leb__FindMSB(heapIDs[nodeIdx]) + 1]++;
+    for (uint32_t depth = 0; depth < 64; ++depth)
+        depthOffsets[depth + 1] += depthOffsets[depth];
+    std::vector<uint32_t> sortedNodes(numNodes);
+    uint32_t depthCursors[64];
+    memcpy(depthCursors, depthOffsets, sizeof(depthCursors));
+    for (uint32_t nodeIdx = 0; nodeIdx < numNodes; ++nodeIdx)
+        sortedNodes[depthCursors[leb__FindMSB(heapIDs[nodeIdx])]++] = nodeIdx;
+
+    // Batches of 8 nodes of the same depth (the missing lanes replicate the last node and are not written)
+    float4 scratchArrays[8][3];
+    for (uint32_t depth = 0; depth < 64; ++depth)
+    {
+        for (uint32_t batchStart = depthOffsets[depth]; batchStart < depthOffsets[depth + 1]; batchStart += 8)
+        {
+            const uint32_t numLanes = depthOffsets[depth + 1] - batchStart < 8 ? depthOffsets[depth + 1] - batchStart : 8;
+            uint64_t batchHeapIDs[8];
+            uint8_t batchBaseTypes[8];
+            float4* batchAttributes[8];
+            for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+            {
+                const uint32_t nodeIdx = sortedNodes[batchStart + (laneIdx < numLanes ? laneIdx : numLanes - 1)];
+                batchHeapIDs[laneIdx] = heapIDs[nodeIdx];
+                batchBaseTypes[laneIdx] = baseTypes[nodeIdx];
+                batchAttributes[laneIdx] = attributeArrays + 3 * nodeIdx;
+                if (laneIdx >= numLanes)
+                {
+                    memcpy(scratchArrays[laneIdx], batchAttributes[laneIdx], sizeof(scratchArrays[laneIdx]));
+                    batchAttributes[laneIdx] = scratchArrays[laneIdx];
+                }
+            }
+            leb__DecodeNodeAttributeArray8(batchHeapIDs, batchBaseTypes, cache, typeCache, batchAttributes);
+        }
+    }
+#else
+    for (uint32_t nodeIdx = 0; nodeIdx < numNodes; ++nodeIdx)
+        leb_DecodeNodeAttributeArray(heapIDs[nodeIdx], baseTypes[nodeIdx], cache, typeCache, attributeArrays + 3 * nodeIdx);
+#endif
+}
+
+/*******************************************************************************
+ * LatticeVertex -- Weights of a vertex relative to the 4 vertices of its base
+ * tetrahedron. With AVX2 one register holds the 4 weights, otherwise two
+ * 32 bit weights are packed per word: the weights are below 2^23 and the sums
+ * are even, so adds and shifts never cross between the halves of a word.
+ *
+ */
+#if defined(__AVX2__)
+typedef __m128i leb__LatticeVertex;
+typedef __m128i leb__LatticeMask;
+
+static inline leb__LatticeVertex leb__LatticeBaseVertex(uint32_t baseIdx)
+{
+    alignas(16) uint32_t weights[4] = { 0, 0, 0, 0 };
+    weights[baseIdx] = 1u << LEB_LATTICE_BITS;
+    return _mm_load_si128((const __m128i*)weights);
+}
+
+static inline leb__LatticeMask leb__LatticeBitMask(uint64_t bitValue)
+{
+    return _mm_set1_epi32(-(int32_t)bitValue);
+}
+
+static inline leb__LatticeMask leb__LatticeMaskXor(const leb__LatticeMask& a, const leb__LatticeMask& b)
+{
+    return _mm_xor_si128(a, b);
+}
+
+static inline leb__LatticeVertex leb__LatticeMidpoint(const leb__LatticeVertex& a, const leb__LatticeVertex& b)
+{
+    return _mm_srli_epi32(_mm_add_epi32(a, b), 1);
+}
+
+// Returns x where the mask is set and y elsewhere
+static inline leb__LatticeVertex leb__LatticeSelect(const leb__LatticeMask& mask, const leb__LatticeVertex& x, const leb__LatticeVertex& y)
+{
+    return _mm_blendv_epi8(y, x, mask);
+}
+
+static inline void leb__LatticeUnpack(const leb__LatticeVertex& vertex, uint32_t weights[4])
+{
+    _mm_storeu_si128((__m128i*)weights, vertex);
+}
+#else
+struct leb__LatticeVertex
+{
+    uint64_t w01;
+    uint64_t w23;
+};
+typedef uint64_t leb__LatticeMask;
+
+static inline leb__LatticeVertex leb__LatticeBaseVertex(uint32_t baseIdx)
+{
+    const uint64_t weight = (1ULL << LEB_LATTICE_BITS) << (32 * (baseIdx & 1));
+    return { baseIdx < 2 ? weight : 0, baseIdx < 2 ? 0 : weight };
+}
+
+static inline leb__LatticeMask leb__LatticeBitMask(uint64_t bitValue)
+{
+    return 0ULL - bitValue;
+}
+
+static inline leb__LatticeMask leb__LatticeMaskXor(const leb__LatticeMask& a, const leb__LatticeMask& b)
+{
+    return a ^ b;
+}
+
+static inline leb__LatticeVertex leb__LatticeMidpoint(const leb__LatticeVertex& a, const leb__LatticeVertex& b)
+{
+    return { (a.w01 + b.w01) >> 1, (a.w23 + b.w23) >> 1 };
+}
+
+// Returns x where the mask is set and y elsewhere
+static inline leb__LatticeVertex leb__LatticeSelect(const leb__LatticeMask& mask, const leb__LatticeVertex& x, const leb__LatticeVertex& y)
+{
+    return { y.w01 ^ ((x.w01 ^ y.w01) & mask), y.w23 ^ ((x.w23 ^ y.w23) & mask) };
+}
+
+static inline void leb__LatticeUnpack(const leb__LatticeVertex& vertex, uint32_t weights[4])
+{
+    weights[0] = (uint32_t)vertex.w01;
+    weights[1] = (uint32_t)(vertex.w01 >> 32);
+    weights[2] = (uint32_t)vertex.w23;
+    weights[3] = (uint32_t)(vertex.w23 >> 32);
+}
+#endif
+
+/*******************************************************************************
+ * DecodeLatticeWeights -- Computes the weights of the vertices of a node
+ * relative to the vertices of its base tetrahedron, in fixed point with
+ * LEB_LATTICE_BITS fractional bits. Only adds, shifts and selects, the weights
+ * are exact.
+ *
+ * Every split keeps 3 vertices of the parent and adds the midpoint of the edge
+ * between the vertices 2 and 3 as the vertex 1 (same as the rows of the
+ * splitting matrices). The types 0 and 3 pick the same vertices, and the types
+ * repeat every 3 levels (0, 1 or 2, 3), so the only level that depends on the
+ * type is the one of type 1 or 2, whose type is given by the previous bit.
+ *
+ */
+static void leb__DecodeLatticeWeights(uint64_t heapID, uint8_t type, uint32_t weights[4][4])
+{
+    leb__LatticeVertex v0 = leb__LatticeBaseVertex(0);
+    leb__LatticeVertex v1 = leb__LatticeBaseVertex(1);
+    leb__LatticeVertex v2 = leb__LatticeBaseVertex(2);
+    leb__LatticeVertex v3 = leb__LatticeBaseVertex(3);
+
+    // Number of levels before the next one of type 1 or 2, and the bit that selects between them (set for the type 2)
+    uint32_t phase = type == 0 ? 1 : (type == 3 ? 2 : 0);
+    leb__LatticeMask previousMask = leb__LatticeBitMask(type == 2);
+
+    // Walk the bits from the root
+    uint64_t depth = leb__FindMSB(heapID);
+    for (int64_t bitID = depth - 1; bitID >= 0; --bitID)
+    {
+        const leb__LatticeMask mask = leb__LatticeBitMask(leb__GetBitValue(heapID, bitID));
+        const leb__LatticeVertex midpoint = leb__LatticeMidpoint(v2, v3);
+        leb__LatticeVertex child0, child2, child3;
+        if (phase == 0)
+        {
+            // Type 1: [v1, m, v2, v0] or [v0, m, v3, v1], type 2: [v0, m, v1, v2] or [v1, m, v0, v3]
+            child0 = leb__LatticeSelect(leb__LatticeMaskXor(previousMask, mask), v0, v1);
+            child2 = leb__LatticeSelect(previousMask, leb__LatticeSelect(mask, v0, v1), leb__LatticeSelect(mask, v3, v2));
+            child3 = leb__LatticeSelect(previousMask, leb__LatticeSelect(mask, v3, v2), leb__LatticeSelect(mask, v1, v0));
+            phase = 2;
+        }
+        else
+        {
+            // Types 0 and 3: [v1, m, v2, v0] or [v1, m, v0, v3]
+            child0 = v1;
+            child2 = leb__LatticeSelect(mask, v0, v2);
+            child3 = leb__LatticeSelect(mask, v3, v0);
+            phase--;
+        }
+        v0 = child0;
+        v1 = midpoint;
+        v2 = child2;
+        v3 = child3;
+        previousMask = mask;
+    }
+
+    // Unpack the weights
+    leb__LatticeUnpack(v0, weights[0]);
+    leb__LatticeUnpack(v1, weights[1]);
+    leb__LatticeUnpack(v2, weights[2]);
+    leb__LatticeUnpack(v3, weights[3]);
+}
+
+/*******************************************************************************
+ * ApplyLatticeWeights -- Compute the attributes of the vertices of a node from
+ * the attributes of the base vertices (the products are exact in double, so the
+ * attributes are only rounded once and both paths round the same way)
+ *
+ */
+static void leb__ApplyLatticeWeights(const uint32_t weights[4][4], float4 attributeArray[3])
+{
+    const double scale = 1.0 / (double)(1u << LEB_LATTICE_BITS);
+#if defined(__AVX2__)
+    __m256d columns[4];
+    for (uint32_t baseIdx = 0; baseIdx < 4; ++baseIdx)
+        columns[baseIdx] = _mm256_cvtepi32_pd(_mm_setr_epi32((int32_t)weights[0][baseIdx], (int32_t)weights[1][baseIdx], (int32_t)weights[2][baseIdx], (int32_t)weights[3][baseIdx]));
+    for (int64_t i = 0; i < 3; ++i)
+    {
+        __m256d result = _mm256_mul_pd(columns[0], _mm256_set1_pd(attributeArray[i].x));
+        result = _mm256_add_pd(result, _mm256_mul_pd(columns[1], _mm256_set1_pd(attributeArray[i].y)));
+        result = _mm256_add_pd(result, _mm256_mul_pd(columns[2], _mm256_set1_pd(attributeArray[i].z)));
+        result = _mm256_add_pd(result, _mm256_mul_pd(columns[3], _mm256_set1_pd(attributeArray[i].w)));
+        _mm_storeu_ps(&attributeArray[i].x, _mm256_cvtpd_ps(_mm256_mul_pd(result, _mm256_set1_pd(scale))));
+    }
+#else
+    for (int64_t i = 0; i < 3; ++i)
+    {
+        const double attributeVector[4] = { attributeArray[i].x, attributeArray[i].y, attributeArray[i].z, attributeArray[i].w };
+        float result[4];
+        for (uint32_t vertexIdx = 0; vertexIdx < 4; ++vertexIdx)
+        {
+            const uint32_t* w = weights[vertexIdx];
+            result[vertexIdx] = (float)((w[0] * attributeVector[0] + w[1] * attributeVector[1] + w[2] * attributeVector[2] + w[3] * attributeVector[3]) * scale);
+        }
+        attributeArray[i] = { result[0], result[1], result[2], result[3] };
+    }
+#endif
+}
+
+/*******************************************************************************
+ * DecodeNodeAttributeArrayLattice -- Compute the triangle attributes at the
+ * input node from its lattice weights (matrix free)
+ *
+ */
+inline void leb_DecodeNodeAttributeArrayLattice(
+    uint64_t heapID,
+    uint8_t baseType,
+    float4 attributeArray[3]
+) {
+    uint32_t weights[4][4];
+    leb__DecodeLatticeWeights(heapID, baseType, weights);
+    leb__ApplyLatticeWeights(weights, attributeArray);
+}
+
+#if defined(__AVX2__)
+/*******************************************************************************
+ * DecodeLatticeWeights8 -- Computes the lattice weights of 8 nodes of the same
+ * depth and base type at once, one lane per node (same steps as
+ * leb__DecodeLatticeWeights, the nodes share the type of every level)
+ *
+ */
+static void leb__DecodeLatticeWeights8(const uint64_t heapIDs[8], uint8_t type, uint32_t weights[4][4][8])
+{
+    // Split the heapIDs in 32 bit words
+    alignas(32) uint32_t lowWords[8];
+    alignas(32) uint32_t highWords[8];
+    for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+    {
+        lowWords[laneIdx] = (uint32_t)heapIDs[laneIdx];
+        highWords[laneIdx] = (uint32_t)(heapIDs[laneIdx] >> 32);
+    }
+    const int64_t depth = (int64_t)leb__FindMSB(heapIDs[0]);
+
+    // The weights of a base vertex only depend on the weights of the same base vertex, each of them is decoded on its own to keep its 4 registers
+    for (uint32_t baseIdx = 0; baseIdx < 4; ++baseIdx)
+    {
+        __m256i v0 = _mm256_set1_epi32(baseIdx == 0 ? (1 << LEB_LATTICE_BITS) : 0);
+        __m256i v1 = _mm256_set1_epi32(baseIdx == 1 ? (1 << LEB_LATTICE_BITS) : 0);
+        __m256i v2 = _mm256_set1_epi32(baseIdx == 2 ? (1 << LEB_LATTICE_BITS) : 0);
+        __m256i v3 = _mm256_set1_epi32(baseIdx == 3 ? (1 << LEB_LATTICE_BITS) : 0);
+
+        // Number of levels before the next one of type 1 or 2, and the bit that selects between them (set for the type 2)
+        uint32_t phase = type == 0 ? 1 : (type == 3 ? 2 : 0);
+        __m256i previousMask = _mm256_set1_epi32(type == 2 ? -1 : 0);
+
+        // The bit of the current level is kept in the sign bit
+        int64_t bitID = depth - 1;
+        __m256i bits = bitID >= 32 ? _mm256_sll_epi32(_mm256_load_si256((const __m256i*)highWords), _mm_cvtsi32_si128((int32_t)(63 - bitID)))
+            : _mm256_sll_epi32(_mm256_load_si256((const __m256i*)lowWords), _mm_cvtsi32_si128((int32_t)(31 - bitID)));
+
+        // Walk the bits from the root
+        for (; bitID >= 0; --bitID)
+        {
+            if (bitID == 31)
+                bits = _mm256_load_si256((const __m256i*)lowWords);
+            const __m256i mask = _mm256_srai_epi32(bits, 31);
+            bits = _mm256_slli_epi32(bits, 1);
+
+            const __m256i midpoint = _mm256_srli_epi32(_mm256_add_epi32(v2, v3), 1);
+            __m256i child0, child2, child3;
+            if (phase == 0)
+            {
+                // Type 1: [v1, m, v2, v0] or [v0, m, v3, v1], type 2: [v0, m, v1, v2] or [v1, m, v0, v3]
+                child0 = _mm256_blendv_epi8(v1, v0, _mm256_xor_si256(previousMask, mask));
+                child2 = _mm256_blendv_epi8(_mm256_blendv_epi8(v2, v3, mask), _mm256_blendv_epi8(v1, v0, mask), previousMask);
+                child3 = _mm256_blendv_epi8(_mm256_blendv_epi8(v0, v1, mask), _mm256_blendv_epi8(v2, v3, mask), previousMask);
+                phase = 2;
+            }
+            else
+            {
+                // Types 0 and 3: [v1, m, v2, v0] or [v1, m, v0, v3]
+                child0 = v1;
+                child2 = _mm256_blendv_epi8(v2, v0, mask);
+                child3 = _mm256_blendv_epi8(v0, v3, mask);
+                phase--;
+            }
+            v0 = child0;
+            v1 = midpoint;
+            v2 = child2;
+            v3 = child3;
+            previousMask = mask;
+        }
+
+        _mm256_storeu_si256((__m256i*)weights[0][baseIdx], v0);
+        _mm256_storeu_si256((__m256i*)weights[1][baseIdx], v1);
+        _mm256_storeu_si256((__m256i*)weights[2][baseIdx], v2);
+        _mm256_storeu_si256((__m256i*)weights[3][baseIdx], v3);
+    }
+}
+
+/*******************************************************************************
+ * ApplyLatticeWeights8 -- Same as leb__ApplyLatticeWeights on 8 nodes at once,
+ * one lane per node (in double, each register covers 4 of the lanes)
+ *
+ */
+static void leb__ApplyLatticeWeights8(const uint32_t weights[4][4][8], float4* attributeArrays[8])
+{
+    // Transpose the attributes of the base vertices
+    alignas(32) double attributes[3][4][8];
+    for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+    {
+        for (uint32_t dim = 0; dim < 3; ++dim)
+        {
+            attributes[dim][0][laneIdx] = attributeArrays[laneIdx][dim].x;
+            attributes[dim][1][laneIdx] = attributeArrays[laneIdx][dim].y;
+            attributes[dim][2][laneIdx] = attributeArrays[laneIdx][dim].z;
+            attributes[dim][3][laneIdx] = attributeArrays[laneIdx][dim].w;
+        }
+    }
+
+    // Sum the weighted attributes in the same order as leb__ApplyLatticeWeights
+    const __m256d scale = _mm256_set1_pd(1.0 / (double)(1u << LEB_LATTICE_BITS));
+    alignas(32) float results[3][4][8];
+    for (uint32_t half = 0; half < 2; ++half)
+    {
+        for (uint32_t vertexIdx = 0; vertexIdx < 4; ++vertexIdx)
+        {
+            __m256d columns[4];
+            for (uint32_t baseIdx = 0; baseIdx < 4; ++baseIdx)
+                columns[baseIdx] = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(weights[vertexIdx][baseIdx] + 4 * half)));
+            for (uint32_t dim = 0; dim < 3; ++dim)
+            {
+                __m256d result = _mm256_mul_pd(columns[0], _mm256_load_pd(attributes[dim][0] + 4 * half));
+                result = _mm256_add_pd(result, _mm256_mul_pd(columns[1], _mm256_load_pd(attributes[dim][1] + 4 * half)));
+                result = _mm256_add_pd(result, _mm256_mul_pd(columns[2], _mm256_load_pd(attributes[dim][2] + 4 * half)));
+                result = _mm256_add_pd(result, _mm256_mul_pd(columns[3], _mm256_load_pd(attributes[dim][3] + 4 * half)));
+                _mm_store_ps(results[dim][vertexIdx] + 4 * half, _mm256_cvtpd_ps(_mm256_mul_pd(result, scale)));
+            }
+        }
+    }
+    for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+    {
+        for (uint32_t dim = 0; dim < 3; ++dim)
+            attributeArrays[laneIdx][dim] = { results[dim][0][laneIdx], results[dim][1][laneIdx], results[dim][2][laneIdx], results[dim][3][laneIdx] };
+    }
+}
+#endif
+
+/*******************************************************************************
+ * DecodeNodeAttributeArraysLattice -- Compute the triangle attributes of many
+ * nodes from their lattice weights, same result as
+ * leb_DecodeNodeAttributeArrayLattice on each of them
+ *
+ */
+inline void leb_DecodeNodeAttributeArraysLattice(
+    uint32_t numNodes,
+    const uint64_t* heapIDs,
+    const uint8_t* baseTypes,
+    float4* attributeArrays
+) {
+#if defined(__AVX2__)
+    // Group the nodes by depth and base type (counting sort), so that the 8 lanes of a batch take the same steps
+    const uint32_t numKeys = 64 * LEB_NUM_TYPES;
+    uint32_t keyOffsets[numKeys + 1] = { 0 };
+    for (uint32_t nodeIdx = 0; nodeIdx < numNodes; ++nodeIdx)
+        keyOffsets[leb__FindMSB(heapIDs[nodeIdx]) * LEB_NUM_TYPES + baseTypes[nodeIdx] + 1]++;
+    for (uint32_t key = 0; key < numKeys; ++key)
+        keyOffsets[key + 1] += keyOffsets[key];
+    std::vector<uint32_t> sortedNodes(numNodes);
+    uint32_t keyCursors[numKeys];
+    memcpy(keyCursors, keyOffsets, sizeof(keyCursors));
+    for (uint32_t nodeIdx = 0; nodeIdx < numNodes; ++nodeIdx)
+        sortedNodes[keyCursors[leb__FindMSB(heapIDs[nodeIdx]) * LEB_NUM_TYPES + baseTypes[nodeIdx]]++] = nodeIdx;
+
+    // Batches of 8 nodes of the same key (the missing lanes replicate the last node and are not written)
+    float4 scratchArrays[8][3];
+    for (uint32_t key = 0; key < numKeys; ++key)
+    {
+        for (uint32_t batchStart = keyOffsets[key]; batchStart < keyOffsets[key + 1]; batchStart += 8)
+        {
+            const uint32_t numLanes = keyOffsets[key + 1] - batchStart < 8 ? keyOffsets[key + 1] - batchStart : 8;
+            uint64_t batchHeapIDs[8];
+            float4* batchAttributes[8];
+            for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+            {
+                const uint32_t nodeIdx = sortedNodes[batchStart + (laneIdx < numLanes ? laneIdx : numLanes - 1)];
+                batchHeapIDs[laneIdx] = heapIDs[nodeIdx];
+                batchAttributes[laneIdx] = attributeArrays + 3 * nodeIdx;
+                if (laneIdx >= numLanes)
+                {
+                    memcpy(scratchArrays[laneIdx], batchAttributes[laneIdx], sizeof(scratchArrays[laneIdx]));
+                    batchAttributes[laneIdx] = scratchArrays[laneIdx];
+                }
+            }
+            uint32_t batchWeights[4][4][8];
+            leb__DecodeLatticeWeights8(batchHeapIDs, (uint8_t)(key % LEB_NUM_TYPES), batchWeights);
+            leb__ApplyLatticeWeights8(batchWeights, batchAttributes);
+        }
+    }
+#else
+    for (uint32_t nodeIdx = 0; nodeIdx < numNodes; ++nodeIdx)
+        leb_DecodeNodeAttributeArrayLattice(heapIDs[nodeIdx], baseTypes[nodeIdx], attributeArrays + 3 * nodeIdx);
+#endif
+}
@@ -3,6 +3,7 @@
 // Internal includes
 #include "math/types.h"
 #include "volume/leb_3d_cache.h"
+#include "tools/chunked_array.h"
 
 // External includes
 #include <stdint.h>
@@ -19,6 +20,13 @@ struct Diamond
     uint32_t size;
 };
 
+// Elements that share the same bisection edge
+struct DiamondRecord
+{
+    uint32_t members[8];
+    uint32_t numMembers;
+};
+
 struct Tetrahedron
 {
     float3 p[4];
@@ -32,24 +40,42 @@ struct LEBVolume
     // Minimal depth of the mesh
     uint32_t minimalDepth = 0;
 
-    // Bisector
-    std::vector<uint64_t> heapIDArray;
-    std::vector<uint8_t> typeArray;
-    std::vector<uint4> neighborsArray;
+    // Bisector (chunked so that the elements never move when the volume grows)
+    ChunkedArray<uint64_t> heapIDArray;
+    ChunkedArray<uint8_t> typeArray;
+    ChunkedArray<uint4> neighborsArray;
 
     // Base attributes
     std::vector<float3> basePoints;
     std::vector<uint8_t> baseTypes;
 
     // Used for subdivision
-    std::vector<Tetrahedron> tetraCacheArray;
-    std::vector<uint8_t> modifArray;
-    std::vector<uint8_t> depthArray;
+    ChunkedArray<Tetrahedron> tetraCacheArray;
+    ChunkedArray<uint8_t> modifArray;
+    ChunkedArray<uint8_t> depthArray;
+
+    // Diamond of every element, maintained by the fitting so that complete diamonds are found without walking their ring
+    ChunkedArray<uint32_t> diamondIDArray;
+    ChunkedArray<DiamondRecord> diamondTable;
+    // Released records of the diamond table, reused by the next diamonds
+    std::vector<uint32_t> freeDiamondIDs;
 
     // Debug Attribute to track diamond splits
     std::vector<Diamond> diamonds;
 };
 
+// Storage of the positions in the exported file
+enum class PositionEncoding
+{
+    // 4 float3 per tetrahedron
+    Float32 = 0,
+    // 4 lattice positions per tetrahedron
+    Lattice,
+    // Lattice positions of the unique vertices and 4 vertex indices per tetrahedron
+    IndexedLattice,
+    Count
+};
+
 struct FittingParameters
 {
     // Should we fit using a frustum?
@@ -71,6 +97,50 @@ struct FittingParameters
     float ratioThreshold = 2.0f;
     float minThreshold = 5.0f;
     float pixelSize = 5.0f;
+
+    // Coefficient of variation (standard deviation over mean) of the densities in the AABB of an element above which it is split,
+    // even if the cell at its center passes the heuristic. Requires the summed-area tables of the cache (0 disables the test).
+    float varianceThreshold = 0.0f;
+
+    // Maximal subdivision depth (0 means it is derived from the grid resolution)
+    uint32_t maxDepth = 0;
+
+    // Budget of the fitting (0 means unbounded), when set the elements with the largest heuristic error are split first
+    uint64_t maxElements = 0;
+    uint64_t maxBytes = 0;
+
+    // Encoding of the positions in the exported file, used to evaluate the byte budget
+    PositionEncoding positionEncoding = PositionEncoding::Float32;
+};
+
+// Defects found by validate_cubic_volume, all the counters are zero for a valid volume
+struct VolumeValidation
+{
+    // Number of allocated elements
+    uint64_t numElements = 0;
+
+    // Elements too deep for the vertex lattice of the checks, the volume isn't checked (and is invalid) if there are any
+    uint64_t deepElements = 0;
+
+    // Stored neighbors that are missing, unallocated or that don't share the face
+    uint64_t mismatchedNeighbors = 0;
+    // Neighbors that don't point back through the shared face
+    uint64_t asymmetricNeighbors = 0;
+
+    // Faces inside of the cube that belong to a single element
+    uint64_t openFaces = 0;
+    // Faces that belong to more than two elements (or to two on the boundary of the cube)
+    uint64_t overSharedFaces = 0;
+
+    // Elements of a diamond (same bisection edge) that have a different type, depth or diamond than the other members
+    uint64_t inconsistentDiamonds = 0;
+
+    // Elements that are flat or not oriented like their base tetrahedron
+    uint64_t invertedElements = 0;
+
+    // Sum of the volumes of the elements over the volume of the cube, and is it exactly the volume of the cube
+    double volumeRatio = 0.0;
+    bool tilesCube = false;
 };
 
 namespace leb_volume
@@ -78,13 +148,26 @@ namespace leb_volume
     // Creates the base leb structure for a cube
     void create_type0_cube(LEBVolume& lebVolume);
 
+    // Reserve the storage of numElements elements, allocated elements are never moved
+    void reserve_elements(LEBVolume& lebVolume, uint64_t numElements);
+
+    // Number of elements that can be allocated without allocating new chunks
+    uint64_t element_capacity(const LEBVolume& lebVolume);
+
     // Function that will, for every element, evaluate the 4 vertices of each tetrahedron
     void evaluate_positions(const LEBVolume& lebVolume, std::vector<float3>& vertices);
 
     // Function that returns if two types are equivalent
     bool equivalent_types(uint8_t type0, uint8_t type1);
 
-    // Evaluate tetrahedron postion
+    // Evaluate tetrahedron postion on the integer lattice of the base tetrahedron
     void evaluate_tetrahedron(uint64_t heapID, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes, Tetrahedron& tetra);
+    void evaluate_tetrahedra(uint32_t numElements, const uint64_t* heapIDs, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes, Tetrahedron* tetras);
+
+    // Evaluate tetrahedron postion through the cached splitting matrices
     void evaluate_tetrahedron(uint64_t heapID, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes, const Leb3DCache& cache, Tetrahedron& tetra);
+    void evaluate_tetrahedra(uint32_t numElements, const uint64_t* heapIDs, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes, const Leb3DCache& cache, Tetrahedron* tetras);
+
+    // Validate a volume subdivided from create_type0_cube, returns if no defect was found
+    bool validate_cubic_volume(const LEBVolume& volume, VolumeValidation& validation);
 }
\ No newline at end of file
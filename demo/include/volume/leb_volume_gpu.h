@@ -8,6 +8,23 @@
 // External includes
 #include <vector>
 
+// Number of bits of every axis of a lattice position (3 axes packed in a uint64_t)
+#define LATTICE_POSITION_BITS 21
+
+// Positions encoded on the dyadic lattice of the volume
+struct PackedPositions
+{
+    // Encoding of the positions (Float32 if they could not be encoded)
+    PositionEncoding encoding = PositionEncoding::Float32;
+    // Origin of the lattice and distance between two lattice points (power of two)
+    float3 origin = { 0.0, 0.0, 0.0 };
+    float step = 0.0f;
+    // Lattice positions, per tetrahedron vertex or per unique vertex
+    std::vector<uint64_t> latticeArray;
+    // Per tetrahedron vertex index in the lattice positions (indexed encoding)
+    std::vector<uint32_t> indexArray;
+};
+
 struct TetraData
 {
     // 4 Compressed plane equations (faces 0 -> 3)
@@ -33,6 +50,7 @@ struct LEBVolumeGPU
 	std::vector<TetraData> tetraData;
     std::vector<float3> centerArray;
     std::vector<float> densityArray;
+    std::vector<uint64_t> heapIDArray;
 
     // Outside interface data
     std::vector<uint3> rtasIndexArray;
@@ -51,6 +69,12 @@ namespace leb_volume
     // Import a packed mesh from disk
     void import_leb_volume_gpu(const char* path, LEBVolumeGPU& lebVolumeGPU);
 
-    // Export a packed mesh to disk
-    void export_leb_volume_gpu(const LEBVolumeGPU& lebVolumeGPU, const char* path);
+    // Export a packed mesh to disk, the positions are written with the requested encoding if they all are on the lattice (float otherwise)
+    void export_leb_volume_gpu(const LEBVolumeGPU& lebVolumeGPU, const char* path, PositionEncoding positionEncoding = PositionEncoding::Float32);
+
+    // Encode the positions on the lattice, returns false (and leaves the encoding to Float32) if a position can't be represented exactly
+    bool encode_positions(const std::vector<float3>& positionArray, PositionEncoding encoding, PackedPositions& packedPositions);
+
+    // Decode the positions of the tetrahedrons, same values as the encoded ones
+    void decode_positions(const PackedPositions& packedPositions, std::vector<float3>& positionArray);
 }
\ No newline at end of file
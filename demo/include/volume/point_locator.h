@@ -0,0 +1,43 @@
+#pragma once
+
+// Internal includes
+#include "math/types.h"
+#include "volume/leb_volume.h"
+
+// External includes
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+// Structure that finds the element that contains a point by descending the LEB tree from the base tetrahedrons
+struct PointLocator
+{
+    // Depth of the base tetrahedrons
+    uint32_t minimalDepth = 0;
+    // Depth of the shallowest element, the elements are only looked for from there
+    uint32_t shallowestDepth = 0;
+    // Depth of the deepest element, the descent stops there
+    uint32_t maximalDepth = 0;
+    // Vertices and types of the base tetrahedrons
+    std::vector<float3> basePoints;
+    std::vector<uint8_t> baseTypes;
+    // Inward plane equations of the faces of the base tetrahedrons
+    std::vector<double4> basePlanes;
+    // Element of every heapID of the volume
+    std::unordered_map<uint64_t, uint32_t> elementMap;
+};
+
+namespace point_locator
+{
+    // Build the locator of a volume
+    void build_point_locator(const LEBVolume& lebVolume, PointLocator& locator);
+
+    // Build the locator from the heapIDs of a volume subdivided from create_type0_cube (for the volumes that don't keep their base tetrahedrons)
+    void build_point_locator(uint32_t numElements, const uint64_t* heapIDs, PointLocator& locator);
+
+    // Element that contains a position (in the space of the base tetrahedrons), UINT32_MAX if it's outside of the volume
+    uint32_t locate_point(const PointLocator& locator, const float3& position);
+
+    // Locate a batch of positions (in parallel)
+    void locate_points(const PointLocator& locator, uint32_t numPositions, const float3* positions, uint32_t* elements);
+}
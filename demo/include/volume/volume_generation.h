@@ -4,6 +4,36 @@
 #include "volume/leb_volume.h"
 #include "volume/grid_volume.h"
 #include "volume/heuristic_cache.h"
+#include "rendering/frustum.h"
+
+// Prediction of the output of a fitting, evaluated from the heuristic cache only
+struct FittingEstimate
+{
+    // Maximal subdivision depth used by the fitting
+    uint32_t maxDepth = 0;
+
+    // Number of tetrahedrons and of faces on the boundary of the volume, including a calibrated model of the splits that keep the mesh conforming
+    uint64_t numElements = 0;
+    uint64_t numOutsideFaces = 0;
+
+    // Memory required by the LEBVolume during the fitting
+    uint64_t cpuSize = 0;
+
+    // Size of the exported LEBVolumeGPU and compressed size (as reported by convert_to_leb_volume_to_gpu)
+    uint64_t gpuSize = 0;
+    uint64_t compressedSize = 0;
+};
+
+// Subdivision decisions that differ between two caches of the same grid
+struct DecisionFlips
+{
+    // Number of evaluated elements
+    uint64_t numElements = 0;
+
+    // Elements split by the reference cache only, and by the tested cache only
+    uint64_t numLostSplits = 0;
+    uint64_t numExtraSplits = 0;
+};
 
 namespace leb_volume
 {
@@ -13,6 +43,27 @@ namespace leb_volume
     // Get the means in the tetrahedron
     float mean_density_element(const GridVolume& gridVolume, uint32_t depth, const Tetrahedron& tetra);
 
+    // Evaluate if an element should be subdivided
+    bool should_subdivide_element(const LEBVolume& volume, uint32_t eleIdx, uint32_t depth, const GridVolume& gridVolume, const HeuristicCache& gridCache, const FittingParameters& fittingParams, const Frustum& frustum);
+
+    // Evaluate up to 8 elements at once (AVX2 when available), returns the mask of the ones that should be subdivided
+    uint32_t should_subdivide_elements(const LEBVolume& volume, const uint32_t* elements, uint32_t numElements, const GridVolume& gridVolume, const HeuristicCache& gridCache, const FittingParameters& fittingParams, const Frustum& frustum);
+
+    // Validation of a lossy cache (e.g. half precision) against a reference one, counts the elements of the volume whose subdivision decision flips
+    DecisionFlips compare_cache_decisions(const LEBVolume& volume, const GridVolume& gridVolume, const HeuristicCache& referenceCache, const HeuristicCache& testedCache, const FittingParameters& fittingParams);
+
     // Fit volume to grid
     uint32_t fit_volume_to_grid(LEBVolume& lebVolume, const GridVolume& gridVolume, const HeuristicCache& heuristicCache, const FittingParameters& parameters);
+
+    // Collapse the diamonds whose parents pass the heuristic, returns the number of merged diamonds
+    uint32_t coarsen_volume(LEBVolume& lebVolume, const GridVolume& gridVolume, const HeuristicCache& heuristicCache, const FittingParameters& parameters);
+
+    // Maximal subdivision depth for a given grid resolution
+    uint32_t evaluate_max_depth(const uint3& gridResolution, const FittingParameters& parameters);
+
+    // Upper bound of the size of an exported LEBVolumeGPU, for positions written with the given encoding
+    uint64_t evaluate_export_size(uint64_t numElements, uint64_t numOutsideFaces, PositionEncoding positionEncoding);
+
+    // Predict the element count and sizes of a fitting without running it (frustum and pixel culling and the box statistics test are ignored)
+    FittingEstimate estimate_fitting(const HeuristicCache& heuristicCache, const FittingParameters& parameters);
 }
\ No newline at end of file
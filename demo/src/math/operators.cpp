@@ -3,6 +3,7 @@
 
 // System includes
 #include <algorithm>
+#include <string.h>
 
 template <typename IT, typename OT>
 OT sign(IT value) {
@@ -961,4 +962,71 @@ int32_t round_up_power2(uint32_t v)
     v |= v >> 16;
     v++;
     return v;
-}
\ No newline at end of file
+}
+
+uint16_t float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    const uint32_t absBits = bits & 0x7fffffff;
+
+    // NaNs stay quiet NaNs
+    if (absBits > 0x7f800000)
+        return sign | 0x7e00 | (uint16_t)((absBits >> 13) & 0x3ff);
+
+    // Everything that rounds above 65504 becomes an infinity
+    if (absBits >= 0x477ff000)
+        return sign | 0x7c00;
+
+    // Normal halfs, rebias the exponent and round the mantissa (a carry moves to the exponent)
+    if (absBits >= 0x38800000)
+    {
+        uint32_t half = (absBits - 0x38000000) >> 13;
+        const uint32_t remainder = absBits & 0x1fff;
+        if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+            half++;
+        return sign | (uint16_t)half;
+    }
+
+    // Subnormal halfs, the value is a multiple of 2^-24
+    const uint32_t exponent = absBits >> 23;
+    if (exponent < 102)
+        return sign;
+    const uint32_t mantissa = (absBits & 0x7fffff) | 0x800000;
+    const uint32_t shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+        half++;
+    return sign | (uint16_t)half;
+}
+
+float half_to_float(uint16_t value)
+{
+    const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    const uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa != 0 ? 0x400000 | (mantissa << 13) : 0);
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else
+    {
+        // Normalize the subnormal halfs
+        uint32_t floatExponent = 113;
+        while ((mantissa & 0x400) == 0)
+        {
+            mantissa <<= 1;
+            floatExponent--;
+        }
+        bits = sign | (floatExponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
@@ -141,6 +141,11 @@ void LEBRenderer::load_geometry(const std::string& filePath)
     // Build the morton codes
     build_morton_cache();
 
+    // Build the point locator (the older files don't have the heapIDs)
+    m_PointLocator = PointLocator();
+    if (m_Volume.heapIDArray.size() == m_NumTetrahedron)
+        point_locator::build_point_locator(m_NumTetrahedron, m_Volume.heapIDArray.data(), m_PointLocator);
+
     // Create the runtime buffers
     if (m_SplitBuffer)
     {
@@ -326,8 +331,10 @@ void LEBRenderer::upload_constant_buffers(CommandBuffer cmdB, const float3& came
     lebCB._NumTetrahedrons = (uint32_t)m_Volume.densityArray.size();
     lebCB._LEBScale = rcp(m_Volume.scale);
 
-    // Initial primitive for our search
-    uint32_t initialPrimitive = m_MortonCache.get_closest_element(cameraPosition * lebCB._LEBScale);
+    // Initial primitive for our search, found by descending the LEB tree (the closest element when the camera is outside or the heapIDs are missing)
+    uint32_t initialPrimitive = m_PointLocator.elementMap.empty() ? UINT32_MAX : point_locator::locate_point(m_PointLocator, cameraPosition * lebCB._LEBScale);
+    if (initialPrimitive == UINT32_MAX)
+        initialPrimitive = m_MortonCache.get_closest_element(cameraPosition * lebCB._LEBScale);
 
     // Is this the right primitive?
     const TetraData& initalData = m_Volume.tetraData[initialPrimitive];
@@ -0,0 +1,29 @@
+// Internal includes
+#include "tools/parallel.h"
+
+// External includes
+#include <omp.h>
+#include <stdlib.h>
+
+// Number of threads set by the application (0 if not set)
+static uint32_t g_NumThreads = 0;
+
+uint32_t parallel_num_threads()
+{
+	// Set by the application
+	if (g_NumThreads != 0)
+		return g_NumThreads;
+
+	// Set by the environment
+	const char* envThreads = getenv("LEB3D_NUM_THREADS");
+	if (envThreads != nullptr && atoi(envThreads) > 0)
+		return (uint32_t)atoi(envThreads);
+
+	// Every logical core of the machine
+	return (uint32_t)omp_get_num_procs();
+}
+
+void set_parallel_num_threads(uint32_t numThreads)
+{
+	g_NumThreads = numThreads;
+}
@@ -1,6 +1,13 @@
 // Internal includes
 #include "volume/grid_volume.h"
 #include "tools/stream.h"
+#include "tools/parallel.h"
+
+// External includes
+#include <algorithm>
+
+// Number of densities hashed by a task
+#define HASH_BLOCK_SIZE (1 << 20)
 
 namespace grid_volume
 {
@@ -45,4 +52,48 @@ namespace grid_volume
         unpack_bytes(binaryPtr, gridVolume.resolution);
         unpack_vector_bytes(binaryPtr, gridVolume.densityArray);
     }
-}
\ No newline at end of file
+
+    uint64_t fnv1a(uint64_t hash, const uint32_t* words, uint64_t numWords)
+    {
+        for (uint64_t wordIdx = 0; wordIdx < numWords; ++wordIdx)
+            hash = (hash ^ words[wordIdx]) * 1099511628211ull;
+        return hash;
+    }
+
+    uint64_t hash_densities(const float* densities, uint64_t numDensities)
+    {
+        // Four interleaved streams hide the latency of the multiplications
+        const uint32_t* words = (const uint32_t*)densities;
+        uint64_t hashes[4] = { 14695981039346656037ull, 14695981039346656037ull, 14695981039346656037ull, 14695981039346656037ull };
+        uint64_t wordIdx = 0;
+        for (; wordIdx + 4 <= numDensities; wordIdx += 4)
+        {
+            for (uint32_t streamIdx = 0; streamIdx < 4; ++streamIdx)
+                hashes[streamIdx] = (hashes[streamIdx] ^ words[wordIdx + streamIdx]) * 1099511628211ull;
+        }
+
+        // Merge the streams and the remaining densities
+        uint64_t hash = fnv1a(hashes[0], (const uint32_t*)(hashes + 1), 6);
+        return fnv1a(hash, words + wordIdx, numDensities - wordIdx);
+    }
+
+    uint64_t hash_grid_volume(const GridVolume& gridVolume)
+    {
+        // Hash the blocks of densities in parallel
+        const uint64_t numDensities = gridVolume.densityArray.size();
+        const int32_t numBlocks = (int32_t)((numDensities + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE);
+        std::vector<uint64_t> blockHashes(numBlocks);
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+        for (int32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx)
+        {
+            const uint64_t firstDensity = (uint64_t)blockIdx * HASH_BLOCK_SIZE;
+            const uint64_t numBlockDensities = std::min((uint64_t)HASH_BLOCK_SIZE, numDensities - firstDensity);
+            blockHashes[blockIdx] = hash_densities(gridVolume.densityArray.data() + firstDensity, numBlockDensities);
+        }
+
+        // Combine them in order with the properties of the grid
+        uint64_t hash = fnv1a(14695981039346656037ull, (const uint32_t*)&gridVolume.scale, sizeof(float3) / sizeof(uint32_t));
+        hash = fnv1a(hash, (const uint32_t*)&gridVolume.resolution, sizeof(uint3) / sizeof(uint32_t));
+        return fnv1a(hash, (const uint32_t*)blockHashes.data(), blockHashes.size() * 2);
+    }
+}
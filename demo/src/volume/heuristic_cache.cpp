@@ -2,142 +2,953 @@
 #include "math/operators.h"
 #include "volume/heuristic_cache.h"
 #include "tools/security.h"
+#include "tools/parallel.h"
+#include "tools/stream.h"
 
 // External includes incldues
 #include <algorithm>
+#include <string>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(_WIN32)
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Every slab of (1 << SLAB_SIZE_LOG2)^2 rows of the first level builds its part of the next levels while it is still in the cache
+#define SLAB_SIZE_LOG2 4
+
+// Cells of a brick of the sparse layout along every axis
+#define SPARSE_BRICK_SIZE_LOG2 2
+
+// Number of cells converted by a task of the half precision packing
+#define PACKING_BLOCK_SIZE 4096
+
+// Identification of the cache files (the version changes with the layout of the file)
+#define CACHE_FILE_MAGIC 0x3342454c
+#define CACHE_FILE_VERSION 1
+
+// Alignment of the moment buffer in the cache files
+#define CACHE_FILE_ALIGNMENT 64
 
 namespace heuristic_cache
 {
-	void build_heuristic_cache(const GridVolume& volume, HeuristicCache& cache)
+	uint64_t spread_bits(uint32_t value)
+	{
+		// Insert two zero bits between the 21 first bits of the value
+		uint64_t bits = value & 0x1fffff;
+		bits = (bits | bits << 32) & 0x1f00000000ffffull;
+		bits = (bits | bits << 16) & 0x1f0000ff0000ffull;
+		bits = (bits | bits << 8) & 0x100f00f00f00f00full;
+		bits = (bits | bits << 4) & 0x10c30c30c30c30c3ull;
+		bits = (bits | bits << 2) & 0x1249249249249249ull;
+		return bits;
+	}
+
+	uint64_t brick_index(const HeuristicCache& cache, uint32_t level, uint32_t x, uint32_t y, uint32_t z)
+	{
+		const uint3& resolution = cache.resolutions[level];
+		const uint32_t brickSizeLog2 = cache.brickSizesLog2[level];
+		const uint32_t brickMask = (1 << brickSizeLog2) - 1;
+		const uint64_t numBricksX = (resolution.x + brickMask) >> brickSizeLog2;
+		const uint64_t numBricksY = (resolution.y + brickMask) >> brickSizeLog2;
+		return (x >> brickSizeLog2) + (y >> brickSizeLog2) * numBricksX + (z >> brickSizeLog2) * numBricksX * numBricksY;
+	}
+
+	uint64_t cell_index(const HeuristicCache& cache, uint32_t level, uint32_t x, uint32_t y, uint32_t z)
+	{
+		if (cache.layout != CacheLayout::Linear)
+		{
+			// Brick of the cell, then the cell inside of the brick
+			const uint32_t brickSizeLog2 = cache.brickSizesLog2[level];
+			const uint32_t brickMask = (1 << brickSizeLog2) - 1;
+			const uint64_t brickIdx = brick_index(cache, level, x, y, z);
+			const uint64_t localIdx = spread_bits(x & brickMask) | spread_bits(y & brickMask) << 1 | spread_bits(z & brickMask) << 2;
+			if (cache.layout == CacheLayout::Sparse)
+				return ((uint64_t)cache.brickTable[cache.brickOffsets[level] + brickIdx] << (3 * brickSizeLog2)) + localIdx;
+			return cache.offsets[level] + (brickIdx << (3 * brickSizeLog2)) + localIdx;
+		}
+		const uint3& resolution = cache.resolutions[level];
+		return cache.offsets[level] + x + (uint64_t)y * resolution.x + (uint64_t)z * resolution.x * resolution.y;
+	}
+
+	bool cell_occupied(const HeuristicCache& cache, uint32_t level, uint32_t x, uint32_t y, uint32_t z)
+	{
+		return cache.layout != CacheLayout::Sparse || cache.brickTable[cache.brickOffsets[level] + brick_index(cache, level, x, y, z)] != 0;
+	}
+
+	void build_brick_table(const GridVolume& volume, HeuristicCache& cache)
+	{
+		// Flag the bricks of the first level that cover a non zero voxel
+		const uint3& gridRes = volume.resolution;
+		const uint32_t brickVoxelsLog2 = SPARSE_BRICK_SIZE_LOG2 + 1;
+		const uint32_t numBricksX = (gridRes.x + (1 << brickVoxelsLog2) - 1) >> brickVoxelsLog2;
+		const uint32_t numBricksY = (gridRes.y + (1 << brickVoxelsLog2) - 1) >> brickVoxelsLog2;
+		const uint32_t numBricksZ = (gridRes.z + (1 << brickVoxelsLog2) - 1) >> brickVoxelsLog2;
+		#pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+		for (int32_t brickZ = 0; brickZ < (int32_t)numBricksZ; ++brickZ)
+		{
+			for (uint32_t voxelZ = brickZ << brickVoxelsLog2; voxelZ < std::min((brickZ + 1u) << brickVoxelsLog2, gridRes.z); ++voxelZ)
+			{
+				for (uint32_t voxelY = 0; voxelY < gridRes.y; ++voxelY)
+				{
+					const float* row = volume.densityArray.data() + (uint64_t)voxelY * gridRes.x + (uint64_t)voxelZ * gridRes.x * gridRes.y;
+					uint32_t* brickRow = cache.brickTable.data() + (voxelY >> brickVoxelsLog2) * numBricksX + (uint64_t)brickZ * numBricksX * numBricksY;
+					for (uint32_t brickX = 0; brickX < numBricksX; ++brickX)
+					{
+						// Only look at the bricks that have not been flagged yet
+						for (uint32_t voxelX = brickX << brickVoxelsLog2; brickRow[brickX] == 0 && voxelX < std::min((brickX + 1) << brickVoxelsLog2, gridRes.x); ++voxelX)
+							brickRow[brickX] = row[voxelX] != 0.0f;
+					}
+				}
+			}
+		}
+
+		// A brick of the next levels covers up to 2x2x2 bricks of the previous one
+		for (uint32_t lvlIdx = 1; lvlIdx < cache.numLevels; ++lvlIdx)
+		{
+			const uint3& inputRes = cache.resolutions[lvlIdx - 1];
+			const uint3& outputRes = cache.resolutions[lvlIdx];
+			const uint32_t brickMask = (1 << SPARSE_BRICK_SIZE_LOG2) - 1;
+			const uint32_t numInputX = (inputRes.x + brickMask) >> SPARSE_BRICK_SIZE_LOG2, numInputY = (inputRes.y + brickMask) >> SPARSE_BRICK_SIZE_LOG2, numInputZ = (inputRes.z + brickMask) >> SPARSE_BRICK_SIZE_LOG2;
+			const uint32_t numOutputX = (outputRes.x + brickMask) >> SPARSE_BRICK_SIZE_LOG2, numOutputY = (outputRes.y + brickMask) >> SPARSE_BRICK_SIZE_LOG2, numOutputZ = (outputRes.z + brickMask) >> SPARSE_BRICK_SIZE_LOG2;
+			const uint32_t* input = cache.brickTable.data() + cache.brickOffsets[lvlIdx - 1];
+			uint32_t* output = cache.brickTable.data() + cache.brickOffsets[lvlIdx];
+			for (uint32_t brickZ = 0; brickZ < numOutputZ; ++brickZ)
+				for (uint32_t brickY = 0; brickY < numOutputY; ++brickY)
+					for (uint32_t brickX = 0; brickX < numOutputX; ++brickX)
+						for (uint32_t inputZ = 2 * brickZ; inputZ < std::min(2 * brickZ + 2, numInputZ); ++inputZ)
+							for (uint32_t inputY = 2 * brickY; inputY < std::min(2 * brickY + 2, numInputY); ++inputY)
+								for (uint32_t inputX = 2 * brickX; inputX < std::min(2 * brickX + 2, numInputX); ++inputX)
+									output[brickX + (brickY + brickZ * numOutputY) * numOutputX] |= input[inputX + ((uint64_t)inputY + (uint64_t)inputZ * numInputY) * numInputX];
+		}
+
+		// Give a slot to every occupied brick, the slot 0 is the zero brick shared by all the empty ones
+		uint32_t numSlots = 1;
+		for (uint32_t& brick : cache.brickTable)
+			brick = brick != 0 ? numSlots++ : 0;
+		cache.momentArray.resize((uint64_t)numSlots << (3 * SPARSE_BRICK_SIZE_LOG2));
+	}
+
+	void reduce_density_row(const GridVolume& volume, HeuristicCache& cache, uint32_t y, uint32_t z)
 	{
-		assert_msg(volume.resolution.x == volume.resolution.y 
-				&& volume.resolution.x == volume.resolution.z, 
-				"This code assumes the grid is cubic, but the code can be extended.");
+		// Rows of the grid that cover the output row (the last row of an odd axis only has one)
+		const uint32_t numRowsY = std::min(volume.resolution.y - 2 * y, 2u);
+		const uint32_t numRowsZ = std::min(volume.resolution.z - 2 * z, 2u);
+		const uint32_t numRows = numRowsY * numRowsZ;
+		const float* rows[4];
+		for (uint32_t lz = 0; lz < numRowsZ; ++lz)
+			for (uint32_t ly = 0; ly < numRowsY; ++ly)
+				rows[numRowsY * lz + ly] = volume.densityArray.data() + (uint64_t)(y * 2ull + ly) * volume.resolution.x + (uint64_t)(z * 2ull + lz) * volume.resolution.x * volume.resolution.y;
+
+		uint32_t x = 0;
+#if defined(__AVX2__)
+		// 8 cells at a time, the reductions are done in the same order as the scalar version (every pair of cells is contiguous unless a Morton brick is a single cell)
+		const bool contiguousPairs = cache.layout == CacheLayout::Linear || cache.brickSizesLog2[0] > 0;
+		for (; numRows == 4 && contiguousPairs && x + 8 <= volume.resolution.x / 2; x += 8)
+		{
+			// The empty bricks of the sparse layout are not stored
+			const bool occupied0 = cell_occupied(cache, 0, x, y, z);
+			const bool occupied1 = cell_occupied(cache, 0, x + 4, y, z);
+			if (!occupied0 && !occupied1)
+				continue;
+
+			__m256 minV = _mm256_set1_ps(FLT_MAX);
+			__m256 maxV = _mm256_set1_ps(-FLT_MAX);
+			__m256 mean = _mm256_setzero_ps();
+			__m256 mean2 = _mm256_setzero_ps();
+			for (uint32_t rowIdx = 0; rowIdx < 4; ++rowIdx)
+			{
+				// Split the 16 densities into the even and odd columns
+				const __m256 d0 = _mm256_loadu_ps(rows[rowIdx] + 2 * x);
+				const __m256 d1 = _mm256_loadu_ps(rows[rowIdx] + 2 * x + 8);
+				const __m256 even = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(d0, d1, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+				const __m256 odd = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(d0, d1, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+
+				// Contribute
+				mean = _mm256_add_ps(mean, even);
+				mean2 = _mm256_add_ps(mean2, _mm256_mul_ps(even, even));
+				minV = _mm256_min_ps(even, minV);
+				maxV = _mm256_max_ps(even, maxV);
+				mean = _mm256_add_ps(mean, odd);
+				mean2 = _mm256_add_ps(mean2, _mm256_mul_ps(odd, odd));
+				minV = _mm256_min_ps(odd, minV);
+				maxV = _mm256_max_ps(odd, maxV);
+			}
+
+			// Normalize the average and interleave the moments
+			mean = _mm256_mul_ps(mean, _mm256_set1_ps(0.125f));
+			mean2 = _mm256_mul_ps(mean2, _mm256_set1_ps(0.125f));
+			const __m256 meanLo = _mm256_unpacklo_ps(mean, mean2);
+			const __m256 meanHi = _mm256_unpackhi_ps(mean, mean2);
+			const __m256 rangeLo = _mm256_unpacklo_ps(minV, maxV);
+			const __m256 rangeHi = _mm256_unpackhi_ps(minV, maxV);
+			const __m256 cells01 = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(meanLo), _mm256_castps_pd(rangeLo)));
+			const __m256 cells23 = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(meanLo), _mm256_castps_pd(rangeLo)));
+			const __m256 cells45 = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(meanHi), _mm256_castps_pd(rangeHi)));
+			const __m256 cells67 = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(meanHi), _mm256_castps_pd(rangeHi)));
+			if (occupied0)
+			{
+				_mm256_storeu_ps(&cache.momentArray[cell_index(cache, 0, x, y, z)].x, _mm256_permute2f128_ps(cells01, cells23, 0x20));
+				_mm256_storeu_ps(&cache.momentArray[cell_index(cache, 0, x + 2, y, z)].x, _mm256_permute2f128_ps(cells45, cells67, 0x20));
+			}
+			if (occupied1)
+			{
+				_mm256_storeu_ps(&cache.momentArray[cell_index(cache, 0, x + 4, y, z)].x, _mm256_permute2f128_ps(cells01, cells23, 0x31));
+				_mm256_storeu_ps(&cache.momentArray[cell_index(cache, 0, x + 6, y, z)].x, _mm256_permute2f128_ps(cells45, cells67, 0x31));
+			}
+		}
+#endif
+
+		// Remaining cells (the last cell of an odd axis only covers one column)
+		for (; x < cache.resolutions[0].x; ++x)
+		{
+			// The empty bricks of the sparse layout are not stored
+			if (!cell_occupied(cache, 0, x, y, z))
+				continue;
+
+			// Compute the statistics
+			const uint32_t numColumns = std::min(volume.resolution.x - 2 * x, 2u);
+			float minV = FLT_MAX;
+			float maxV = -FLT_MAX;
+			float mean = 0.0;
+			float mean2 = 0.0;
+			for (uint32_t rowIdx = 0; rowIdx < numRows; ++rowIdx)
+			{
+				for (uint32_t lx = 0; lx < numColumns; ++lx)
+				{
+					// Grab the density
+					float density = rows[rowIdx][x * 2 + lx];
 
-		// Keep track of the top resolution
-		cache.resolution = volume.resolution.x >> 1;
+					// Contribute
+					mean += density;
+					mean2 += density * density;
+					minV = std::min(minV, density);
+					maxV = std::max(maxV, density);
+				}
+			}
 
-		// Count the total number of cells
-		uint64_t currentRes = cache.resolution;
+			// Normalize the average (the voxel count is a power of two, so this is exact)
+			const float normalization = 1.0f / (numRows * numColumns);
+			cache.momentArray[cell_index(cache, 0, x, y, z)] = { mean * normalization, mean2 * normalization, minV, maxV };
+		}
+	}
+
+	void reduce_partial_moments(HeuristicCache& cache, uint32_t lvlIdx, uint32_t x, uint32_t y, uint32_t z)
+	{
+		// The input cells on the border may be missing or cover fewer voxels, weight them by their voxel count
+		const uint3& inputRes = cache.resolutions[lvlIdx - 1];
+		const uint3& gridRes = cache.gridResolution;
+		const uint32_t inputSize = 1 << lvlIdx;
+		float minV = FLT_MAX;
+		float maxV = -FLT_MAX;
+		float mean = 0.0;
+		float mean2 = 0.0;
+		float weight = 0.0;
+		for (uint32_t inputZ = 2 * z; inputZ < std::min(2 * z + 2, inputRes.z); ++inputZ)
+		{
+			for (uint32_t inputY = 2 * y; inputY < std::min(2 * y + 2, inputRes.y); ++inputY)
+			{
+				for (uint32_t inputX = 2 * x; inputX < std::min(2 * x + 2, inputRes.x); ++inputX)
+				{
+					const float4& data = cache.momentArray[cell_index(cache, lvlIdx - 1, inputX, inputY, inputZ)];
+					const float numVoxels = (float)std::min(inputSize, gridRes.x - inputX * inputSize)
+						* (float)std::min(inputSize, gridRes.y - inputY * inputSize)
+						* (float)std::min(inputSize, gridRes.z - inputZ * inputSize);
+
+					// Contribute
+					mean += data.x * numVoxels;
+					mean2 += data.y * numVoxels;
+					minV = std::min(minV, data.z);
+					maxV = std::max(maxV, data.w);
+					weight += numVoxels;
+				}
+			}
+		}
+
+		// Normalize the average
+		cache.momentArray[cell_index(cache, lvlIdx, x, y, z)] = { mean / weight, mean2 / weight, minV, maxV };
+	}
+
+	void reduce_moments(HeuristicCache& cache, uint32_t lvlIdx, uint32_t x, uint32_t y, uint32_t z)
+	{
+		// The empty bricks of the sparse layout are not stored (the empty input bricks read the zero brick)
+		if (!cell_occupied(cache, lvlIdx, x, y, z))
+			return;
+
+		// A cell that covers a full block of voxels has 8 full input cells, the other ones are on the border
+		const uint32_t cellSize = 2 << lvlIdx;
+		if ((x + 1) * cellSize > cache.gridResolution.x || (y + 1) * cellSize > cache.gridResolution.y || (z + 1) * cellSize > cache.gridResolution.z)
+		{
+			reduce_partial_moments(cache, lvlIdx, x, y, z);
+			return;
+		}
+
+		// First input cell (the input level has at least two cells along every axis, so in the brick layouts the 8 input cells are contiguous)
+		const float4* input = cache.momentArray.data() + cell_index(cache, lvlIdx - 1, x * 2, y * 2, z * 2);
+		float4& output = cache.momentArray[cell_index(cache, lvlIdx, x, y, z)];
+		const uint3& inputRes = cache.resolutions[lvlIdx - 1];
+		const uint64_t strideY = cache.layout == CacheLayout::Linear ? inputRes.x : 2;
+		const uint64_t strideZ = cache.layout == CacheLayout::Linear ? (uint64_t)inputRes.x * inputRes.y : 4;
+
+#if defined(__AVX2__)
+		// The four moments are reduced at once, the sums and the min/max are blended at the end
+		__m128 sum = _mm_setzero_ps();
+		__m128 minV = _mm_set1_ps(FLT_MAX);
+		__m128 maxV = _mm_set1_ps(-FLT_MAX);
+		for (uint32_t lz = 0; lz < 2; ++lz)
+		{
+			for (uint32_t ly = 0; ly < 2; ++ly)
+			{
+				for (uint32_t lx = 0; lx < 2; ++lx)
+				{
+					const __m128 data = _mm_loadu_ps(&input[lx + ly * strideY + lz * strideZ].x);
+					sum = _mm_add_ps(sum, data);
+					minV = _mm_min_ps(data, minV);
+					maxV = _mm_max_ps(data, maxV);
+				}
+			}
+		}
+		sum = _mm_mul_ps(sum, _mm_set1_ps(0.125f));
+		_mm_storeu_ps(&output.x, _mm_blend_ps(_mm_blend_ps(sum, minV, 0x4), maxV, 0x8));
+#else
+		float minV = FLT_MAX;
+		float maxV = -FLT_MAX;
+		float mean = 0.0;
+		float mean2 = 0.0;
+		for (uint32_t lz = 0; lz < 2; ++lz)
+		{
+			for (uint32_t ly = 0; ly < 2; ++ly)
+			{
+				for (uint32_t lx = 0; lx < 2; ++lx)
+				{
+					const float4& data = input[lx + ly * strideY + lz * strideZ];
+
+					// Contribute
+					mean += data.x;
+					mean2 += data.y;
+					minV = std::min(minV, data.z);
+					maxV = std::max(maxV, data.w);
+				}
+			}
+		}
+
+		// Normalize the average
+		output = { mean * 0.125f, mean2 * 0.125f, minV, maxV };
+#endif
+	}
+
+	void pack_moments(HeuristicCache& cache)
+	{
+		// Convert the moments by blocks of cells
+		const uint64_t numCells = cache.momentArray.size();
+		cache.packedMomentArray.resize(numCells);
+		const int32_t numBlocks = (int32_t)((numCells + PACKING_BLOCK_SIZE - 1) / PACKING_BLOCK_SIZE);
+		#pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 16)
+		for (int32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx)
+		{
+			uint64_t cellIdx = (uint64_t)blockIdx * PACKING_BLOCK_SIZE;
+			const uint64_t lastCellIdx = std::min(cellIdx + PACKING_BLOCK_SIZE, numCells);
+#if defined(__AVX2__)
+			// Two cells at a time
+			for (; cellIdx + 2 <= lastCellIdx; cellIdx += 2)
+				_mm_storeu_si128((__m128i*)&cache.packedMomentArray[cellIdx], _mm256_cvtps_ph(_mm256_loadu_ps(&cache.momentArray[cellIdx].x), _MM_FROUND_TO_NEAREST_INT));
+#endif
+			for (; cellIdx < lastCellIdx; ++cellIdx)
+			{
+				const float4& moments = cache.momentArray[cellIdx];
+				cache.packedMomentArray[cellIdx] = { float_to_half(moments.x), float_to_half(moments.y), float_to_half(moments.z), float_to_half(moments.w) };
+			}
+		}
+
+		// Release the full precision moments
+		std::vector<float4>().swap(cache.momentArray);
+	}
+
+	void build_heuristic_cache(const GridVolume& volume, HeuristicCache& cache, CacheLayout layout, CachePrecision precision)
+	{
+		assert_msg(volume.resolution.x > 0 && volume.resolution.y > 0 && volume.resolution.z > 0, "The grid is empty.");
+
+		// The cache no longer reads an imported file and the summed-area tables are built on demand from the new levels
+		release_heuristic_cache(cache);
+		cache.summedOffsets.clear();
+		cache.summedArray.clear();
+
+		// Every level is pushed again, nothing is kept from a previous build or a failed import
+		cache.numLevels = 0;
+		cache.baseLevel = 0;
+		cache.resolutions.clear();
+		cache.brickSizesLog2.clear();
+		cache.offsets.clear();
+		cache.brickOffsets.clear();
+		cache.brickTable.clear();
+		cache.momentArray.clear();
+		cache.packedMomentArray.clear();
+
+		// Keep track of the source resolution
+		cache.gridResolution = volume.resolution;
+		cache.layout = layout;
+		cache.precision = precision;
+
+		// Count the total number of cells, every level halves every axis (rounded up) until a single cell is left
+		uint3 currentRes = { (volume.resolution.x + 1) >> 1, (volume.resolution.y + 1) >> 1, (volume.resolution.z + 1) >> 1 };
 		uint64_t initialOffset = 0;
-		while (currentRes > 0)
+		uint64_t numBricks = 0;
+		while (true)
 		{
-			// Level offset
-			cache.offsets.push_back(initialOffset);
-			cache.resolutions.push_back((uint32_t)currentRes);
-			
-			// Global offset
-			initialOffset += currentRes * currentRes * currentRes;
+			// Level offset (the sparse layout goes through the brick table)
+			cache.offsets.push_back(layout == CacheLayout::Sparse ? 0 : initialOffset);
+			cache.resolutions.push_back(currentRes);
+
+			// Largest power of two brick that fits in the level (fixed for the sparse layout)
+			const uint32_t minRes = std::min(std::min(currentRes.x, currentRes.y), currentRes.z);
+			uint32_t brickSizeLog2 = 0;
+			while ((2u << brickSizeLog2) <= minRes)
+				brickSizeLog2++;
+			if (layout == CacheLayout::Sparse)
+				brickSizeLog2 = SPARSE_BRICK_SIZE_LOG2;
+			cache.brickSizesLog2.push_back(brickSizeLog2);
+
+			// Bricks of the level in the brick table
+			const uint32_t brickMask = (1 << brickSizeLog2) - 1;
+			const uint64_t numLevelBricks = (uint64_t)((currentRes.x + brickMask) >> brickSizeLog2) * ((currentRes.y + brickMask) >> brickSizeLog2) * ((currentRes.z + brickMask) >> brickSizeLog2);
+			cache.brickOffsets.push_back(numBricks);
+			numBricks += numLevelBricks;
+
+			// Global offset (the Morton layout pads the level to whole bricks)
+			uint64_t numCells = (uint64_t)currentRes.x * currentRes.y * currentRes.z;
+			if (layout != CacheLayout::Linear)
+				numCells = numLevelBricks << (3 * brickSizeLog2);
+			initialOffset += numCells;
 
 			// Reduce resolution
-			currentRes >>= 1;
+			if (currentRes.x == 1 && currentRes.y == 1 && currentRes.z == 1)
+				break;
+			currentRes = { (currentRes.x + 1) >> 1, (currentRes.y + 1) >> 1, (currentRes.z + 1) >> 1 };
 		}
 
-		// Allocate the memory space
-		cache.momentArray.resize(initialOffset);
+		// Allocate the memory space (only the occupied bricks for the sparse layout)
 		cache.numLevels = (uint32_t)cache.offsets.size();
+		if (layout == CacheLayout::Sparse)
+		{
+			cache.brickTable.resize(numBricks);
+			build_brick_table(volume, cache);
+		}
+		else
+			cache.momentArray.resize(initialOffset);
+
+		// The cells of the base level are the closest to the size of the base elements along the largest axis (the coarsest level for a power of two grid)
+		const uint32_t maxResolution = std::max(std::max(volume.resolution.x, volume.resolution.y), volume.resolution.z);
+		cache.baseLevel = std::min((uint32_t)std::max((int32_t)lround(log2((double)maxResolution)) - 1, 0), cache.numLevels - 1);
+
+		// Levels that are built slab by slab
+		const uint32_t numSlabLevels = std::min((uint32_t)SLAB_SIZE_LOG2 + 1, cache.numLevels);
+		const uint32_t numSlabsY = (cache.resolutions[0].y + (1 << SLAB_SIZE_LOG2) - 1) >> SLAB_SIZE_LOG2;
+		const uint32_t numSlabsZ = (cache.resolutions[0].z + (1 << SLAB_SIZE_LOG2) - 1) >> SLAB_SIZE_LOG2;
 
-		// First we evaluate the lowest level
-		#pragma omp parallel for num_threads(32)
-		for (int32_t z = 0; z < (int32_t)cache.resolution; ++z)
+		// Evaluate the first level of a slab and reduce it while it is in the cache
+		#pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+		for (int32_t slabIdx = 0; slabIdx < (int32_t)(numSlabsY * numSlabsZ); ++slabIdx)
 		{
-			for (uint32_t y = 0; y < cache.resolution; ++y)
+			const uint32_t slabY = (uint32_t)slabIdx % numSlabsY;
+			const uint32_t slabZ = (uint32_t)slabIdx / numSlabsY;
+			for (uint32_t lvlIdx = 0; lvlIdx < numSlabLevels; ++lvlIdx)
 			{
-				for (uint32_t x = 0; x < cache.resolution; ++x)
+				// Rows of the slab at this level
+				const uint32_t slabSize = (1 << SLAB_SIZE_LOG2) >> lvlIdx;
+				const uint3& resolution = cache.resolutions[lvlIdx];
+				const uint32_t y0 = slabY * slabSize, y1 = std::min(y0 + slabSize, resolution.y);
+				const uint32_t z0 = slabZ * slabSize, z1 = std::min(z0 + slabSize, resolution.z);
+				for (uint32_t z = z0; z < z1; ++z)
 				{
-					// Compute the statistics
-					float minV = FLT_MAX;
-					float maxV = -FLT_MAX;
-					float mean = 0.0;
-					float mean2 = 0.0;
-					for (uint32_t lz = 0; lz < 2; ++lz)
+					for (uint32_t y = y0; y < y1; ++y)
 					{
-						for (uint32_t ly = 0; ly < 2; ++ly)
+						if (lvlIdx == 0)
+							reduce_density_row(volume, cache, y, z);
+						else
 						{
-							for (uint32_t lx = 0; lx < 2; ++lx)
-							{
-								// Offset of the input cell
-								uint64_t offset = (uint64_t)x * 2 + (uint64_t)lx + (uint64_t)(y * 2ull + ly) * volume.resolution.x + (uint64_t)(z * 2ull + lz) * volume.resolution.x * volume.resolution.y;
-
-								// Grab the density
-								float density = volume.densityArray[offset];
-
-								// Contribute
-								mean += density;
-								mean2 += density * density;
-								minV = std::min(minV, density);
-								maxV = std::max(maxV, density);
-							}
+							for (uint32_t x = 0; x < resolution.x; ++x)
+								reduce_moments(cache, lvlIdx, x, y, z);
 						}
 					}
-					// Normalize the average
-					uint64_t cacheOffset = (uint64_t)x + (uint64_t)y * cache.resolution + (uint64_t)z * cache.resolution * cache.resolution;
-					cache.momentArray[cacheOffset] = { mean * 0.125f, mean2 * 0.125f, minV, maxV };
 				}
 			}
 		}
 
 		// Then process the remaining levels
-		uint32_t inputRes = cache.resolution;
-		uint32_t outputRes = inputRes >> 1;
-		for (uint32_t lvlIdx = 1; lvlIdx < cache.offsets.size(); ++lvlIdx)
+		for (uint32_t lvlIdx = numSlabLevels; lvlIdx < cache.numLevels; ++lvlIdx)
+		{
+			const uint3& outputRes = cache.resolutions[lvlIdx];
+			#pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+			for (int32_t z = 0; z < (int32_t)outputRes.z; ++z)
+			{
+				for (uint32_t y = 0; y < outputRes.y; ++y)
+				{
+					for (uint32_t x = 0; x < outputRes.x; ++x)
+						reduce_moments(cache, lvlIdx, x, y, (uint32_t)z);
+				}
+			}
+		}
+
+		// The levels are always reduced in full precision, then packed if required
+		if (precision == CachePrecision::Float16)
+			pack_moments(cache);
+	}
+
+	void pack_cache_header(const HeuristicCache& cache, uint64_t gridHash, std::vector<char>& buffer)
+	{
+		// Identification of the file
+		pack_bytes(buffer, (uint32_t)CACHE_FILE_MAGIC);
+		pack_bytes(buffer, (uint32_t)CACHE_FILE_VERSION);
+		pack_bytes(buffer, gridHash);
+
+		// Description of the levels
+		pack_bytes(buffer, cache.layout);
+		pack_bytes(buffer, cache.precision);
+		pack_bytes(buffer, cache.numLevels);
+		pack_bytes(buffer, cache.baseLevel);
+		pack_bytes(buffer, cache.gridResolution);
+		pack_vector_bytes(buffer, cache.resolutions);
+		pack_vector_bytes(buffer, cache.brickSizesLog2);
+		pack_vector_bytes(buffer, cache.offsets);
+		pack_vector_bytes(buffer, cache.brickOffsets);
+		pack_vector_bytes(buffer, cache.brickTable);
+
+		// The moment buffer starts at the next aligned offset
+		pack_bytes(buffer, num_cells(cache));
+		buffer.resize((buffer.size() + CACHE_FILE_ALIGNMENT - 1) / CACHE_FILE_ALIGNMENT * CACHE_FILE_ALIGNMENT, 0);
+	}
+
+	void export_heuristic_cache(const HeuristicCache& cache, uint64_t gridHash, const char* path)
+	{
+		// Pack the description of the cache
+		std::vector<char> header;
+		pack_cache_header(cache, gridHash, header);
+
+		// Write to disk, the moments are written directly from the cache
+		const uint64_t cellSize = cache.precision == CachePrecision::Float16 ? sizeof(half4) : sizeof(float4);
+		const void* moments = cache.precision == CachePrecision::Float16 ? (const void*)packed_moment_buffer(cache) : (const void*)moment_buffer(cache);
+		const std::string tmpPath = std::string(path) + ".tmp";
+		FILE* pFile;
+		pFile = fopen(tmpPath.c_str(), "wb");
+		assert_msg(pFile != nullptr, "Failed to open the cache file.");
+		bool written = fwrite(header.data(), sizeof(char), header.size(), pFile) == header.size();
+		written = fwrite(moments, cellSize, num_cells(cache), pFile) == num_cells(cache) && written;
+		written = fclose(pFile) == 0 && written;
+		if (!written)
+		{
+			remove(tmpPath.c_str());
+			assert_msg(false, "Failed to write the cache file.");
+			return;
+		}
+
+		// Only a complete file replaces the previous one
+#if defined(_WIN32)
+		const bool renamed = MoveFileExA(tmpPath.c_str(), path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		const bool renamed = rename(tmpPath.c_str(), path) == 0;
+#endif
+		if (!renamed)
+			remove(tmpPath.c_str());
+		assert_msg(renamed, "Failed to replace the cache file.");
+	}
+
+	const char* map_file(const char* path, uint64_t& size)
+	{
+#if defined(_WIN32)
+		// The view keeps the mapping alive once the handles are closed
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return nullptr;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = (uint64_t)fileSize.QuadPart;
+		HANDLE mapping = size > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+		CloseHandle(file);
+		if (mapping == nullptr)
+			return nullptr;
+		const char* view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		return view;
+#else
+		int file = open(path, O_RDONLY);
+		if (file < 0)
+			return nullptr;
+		struct stat fileStat;
+		fstat(file, &fileStat);
+		size = (uint64_t)fileStat.st_size;
+		void* view = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+		close(file);
+		return view != MAP_FAILED ? (const char*)view : nullptr;
+#endif
+	}
+
+	void unmap_file(const void* view, uint64_t size)
+	{
+#if defined(_WIN32)
+		UnmapViewOfFile(view);
+#else
+		munmap((void*)view, size);
+#endif
+	}
+
+	template<typename T>
+	bool unpack_checked(const char*& binaryPtr, const char* end, T& value)
+	{
+		// The field must fit in the rest of the file
+		if ((uint64_t)(end - binaryPtr) < sizeof(T))
+			return false;
+		unpack_bytes(binaryPtr, value);
+		return true;
+	}
+
+	template<typename T>
+	bool unpack_vector_checked(const char*& binaryPtr, const char* end, std::vector<T>& values)
+	{
+		// The size and then the elements must fit in the rest of the file
+		size_t numElements = 0;
+		if (!unpack_checked(binaryPtr, end, numElements) || numElements > (uint64_t)(end - binaryPtr) / sizeof(T))
+			return false;
+		values.resize(numElements);
+		unpack_buffer(binaryPtr, numElements * sizeof(T), (char*)values.data());
+		return true;
+	}
+
+	bool product_fits(uint64_t x, uint64_t y, uint64_t z, uint64_t limit)
+	{
+		// x * y * z <= limit without overflowing, for 32 bit factors (z > 0)
+		return x * y <= limit / z;
+	}
+
+	bool valid_cache_levels(const HeuristicCache& cache)
+	{
+		// Every level halves the previous one (rounded up) down to a single cell, like build_heuristic_cache does
+		const uint3& gridRes = cache.gridResolution;
+		if (gridRes.x == 0 || gridRes.y == 0 || gridRes.z == 0)
+			return false;
+		uint3 expectedRes = { (gridRes.x + 1) >> 1, (gridRes.y + 1) >> 1, (gridRes.z + 1) >> 1 };
+		for (uint32_t lvlIdx = 0; lvlIdx < cache.numLevels; ++lvlIdx)
 		{
-			// First we evaluate the lowest level
-			#pragma omp parallel for num_threads(32)
-			for (int32_t z = 0; z < (int32_t)outputRes; ++z)
+			const uint3& resolution = cache.resolutions[lvlIdx];
+			const bool lastLevel = resolution.x == 1 && resolution.y == 1 && resolution.z == 1;
+			if (resolution.x != expectedRes.x || resolution.y != expectedRes.y || resolution.z != expectedRes.z || lastLevel != (lvlIdx == cache.numLevels - 1))
+				return false;
+			expectedRes = { (resolution.x + 1) >> 1, (resolution.y + 1) >> 1, (resolution.z + 1) >> 1 };
+
+			// Bricks of the level (spread_bits handles up to 21 bits of local coordinates)
+			const uint32_t brickSizeLog2 = cache.brickSizesLog2[lvlIdx];
+			if (brickSizeLog2 > 20 || (cache.layout == CacheLayout::Sparse && brickSizeLog2 != SPARSE_BRICK_SIZE_LOG2))
+				return false;
+			const uint32_t brickMask = (1 << brickSizeLog2) - 1;
+			const uint64_t numBricksX = (resolution.x + brickMask) >> brickSizeLog2;
+			const uint64_t numBricksY = (resolution.y + brickMask) >> brickSizeLog2;
+			const uint64_t numBricksZ = (resolution.z + brickMask) >> brickSizeLog2;
+
+			// The cells of the level must be in the moment buffer (through the brick table for the sparse layout)
+			if (cache.layout == CacheLayout::Sparse)
+			{
+				const uint64_t brickOffset = cache.brickOffsets[lvlIdx];
+				if (brickOffset > cache.brickTable.size() || !product_fits(numBricksX, numBricksY, numBricksZ, cache.brickTable.size() - brickOffset))
+					return false;
+			}
+			else
 			{
-				for (uint32_t y = 0; y < outputRes; ++y)
+				const uint64_t offset = cache.offsets[lvlIdx];
+				if (offset > cache.numMappedCells)
+					return false;
+				const uint64_t remainingCells = cache.numMappedCells - offset;
+				if (cache.layout == CacheLayout::Linear ? !product_fits(resolution.x, resolution.y, resolution.z, remainingCells) : !product_fits(numBricksX, numBricksY, numBricksZ, remainingCells >> (3 * brickSizeLog2)))
+					return false;
+			}
+		}
+
+		// Every brick of the sparse layout must point at a whole brick of the moment buffer
+		const uint64_t numSlots = cache.numMappedCells >> (3 * SPARSE_BRICK_SIZE_LOG2);
+		for (uint64_t brickIdx = 0; brickIdx < cache.brickTable.size(); ++brickIdx)
+		{
+			if (cache.brickTable[brickIdx] >= numSlots)
+				return false;
+		}
+		return true;
+	}
+
+	bool import_heuristic_cache(const char* path, uint64_t gridHash, HeuristicCache& cache)
+	{
+		// Map the file, it is unmapped on return unless the cache takes it
+		MappedFile file;
+		file.view = map_file(path, file.size);
+		if (file.view == nullptr)
+			return false;
+		const char* view = file.view;
+		const uint64_t fileSize = file.size;
+
+		// Make sure the file was built from this grid before reading anything else
+		const char* binaryPtr = view;
+		const char* end = view + fileSize;
+		uint32_t magic = 0, version = 0;
+		uint64_t fileGridHash = 0;
+		bool valid = unpack_checked(binaryPtr, end, magic) && unpack_checked(binaryPtr, end, version) && unpack_checked(binaryPtr, end, fileGridHash);
+		valid = valid && magic == CACHE_FILE_MAGIC && version == CACHE_FILE_VERSION && fileGridHash == gridHash;
+
+		// Description of the levels, read in a separate cache so that a truncated file leaves the current one untouched
+		HeuristicCache imported;
+		valid = valid && unpack_checked(binaryPtr, end, imported.layout) && unpack_checked(binaryPtr, end, imported.precision);
+		valid = valid && unpack_checked(binaryPtr, end, imported.numLevels) && unpack_checked(binaryPtr, end, imported.baseLevel);
+		valid = valid && unpack_checked(binaryPtr, end, imported.gridResolution);
+		valid = valid && unpack_vector_checked(binaryPtr, end, imported.resolutions) && unpack_vector_checked(binaryPtr, end, imported.brickSizesLog2);
+		valid = valid && unpack_vector_checked(binaryPtr, end, imported.offsets) && unpack_vector_checked(binaryPtr, end, imported.brickOffsets);
+		valid = valid && unpack_vector_checked(binaryPtr, end, imported.brickTable);
+		valid = valid && unpack_checked(binaryPtr, end, imported.numMappedCells);
+
+		// Every level must be described
+		valid = valid && imported.numLevels > 0 && imported.baseLevel < imported.numLevels;
+		valid = valid && imported.resolutions.size() == imported.numLevels && imported.brickSizesLog2.size() == imported.numLevels;
+		valid = valid && imported.offsets.size() == imported.numLevels && imported.brickOffsets.size() == imported.numLevels;
+		valid = valid && (uint32_t)imported.layout < (uint32_t)CacheLayout::Count && (uint32_t)imported.precision < (uint32_t)CachePrecision::Count;
+
+		// The moments are read in place and fill the rest of the file
+		const uint64_t momentOffset = ((uint64_t)(binaryPtr - view) + CACHE_FILE_ALIGNMENT - 1) / CACHE_FILE_ALIGNMENT * CACHE_FILE_ALIGNMENT;
+		const uint64_t cellSize = imported.precision == CachePrecision::Float16 ? sizeof(half4) : sizeof(float4);
+		valid = valid && momentOffset <= fileSize && imported.numMappedCells == (fileSize - momentOffset) / cellSize && momentOffset + imported.numMappedCells * cellSize == fileSize;
+
+		// Every cell the levels can address must be in the file
+		valid = valid && valid_cache_levels(imported);
+		if (!valid)
+			return false;
+
+		// Replace the current cache (its previous file is unmapped)
+		imported.mappedFile = std::move(file);
+		imported.mappedMomentOffset = momentOffset;
+		cache = std::move(imported);
+		return true;
+	}
+
+	void release_heuristic_cache(HeuristicCache& cache)
+	{
+		cache.mappedFile = MappedFile();
+		cache.mappedMomentOffset = 0;
+		cache.numMappedCells = 0;
+	}
+
+	uint64_t num_cells(const HeuristicCache& cache)
+	{
+		if (cache.mappedFile.view != nullptr)
+			return cache.numMappedCells;
+		return cache.precision == CachePrecision::Float16 ? cache.packedMomentArray.size() : cache.momentArray.size();
+	}
+
+	const float4* moment_buffer(const HeuristicCache& cache)
+	{
+		return cache.mappedFile.view != nullptr ? (const float4*)(cache.mappedFile.view + cache.mappedMomentOffset) : cache.momentArray.data();
+	}
+
+	const half4* packed_moment_buffer(const HeuristicCache& cache)
+	{
+		return cache.mappedFile.view != nullptr ? (const half4*)(cache.mappedFile.view + cache.mappedMomentOffset) : cache.packedMomentArray.data();
+	}
+
+	float4 cell_moments(const HeuristicCache& cache, uint64_t cellIdx)
+	{
+		if (cache.precision == CachePrecision::Float32)
+			return moment_buffer(cache)[cellIdx];
+
+		// Decode the four moments at once
+		const half4& packed = packed_moment_buffer(cache)[cellIdx];
+#if defined(__AVX2__)
+		float4 moments;
+		_mm_storeu_ps(&moments.x, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)&packed)));
+		return moments;
+#else
+		return { half_to_float(packed.x), half_to_float(packed.y), half_to_float(packed.z), half_to_float(packed.w) };
+#endif
+	}
+
+	uint32_t cache_level(const HeuristicCache& cache, uint32_t depth)
+	{
+		// Every cache level covers three subdivision depths
+		return (uint32_t)std::max((int32_t)(cache.baseLevel - (depth - 4) / 3), 0);
+	}
+
+	void position_to_cell(const HeuristicCache& cache, const float3& position, uint32_t level, uint32_t& x, uint32_t& y, uint32_t& z)
+	{
+		const uint3& gridRes = cache.gridResolution;
+
+		// Evalute the normalized positon
+		float3 normPos = position + float3({ 0.5, 0.5, 0.5 });
+
+		// Evalute the voxel coords, a cell of the level covers 2^(level + 1) voxels along every axis
+		x = (uint32_t)(std::clamp(int64_t(normPos.x * gridRes.x), (int64_t)0, (int64_t)gridRes.x - 1) >> (level + 1));
+		y = (uint32_t)(std::clamp(int64_t(normPos.y * gridRes.y), (int64_t)0, (int64_t)gridRes.y - 1) >> (level + 1));
+		z = (uint32_t)(std::clamp(int64_t(normPos.z * gridRes.z), (int64_t)0, (int64_t)gridRes.z - 1) >> (level + 1));
+	}
+
+	float4 sample_cache(const HeuristicCache& cache, const float3& position, uint32_t depth)
+	{
+		uint32_t cacheDepth = cache_level(cache, depth);
+		uint32_t coordX, coordY, coordZ;
+		position_to_cell(cache, position, cacheDepth, coordX, coordY, coordZ);
+		return cell_moments(cache, cell_index(cache, cacheDepth, coordX, coordY, coordZ));
+	}
+
+	bool sample_occupancy(const HeuristicCache& cache, const float3& position, uint32_t depth)
+	{
+		if (cache.layout != CacheLayout::Sparse)
+			return true;
+		uint32_t cacheDepth = cache_level(cache, depth);
+		uint32_t coordX, coordY, coordZ;
+		position_to_cell(cache, position, cacheDepth, coordX, coordY, coordZ);
+		return cell_occupied(cache, cacheDepth, coordX, coordY, coordZ);
+	}
+
+	void build_summed_area_tables(HeuristicCache& cache, uint32_t firstLevel)
+	{
+		assert_msg(firstLevel < cache.numLevels, "Invalid first level for the summed-area tables.");
+
+		// Allocate the tables, (resolution + 1)^3 entries per level where the first entry along every axis stays zero
+		cache.summedFirstLevel = firstLevel;
+		cache.summedOffsets.clear();
+		uint64_t totalSize = 0;
+		for (uint32_t lvlIdx = firstLevel; lvlIdx < cache.numLevels; ++lvlIdx)
+		{
+			const uint3& resolution = cache.resolutions[lvlIdx];
+			cache.summedOffsets.push_back(totalSize);
+			totalSize += (uint64_t)(resolution.x + 1) * (resolution.y + 1) * (resolution.z + 1);
+		}
+		cache.summedArray.assign(totalSize, { 0.0, 0.0 });
+
+		const uint3& gridRes = cache.gridResolution;
+		for (uint32_t lvlIdx = firstLevel; lvlIdx < cache.numLevels; ++lvlIdx)
+		{
+			const uint3& resolution = cache.resolutions[lvlIdx];
+			const uint64_t strideY = resolution.x + 1;
+			const uint64_t strideZ = strideY * (resolution.y + 1);
+			double2* table = cache.summedArray.data() + cache.summedOffsets[lvlIdx - firstLevel];
+			const uint32_t cellSize = 2u << lvlIdx;
+
+			// Sums of the voxels of the cells (the border cells cover fewer voxels), accumulated along x
+			#pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+			for (int32_t z = 0; z < (int32_t)resolution.z; ++z)
+			{
+				for (uint32_t y = 0; y < resolution.y; ++y)
 				{
-					for (uint32_t x = 0; x < outputRes; ++x)
+					const double numVoxelsYZ = (double)std::min(cellSize, gridRes.y - y * cellSize) * std::min(cellSize, gridRes.z - z * cellSize);
+					double2 rowSum = { 0.0, 0.0 };
+					double2* row = table + (y + 1) * strideY + (z + 1) * strideZ + 1;
+					for (uint32_t x = 0; x < resolution.x; ++x)
 					{
-						float minV = FLT_MAX;
-						float maxV = -FLT_MAX;
-						float mean = 0.0;
-						float mean2 = 0.0;
-						for (uint32_t lz = 0; lz < 2; ++lz)
-						{
-							for (uint32_t ly = 0; ly < 2; ++ly)
-							{
-								for (uint32_t lx = 0; lx < 2; ++lx)
-								{
-									// Offset of the input cell
-									uint64_t offset = cache.offsets[lvlIdx - 1] + (uint64_t)x * 2 + (uint64_t)lx + (uint64_t)(y * 2 + ly) * inputRes + (uint64_t)(z * 2 + lz) * inputRes * inputRes;
-									const float4& data = cache.momentArray[offset];
-									// Contribute
-									mean += data.x;
-									mean2 += data.y;
-									minV = std::min(minV, data.z);
-									maxV = std::max(maxV, data.w);
-								}
-							}
-						}
+						const float4 moments = cell_moments(cache, cell_index(cache, lvlIdx, x, y, (uint32_t)z));
+						const double numVoxels = numVoxelsYZ * std::min(cellSize, gridRes.x - x * cellSize);
+						rowSum.x += moments.x * numVoxels;
+						rowSum.y += moments.y * numVoxels;
+						row[x] = rowSum;
+					}
+				}
+			}
 
-						// Normalize the average
-						uint64_t cacheOffset = cache.offsets[lvlIdx] + (uint64_t)x + (uint64_t)y * outputRes + (uint64_t)z * outputRes * outputRes;
-						cache.momentArray[cacheOffset] = { mean * 0.125f, mean2 * 0.125f, minV, maxV };
+			// Then along y
+			#pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+			for (int32_t z = 1; z <= (int32_t)resolution.z; ++z)
+			{
+				for (uint32_t y = 2; y <= resolution.y; ++y)
+				{
+					double2* row = table + y * strideY + z * strideZ;
+					const double2* previousRow = row - strideY;
+					for (uint32_t x = 1; x <= resolution.x; ++x)
+					{
+						row[x].x += previousRow[x].x;
+						row[x].y += previousRow[x].y;
 					}
 				}
 			}
 
-			inputRes = outputRes;
-			outputRes = inputRes >> 1;
+			// Then along z
+			#pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+			for (int32_t y = 1; y <= (int32_t)resolution.y; ++y)
+			{
+				for (uint32_t z = 2; z <= resolution.z; ++z)
+				{
+					double2* row = table + y * strideY + z * strideZ;
+					const double2* previousRow = row - strideZ;
+					for (uint32_t x = 1; x <= resolution.x; ++x)
+					{
+						row[x].x += previousRow[x].x;
+						row[x].y += previousRow[x].y;
+					}
+				}
+			}
 		}
 	}
 
-	float4 sample_cache(const HeuristicCache& cache, const float3& position, uint32_t depth)
+	float2 sample_box_statistics(const HeuristicCache& cache, const float3& boxMin, const float3& boxMax, uint32_t depth)
 	{
-		int32_t cacheDepth = std::max((int32_t)(cache.numLevels - (depth - 4) / 3 - 1), 0);
-		uint32_t resolution = cache.resolutions[cacheDepth];
-		uint64_t offset = cache.offsets[cacheDepth];
+		assert_msg(!cache.summedOffsets.empty(), "The summed-area tables have not been built.");
 
-		// Evalute the normalized positon
-		float3 normPos = position + float3({ 0.5, 0.5, 0.5 });
+		// Cells of the level that overlap the box
+		const uint32_t level = std::max(cache_level(cache, depth), cache.summedFirstLevel);
+		uint32_t minX, minY, minZ, maxX, maxY, maxZ;
+		position_to_cell(cache, boxMin, level, minX, minY, minZ);
+		position_to_cell(cache, boxMax, level, maxX, maxY, maxZ);
 
-		// Evalute the coords
-		int64_t coordX = int64_t(normPos.x * resolution);
-		int64_t coordY = int64_t(normPos.y * resolution);
-		int64_t coordZ = int64_t(normPos.z * resolution);
-		return cache.momentArray[offset + coordX + coordY * resolution + resolution * resolution * coordZ];
+		// Sums over the box from the 8 corners of the table (the corners that take an odd number of upper bounds are added)
+		const uint3& resolution = cache.resolutions[level];
+		const uint64_t strideY = resolution.x + 1;
+		const uint64_t strideZ = strideY * (resolution.y + 1);
+		const double2* table = cache.summedArray.data() + cache.summedOffsets[level - cache.summedFirstLevel];
+		double2 sum = { 0.0, 0.0 };
+		for (uint32_t cornerIdx = 0; cornerIdx < 8; ++cornerIdx)
+		{
+			const uint64_t x = (cornerIdx & 1) ? maxX + 1 : minX;
+			const uint64_t y = (cornerIdx & 2) ? maxY + 1 : minY;
+			const uint64_t z = (cornerIdx & 4) ? maxZ + 1 : minZ;
+			const double sign = ((cornerIdx ^ (cornerIdx >> 1) ^ (cornerIdx >> 2)) & 1) ? 1.0 : -1.0;
+			const double2& entry = table[x + y * strideY + z * strideZ];
+			sum.x += sign * entry.x;
+			sum.y += sign * entry.y;
+		}
+
+		// Number of voxels covered by the cells
+		const uint3& gridRes = cache.gridResolution;
+		const uint32_t cellSize = 2u << level;
+		const double numVoxels = (double)(std::min((maxX + 1) * cellSize, gridRes.x) - minX * cellSize)
+			* (std::min((maxY + 1) * cellSize, gridRes.y) - minY * cellSize)
+			* (std::min((maxZ + 1) * cellSize, gridRes.z) - minZ * cellSize);
+
+		// Mean and variance (the cancellation can make it slightly negative)
+		const double mean = sum.x / numVoxels;
+		const double variance = std::max(sum.y / numVoxels - mean * mean, 0.0);
+		return { (float)mean, (float)variance };
+	}
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+	: view(other.view), size(other.size)
+{
+	other.view = nullptr;
+	other.size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	if (this != &other)
+	{
+		if (view != nullptr)
+			heuristic_cache::unmap_file(view, size);
+		view = other.view;
+		size = other.size;
+		other.view = nullptr;
+		other.size = 0;
 	}
+	return *this;
 }
 
+MappedFile::~MappedFile()
+{
+	if (view != nullptr)
+		heuristic_cache::unmap_file(view, size);
+}
@@ -3,25 +3,60 @@
 #include "volume/leb_3d_cache.h"
 #include "math/operators.h"
 
-Leb3DCache::Leb3DCache()
-{
-    // Keep the cache depth
-    m_CacheDepth = LEB_CACHE_SIZE;
-    uint32_t matrixCount = 2ULL << m_CacheDepth;
-    m_Cache.resize(matrixCount);
+// Bounds of the cache depth (the tables weigh 65 bytes per node and base type, and are evaluated by the compiler)
+static_assert(LEB_CACHE_SIZE >= 1 && LEB_CACHE_SIZE <= 12, "Unsupported LEB cache size.");
 
-    // Build the CPU table
-    leb__IdentityMatrix4x4(m_Cache[0]);
+struct Leb3DCacheTables
+{
+    float matrices[LEB_NUM_TYPES][LEB_CACHE_MATRIX_COUNT][16];
+    uint8_t types[LEB_NUM_TYPES][LEB_CACHE_MATRIX_COUNT];
+};
 
-    // Build the caches
-    for (uint64_t heapID = 1ULL; heapID < (2ULL << m_CacheDepth); ++heapID)
+static constexpr Leb3DCacheTables generate_cache_tables()
+{
+    Leb3DCacheTables tables = {};
+    for (uint8_t baseType = 0; baseType < LEB_NUM_TYPES; ++baseType)
     {
-        float4x4 mat;
-        leb__DecodeTransformationMatrix(heapID, 0, mat);
-        m_Cache[heapID] = mat;
+        // The root (and the unused slot 0) is the identity
+        for (uint32_t heapID = 0; heapID < 2; ++heapID)
+        {
+            for (uint32_t coeffIdx = 0; coeffIdx < 16; ++coeffIdx)
+                tables.matrices[baseType][heapID][coeffIdx] = (coeffIdx % 5) == 0 ? 1.0f : 0.0f;
+            tables.types[baseType][heapID] = baseType;
+        }
+
+        // Every node splits its parent, same operations as the uncached leb__DecodeTransformationMatrix
+        for (uint32_t heapID = 2; heapID < LEB_CACHE_MATRIX_COUNT; ++heapID)
+        {
+            const uint32_t parentID = heapID >> 1;
+            const uint64_t bitValue = heapID & 1;
+            const uint8_t parentType = tables.types[baseType][parentID];
+            float splitMatrix[16] = {};
+            leb__SplittingCoefficients(bitValue, parentType, splitMatrix);
+            leb__Matrix4x4Product(splitMatrix, tables.matrices[baseType][parentID], tables.matrices[baseType][heapID]);
+            tables.types[baseType][heapID] = leb__ChildType(parentType, bitValue);
+        }
     }
+    return tables;
+}
+
+// Tables shared by the whole process
+static constexpr Leb3DCacheTables g_CacheTables = generate_cache_tables();
+
+Leb3DCache::Leb3DCache()
+{
 }
 
 Leb3DCache::~Leb3DCache()
 {
 }
+
+const float4x4* Leb3DCache::get_cache() const
+{
+    return (const float4x4*)&g_CacheTables.matrices[0][0][0];
+}
+
+const uint8_t* Leb3DCache::get_types() const
+{
+    return &g_CacheTables.types[0][0];
+}
@@ -4,8 +4,11 @@
 #include "volume/leb_3d_eval.h"
 #include "math/operators.h"
 #include "tools/security.h"
+#include "tools/parallel.h"
 
 // External includes
+#include <algorithm>
+#include <atomic>
 #include <map>
 
 namespace leb_volume
@@ -39,7 +42,7 @@ namespace leb_volume
         float4 baseAttributes[3] = { {p0.x, p1.x, p2.x, p3.x}, {p0.y, p1.y, p2.y, p3.y}, {p0.z, p1.z, p2.z, p3.z} };
 
         // Decode
-        leb_DecodeNodeAttributeArray(subHeapID, baseType, cache.get_cache(), baseAttributes);
+        leb_DecodeNodeAttributeArray(subHeapID, baseType, cache.get_cache(), cache.get_types(), baseAttributes);
 
         // Fill the child triangle
         tetra.p[0] = float3({ baseAttributes[0].x, baseAttributes[1].x, baseAttributes[2].x });
@@ -48,6 +51,54 @@ namespace leb_volume
         tetra.p[3] = float3({ baseAttributes[0].w, baseAttributes[1].w, baseAttributes[2].w });
     }
 
+    void split_base_primitives(uint32_t numElements, const uint64_t* heapIDs, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes,
+        std::vector<uint64_t>& subHeapIDs, std::vector<uint8_t>& subBaseTypes, std::vector<float4>& attributes)
+    {
+        // Split every heapID into its base primitive and its heapID in the sub tree, like evaluate_tetrahedron
+        subHeapIDs.resize(numElements);
+        subBaseTypes.resize(numElements);
+        attributes.resize(3 * numElements);
+        for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+        {
+            uint64_t heapID = heapIDs[eleIdx];
+            uint64_t subTreeDepth = leb__FindMSB(heapID) - minDepth;
+            uint32_t primitiveID = uint32_t((heapID >> subTreeDepth) - (1uLL << minDepth));
+            uint64_t mask = subTreeDepth != 0uL ? 0xFFFFFFFFFFFFFFFFull >> (64ull - subTreeDepth) : 0ull;
+            subHeapIDs[eleIdx] = (mask & heapID) + (1ull << subTreeDepth);
+            subBaseTypes[eleIdx] = baseTypes[primitiveID];
+
+            // Grab the base positions of the element
+            const float3* p = &basePoints[4 * primitiveID];
+            attributes[3 * eleIdx] = { p[0].x, p[1].x, p[2].x, p[3].x };
+            attributes[3 * eleIdx + 1] = { p[0].y, p[1].y, p[2].y, p[3].y };
+            attributes[3 * eleIdx + 2] = { p[0].z, p[1].z, p[2].z, p[3].z };
+        }
+    }
+
+    void fill_tetrahedra(uint32_t numElements, const std::vector<float4>& attributes, Tetrahedron* tetras)
+    {
+        for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+        {
+            const float4* baseAttributes = &attributes[3 * eleIdx];
+            tetras[eleIdx].p[0] = float3({ baseAttributes[0].x, baseAttributes[1].x, baseAttributes[2].x });
+            tetras[eleIdx].p[1] = float3({ baseAttributes[0].y, baseAttributes[1].y, baseAttributes[2].y });
+            tetras[eleIdx].p[2] = float3({ baseAttributes[0].z, baseAttributes[1].z, baseAttributes[2].z });
+            tetras[eleIdx].p[3] = float3({ baseAttributes[0].w, baseAttributes[1].w, baseAttributes[2].w });
+        }
+    }
+
+    void evaluate_tetrahedra(uint32_t numElements, const uint64_t* heapIDs, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes, const Leb3DCache& cache, Tetrahedron* tetras)
+    {
+        std::vector<uint64_t> subHeapIDs;
+        std::vector<uint8_t> subBaseTypes;
+        std::vector<float4> attributes;
+        split_base_primitives(numElements, heapIDs, minDepth, basePoints, baseTypes, subHeapIDs, subBaseTypes, attributes);
+
+        // Decode all of them at once, grouped by depth and 8 at a time when AVX2 is available
+        leb_DecodeNodeAttributeArrays(numElements, subHeapIDs.data(), subBaseTypes.data(), cache.get_cache(), cache.get_types(), attributes.data());
+        fill_tetrahedra(numElements, attributes, tetras);
+    }
+
     void evaluate_tetrahedron(uint64_t heapID, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes, Tetrahedron& tetra)
     {
         // Get the depth of the element
@@ -76,8 +127,8 @@ namespace leb_volume
         // Generate the triangle positions
         float4 baseAttributes[3] = { {p0.x, p1.x, p2.x, p3.x}, {p0.y, p1.y, p2.y, p3.y}, {p0.z, p1.z, p2.z, p3.z} };
 
-        // Decode
-        leb_DecodeNodeAttributeArray(subHeapID, baseType, baseAttributes);
+        // Decode on the lattice, the weights are exact and the position is rounded once
+        leb_DecodeNodeAttributeArrayLattice(subHeapID, baseType, baseAttributes);
 
         // Fill the child triangle
         tetra.p[0] = float3({ baseAttributes[0].x, baseAttributes[1].x, baseAttributes[2].x });
@@ -86,67 +137,211 @@ namespace leb_volume
         tetra.p[3] = float3({ baseAttributes[0].w, baseAttributes[1].w, baseAttributes[2].w });
     }
 
-    void evaluate_face_centers(const LEBVolume& lebVolume, std::vector<float3>& faceCenters)
+    void evaluate_tetrahedra(uint32_t numElements, const uint64_t* heapIDs, uint32_t minDepth, const std::vector<float3>& basePoints, const std::vector<uint8_t>& baseTypes, Tetrahedron* tetras)
     {
-        // Now we are going to check that the faces actually touch each other
-        faceCenters.resize(lebVolume.totalNumElements * 4);
+        std::vector<uint64_t> subHeapIDs;
+        std::vector<uint8_t> subBaseTypes;
+        std::vector<float4> attributes;
+        split_base_primitives(numElements, heapIDs, minDepth, basePoints, baseTypes, subHeapIDs, subBaseTypes, attributes);
+
+        // Decode all of them at once on the lattice, grouped by depth and base type and 8 at a time when AVX2 is available
+        leb_DecodeNodeAttributeArraysLattice(numElements, subHeapIDs.data(), subBaseTypes.data(), attributes.data());
+        fill_tetrahedra(numElements, attributes, tetras);
+    }
+
+    // Vertices of the 4 faces of a tetrahedron, same order as the neighbors
+    const uint32_t g_FaceVertices[4][3] = { { 0, 1, 2 }, { 0, 3, 1 }, { 1, 3, 2 }, { 0, 2, 3 } };
+
+    // Steps of the vertex keys along the edge of the cube (log2), every coordinate takes one more bit
+    const uint32_t g_VertexKeyStepsLog2 = 20;
+
+    // Deepest element below the base tetrahedrons whose vertices are exactly on the key lattice (the base vertices are on the half cube lattice, their
+    // descendants at depth d on the 2^-floor((d + 4) / 3) one), this covers every 64 bit heapID of the cube
+    const uint32_t g_MaxVertexKeyDepth = 3 * g_VertexKeyStepsLog2 - 2;
 
-        // Now we are going to check that the faces actually touch each other
-        for (uint32_t elementID = 0; elementID < lebVolume.totalNumElements; ++elementID)
+    uint64_t lattice_vertex_key(const float3& position)
+    {
+        // Coordinates on the lattice of the unit cube, 21 bits per axis (2^20 steps along the edge of the cube)
+        const double scale = (double)(1u << g_VertexKeyStepsLog2);
+        const uint64_t x = (uint64_t)(((double)position.x + 0.5) * scale + 0.5) & 0x1FFFFF;
+        const uint64_t y = (uint64_t)(((double)position.y + 0.5) * scale + 0.5) & 0x1FFFFF;
+        const uint64_t z = (uint64_t)(((double)position.z + 0.5) * scale + 0.5) & 0x1FFFFF;
+        return x | (y << 21) | (z << 42);
+    }
+
+    void face_key(const uint64_t vertexKeys[4], uint32_t faceIdx, uint64_t key[3])
+    {
+        // Sort the keys of the 3 vertices so that both sides of a face share the same key
+        uint64_t k0 = vertexKeys[g_FaceVertices[faceIdx][0]];
+        uint64_t k1 = vertexKeys[g_FaceVertices[faceIdx][1]];
+        uint64_t k2 = vertexKeys[g_FaceVertices[faceIdx][2]];
+        if (k0 > k1) std::swap(k0, k1);
+        if (k1 > k2) std::swap(k1, k2);
+        if (k0 > k1) std::swap(k0, k1);
+        key[0] = k0;
+        key[1] = k1;
+        key[2] = k2;
+    }
+
+    uint64_t hash_face_key(const uint64_t key[3])
+    {
+        // Multiply and fold every key, then finish with a 64 bit mix
+        uint64_t hash = 0x9E3779B97F4A7C15ull;
+        for (uint32_t keyIdx = 0; keyIdx < 3; ++keyIdx)
         {
-            // Read the heapID
-            uint64_t heapID = lebVolume.heapIDArray[elementID];
-            if (heapID == 0)
-                continue;
+            hash = (hash ^ key[keyIdx]) * 0xBF58476D1CE4E5B9ull;
+            hash ^= hash >> 31;
+        }
+        hash *= 0x94D049BB133111EBull;
+        return hash ^ (hash >> 29);
+    }
 
-            // Evaluate the positions
-            Tetrahedron tetra;
-            evaluate_tetrahedron(heapID, lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, tetra);
+    uint64_t evaluate_vertex_keys(const LEBVolume& volume, std::vector<uint64_t>& vertexKeys)
+    {
+        // Lattice key of the vertices of every element (0 for the unallocated ones), returns the number of elements too deep for their keys to be exact
+        const uint32_t numElements = volume.totalNumElements;
+        const uint32_t maxKeyDepth = volume.minimalDepth + g_MaxVertexKeyDepth;
+        vertexKeys.assign(4 * (uint64_t)numElements, 0);
+        const uint32_t batchSize = 256;
+        const int32_t numBatches = (int32_t)((numElements + batchSize - 1) / batchSize);
+        int64_t numDeepElements = 0;
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 4) reduction(+: numDeepElements)
+        for (int32_t batchIdx = 0; batchIdx < numBatches; ++batchIdx)
+        {
+            const uint32_t batchStart = batchIdx * batchSize;
+            const uint32_t batchEnd = std::min(batchStart + batchSize, numElements);
+
+            // Gather the allocated elements
+            uint64_t heapIDs[batchSize];
+            uint32_t elementIDs[batchSize];
+            uint32_t numAllocated = 0;
+            for (uint32_t elementID = batchStart; elementID < batchEnd; ++elementID)
+            {
+                if (volume.heapIDArray[elementID] == 0)
+                    continue;
+                heapIDs[numAllocated] = volume.heapIDArray[elementID];
+                elementIDs[numAllocated++] = elementID;
+                numDeepElements += leb__FindMSB(heapIDs[numAllocated - 1]) > maxKeyDepth;
+            }
 
-            // Compute the center of the faces
-            faceCenters[4 * elementID] = (tetra.p[0] + tetra.p[1] + tetra.p[2]) / 3.0f;
-            faceCenters[4 * elementID + 1] = (tetra.p[0] + tetra.p[3] + tetra.p[1]) / 3.0f;
-            faceCenters[4 * elementID + 2] = (tetra.p[1] + tetra.p[3] + tetra.p[2]) / 3.0f;
-            faceCenters[4 * elementID + 3] = (tetra.p[0] + tetra.p[2] + tetra.p[3]) / 3.0f;
+            // Evaluate them as a batch
+            Tetrahedron tetras[batchSize];
+            evaluate_tetrahedra(numAllocated, heapIDs, volume.minimalDepth, volume.basePoints, volume.baseTypes, tetras);
+            for (uint32_t allocIdx = 0; allocIdx < numAllocated; ++allocIdx)
+            {
+                for (uint32_t vertexIdx = 0; vertexIdx < 4; ++vertexIdx)
+                    vertexKeys[4 * (uint64_t)elementIDs[allocIdx] + vertexIdx] = lattice_vertex_key(tetras[allocIdx].p[vertexIdx]);
+            }
         }
+        return (uint64_t)numDeepElements;
     }
 
-    void evaluate_neighbors(const LEBVolume& volume, const std::vector<float3>& faceCenters, std::vector<uint4>& neighborsArray)
+    bool same_face(const std::vector<uint64_t>& vertexKeys, uint32_t faceID, const uint64_t key[3])
     {
-        // Now we are going to check that the faces actually touch each other
-        neighborsArray.resize(volume.totalNumElements);
-        memset(neighborsArray.data(), 0xff, volume.totalNumElements * sizeof(uint4));
-        for (uint32_t currentID = 0; currentID < volume.totalNumElements; ++currentID)
+        // Does the face have the same vertices as the key
+        uint64_t otherKey[3];
+        face_key(&vertexKeys[4 * (uint64_t)(faceID / 4)], faceID % 4, otherKey);
+        return otherKey[0] == key[0] && otherKey[1] == key[1] && otherKey[2] == key[2];
+    }
+
+    uint64_t insert_face(std::vector<uint64_t>& faceTable, const std::vector<uint64_t>& vertexKeys, const uint64_t key[3], uint64_t hash, uint32_t faceID, uint32_t& firstFaceID)
+    {
+        // Returns the slot of the key and the first face that was inserted with it
+        const uint64_t tableSize = faceTable.size();
+        assert_msg(faceID < UINT32_MAX, "The face identifier doesn't fit the face table.");
+        const uint64_t entry = (hash & 0xFFFFFFFF00000000ull) | ((uint64_t)faceID + 1);
+        for (uint64_t slot = hash % tableSize;; slot = slot + 1 == tableSize ? 0 : slot + 1)
         {
-            // If unallocated, skip
-            if (volume.heapIDArray[currentID] == 0)
-                continue;
+            // Claim the slot if it's empty
+            std::atomic_ref<uint64_t> slotRef(faceTable[slot]);
+            uint64_t current = slotRef.load(std::memory_order_relaxed);
+            if (current == 0 && slotRef.compare_exchange_strong(current, entry, std::memory_order_relaxed))
+            {
+                firstFaceID = faceID;
+                return slot;
+            }
 
-            // Assign the neighbors
-            uint4 neighbors = { UINT32_MAX, UINT32_MAX , UINT32_MAX , UINT32_MAX };
+            // Otherwise compare the vertices of the face that claimed it (the hashes can collide)
+            if ((current >> 32) == (entry >> 32) && same_face(vertexKeys, (uint32_t)current - 1, key))
+            {
+                firstFaceID = (uint32_t)current - 1;
+                return slot;
+            }
+        }
+    }
 
-            // Compute the center of the faces
-            for (uint32_t faceIdx = 0; faceIdx < 4; ++faceIdx)
+    uint64_t find_face(const std::vector<uint64_t>& faceTable, const std::vector<uint64_t>& vertexKeys, const uint64_t key[3], uint64_t hash)
+    {
+        // Same probing as insert_face, once all the faces are inserted (UINT64_MAX if the key is not in the table)
+        const uint64_t tableSize = faceTable.size();
+        for (uint64_t slot = hash % tableSize;; slot = slot + 1 == tableSize ? 0 : slot + 1)
+        {
+            const uint64_t current = faceTable[slot];
+            if (current == 0)
+                return UINT64_MAX;
+            if ((current >> 32) == (hash >> 32) && same_face(vertexKeys, (uint32_t)current - 1, key))
+                return slot;
+        }
+    }
+
+    void evaluate_neighbors(const LEBVolume& volume, std::vector<uint4>& neighborsArray)
+    {
+        // The faces are identified by 4 * elementID + faceIdx + 1 on 32 bits
+        const uint32_t numElements = volume.totalNumElements;
+        assert_msg(numElements < (1u << 30), "Too many elements to match their faces.");
+
+        // Lattice key of the vertices of every element, the faces would be matched approximately past the depth of the lattice
+        std::vector<uint64_t> vertexKeys;
+        const uint64_t numDeepElements = evaluate_vertex_keys(volume, vertexKeys);
+        assert_msg(numDeepElements == 0, "Elements too deep to match their faces.");
+
+        // Open addressing table of the faces, a slot holds the upper half of the hash of a face and the identifier of the first face that claimed it (0 if empty)
+        std::vector<uint64_t> faceTable(4 * (uint64_t)numElements + 1, 0);
+
+        // Insert every face, the second face of a key links both elements
+        neighborsArray.resize(numElements);
+        memset(neighborsArray.data(), 0xff, numElements * sizeof(uint4));
+        const uint32_t groupSize = 16;
+        const int32_t numGroups = (int32_t)((numElements + groupSize - 1) / groupSize);
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 64)
+        for (int32_t groupIdx = 0; groupIdx < numGroups; ++groupIdx)
+        {
+            const uint32_t groupStart = groupIdx * groupSize;
+            const uint32_t groupEnd = std::min(groupStart + groupSize, numElements);
+
+            // Hash the faces of the group first, so that their slots are requested together
+            uint64_t keys[groupSize][4][3];
+            uint64_t hashes[groupSize][4];
+            for (uint32_t elementID = groupStart; elementID < groupEnd; ++elementID)
             {
-                float dist = FLT_MAX;
-                const float3& faceCenter = faceCenters[4 * currentID + faceIdx];
-                for (uint32_t nID = 0; nID < volume.totalNumElements; ++nID)
+                for (uint32_t faceIdx = 0; faceIdx < 4; ++faceIdx)
+                {
+                    face_key(&vertexKeys[4 * (uint64_t)elementID], faceIdx, keys[elementID - groupStart][faceIdx]);
+                    hashes[elementID - groupStart][faceIdx] = hash_face_key(keys[elementID - groupStart][faceIdx]);
+#if defined(__AVX2__)
+                    _mm_prefetch((const char*)&faceTable[hashes[elementID - groupStart][faceIdx] % faceTable.size()], _MM_HINT_T0);
+#endif
+                }
+            }
+
+            for (uint32_t elementID = groupStart; elementID < groupEnd; ++elementID)
+            {
+                // If unallocated, skip
+                if (volume.heapIDArray[elementID] == 0)
+                    continue;
+
+                for (uint32_t faceIdx = 0; faceIdx < 4; ++faceIdx)
                 {
-                    if (nID == currentID)
-                        continue;
-                    for (uint32_t nfaceIdx = 0; nfaceIdx < 4; ++nfaceIdx)
+                    const uint32_t faceID = 4 * elementID + faceIdx;
+                    uint32_t otherFace;
+                    insert_face(faceTable, vertexKeys, keys[elementID - groupStart][faceIdx], hashes[elementID - groupStart][faceIdx], faceID, otherFace);
+                    if (otherFace != faceID)
                     {
-                        float cDist = length(faceCenter - faceCenters[4 * nID + nfaceIdx]);
-                        if (cDist < 0.001 && cDist < dist)
-                        {
-                            dist = cDist;
-                            at(neighbors, faceIdx) = nID;
-                        }
+                        at(neighborsArray[otherFace / 4], otherFace % 4) = elementID;
+                        at(neighborsArray[elementID], faceIdx) = otherFace / 4;
                     }
                 }
             }
-
-            neighborsArray[currentID] = neighbors;
         }
     }
 
@@ -156,24 +351,48 @@ namespace leb_volume
 
         // Allocate the memory space
         vertices.resize(4 * lebVolume.totalNumElements);
-        #pragma omp parallel for num_threads(16)
-        for (int32_t elementID = 0; elementID < (int32_t)lebVolume.totalNumElements; ++elementID)
+        const uint32_t batchSize = 256;
+        const int32_t numBatches = (int32_t)((lebVolume.totalNumElements + batchSize - 1) / batchSize);
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 4)
+        for (int32_t batchIdx = 0; batchIdx < numBatches; ++batchIdx)
         {
-            // Read the heapID
-            uint64_t heapID = lebVolume.heapIDArray[elementID];
-
-            // Execute
-            Tetrahedron tetra;
-            if ((lebVolume.modifArray[elementID] & 0x2) == 2)
-                evaluate_tetrahedron(heapID, lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, lebCache, tetra);
-            else
-                tetra = lebVolume.tetraCacheArray[elementID];
-
-            // Export it to the buffer
-            vertices[4 * elementID] = tetra.p[0];
-            vertices[4 * elementID + 1] = tetra.p[1];
-            vertices[4 * elementID + 2] = tetra.p[2];
-            vertices[4 * elementID + 3] = tetra.p[3];
+            const uint32_t batchStart = batchIdx * batchSize;
+            const uint32_t batchEnd = std::min(batchStart + batchSize, lebVolume.totalNumElements);
+
+            // Gather the elements that need to be evaluated, the others are read from the cache
+            uint64_t heapIDs[batchSize];
+            uint32_t elementIDs[batchSize];
+            uint32_t numInvalid = 0;
+            for (uint32_t elementID = batchStart; elementID < batchEnd; ++elementID)
+            {
+                if ((lebVolume.modifArray[elementID] & 0x2) == 2)
+                {
+                    heapIDs[numInvalid] = lebVolume.heapIDArray[elementID];
+                    elementIDs[numInvalid++] = elementID;
+                }
+                else
+                {
+                    const Tetrahedron& tetra = lebVolume.tetraCacheArray[elementID];
+                    vertices[4 * elementID] = tetra.p[0];
+                    vertices[4 * elementID + 1] = tetra.p[1];
+                    vertices[4 * elementID + 2] = tetra.p[2];
+                    vertices[4 * elementID + 3] = tetra.p[3];
+                }
+            }
+
+            // Evaluate them as a batch
+            Tetrahedron tetras[batchSize];
+            evaluate_tetrahedra(numInvalid, heapIDs, lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, lebCache, tetras);
+
+            // Export them to the buffer
+            for (uint32_t invalidIdx = 0; invalidIdx < numInvalid; ++invalidIdx)
+            {
+                const uint32_t elementID = elementIDs[invalidIdx];
+                vertices[4 * elementID] = tetras[invalidIdx].p[0];
+                vertices[4 * elementID + 1] = tetras[invalidIdx].p[1];
+                vertices[4 * elementID + 2] = tetras[invalidIdx].p[2];
+                vertices[4 * elementID + 3] = tetras[invalidIdx].p[3];
+            }
         }
     }
 
@@ -266,45 +485,11 @@ namespace leb_volume
         for (uint32_t idx = 0; idx < g_BaseTetraCount; ++idx)
             lebVolume.baseTypes[idx] = 0;
 
-        // Evaluate the face centers of each face
-        std::vector<float3> faceCenters;
-        evaluate_face_centers(lebVolume, faceCenters);
-
-        // Now we are going to check that the faces actually touch each other
-        lebVolume.neighborsArray.resize(g_BaseTetraCount);
-        for (uint32_t currentID = 0; currentID < g_BaseTetraCount; ++currentID)
-        {
-            if (lebVolume.heapIDArray[currentID] == 0)
-            {
-                lebVolume.neighborsArray[currentID] = { UINT32_MAX, UINT32_MAX , UINT32_MAX , UINT32_MAX };
-                continue;
-            }
-            uint4 neighbors = { UINT32_MAX, UINT32_MAX , UINT32_MAX , UINT32_MAX };
-
-            // Compute the center of the faces
-            for (uint32_t faceIdx = 0; faceIdx < 4; ++faceIdx)
-            {
-                float dist = FLT_MAX;
-                const float3& faceCenter = faceCenters[4 * currentID + faceIdx];
-                for (uint32_t nID = 0; nID < g_BaseTetraCount; ++nID)
-                {
-                    if (nID == currentID)
-                        continue;
-                    for (uint32_t nfaceIdx = 0; nfaceIdx < 4; ++nfaceIdx)
-                    {
-                        float cDist = length(faceCenter - faceCenters[4 * nID + nfaceIdx]);
-                        if (cDist < 0.001 && cDist < dist)
-                        {
-                            dist = cDist;
-                            at(neighbors, faceIdx) = nID;
-                        }
-                    }
-                }
-            }
-
-            // Record the neighbors pointer
-            lebVolume.neighborsArray[currentID] = neighbors;
-        }
+        // Match the faces of the base tetrahedrons
+        std::vector<uint4> neighborsArray;
+        evaluate_neighbors(lebVolume, neighborsArray);
+        for (uint32_t idx = 0; idx < g_BaseTetraCount; ++idx)
+            lebVolume.neighborsArray[idx] = neighborsArray[idx];
 
         // Cache structures used for the subdivision
         lebVolume.modifArray.resize(lebVolume.totalNumElements);
@@ -312,82 +497,225 @@ namespace leb_volume
         lebVolume.tetraCacheArray.resize(lebVolume.totalNumElements);
     }
 
-    bool is_on_external_face(const float3& pt)
+    void reserve_elements(LEBVolume& lebVolume, uint64_t numElements)
     {
-        return (abs(pt.x + 0.5f) < 0.00001)
-            || (abs(pt.x - 0.5f) < 0.00001)
-            || (abs(pt.y + 0.5f) < 0.00001)
-            || (abs(pt.y - 0.5f) < 0.00001)
-            || (abs(pt.z + 0.5f) < 0.00001)
-            || (abs(pt.z - 0.5f) < 0.00001);
+        lebVolume.heapIDArray.reserve(numElements);
+        lebVolume.typeArray.reserve(numElements);
+        lebVolume.neighborsArray.reserve(numElements);
+        lebVolume.modifArray.reserve(numElements);
+        lebVolume.depthArray.reserve(numElements);
+        lebVolume.tetraCacheArray.reserve(numElements);
+        lebVolume.diamondIDArray.reserve(numElements);
     }
 
-    void validate_cubic_volume(const LEBVolume& cpuVolume)
+    uint64_t element_capacity(const LEBVolume& lebVolume)
     {
-        // Evaluate the face centers of each face
-        std::vector<float3> faceCenters;
-        evaluate_face_centers(cpuVolume, faceCenters);
+        return lebVolume.heapIDArray.capacity();
+    }
 
-        // Build the right neighbor buffer
-        std::vector<uint4> neighborsArray;
-        evaluate_neighbors(cpuVolume, faceCenters, neighborsArray);
+    uint32_t lattice_coordinate(uint64_t vertexKey, uint32_t axis)
+    {
+        return (uint32_t)(vertexKey >> (21 * axis)) & 0x1FFFFF;
+    }
 
-        // Everyone must have a neighbor (except when the face is on an external face of the cube)
-        for (uint32_t eleID = 0; eleID < cpuVolume.totalNumElements; ++eleID)
+    bool on_cube_boundary(const uint64_t key[3])
+    {
+        // The 3 vertices of the face are on the same side of the cube
+        for (uint32_t axis = 0; axis < 3; ++axis)
         {
-            // Skip for an unallocated element
-            if (cpuVolume.heapIDArray[eleID] == 0)
-                continue;
+            const uint32_t coordinate = lattice_coordinate(key[0], axis);
+            if ((coordinate == 0 || coordinate == (1u << 20)) && lattice_coordinate(key[1], axis) == coordinate && lattice_coordinate(key[2], axis) == coordinate)
+                return true;
+        }
+        return false;
+    }
 
-            // Grab the geometric neighbors of this element
-            uint4 actualNeighbors = neighborsArray[eleID];
+    int64_t lattice_determinant(const uint64_t vertexKeys[4])
+    {
+        // Six times the signed volume of the tetrahedron in lattice units, the edges are at most 2^20 long so it fits on 64 bits
+        int64_t e[3][3];
+        for (uint32_t edgeIdx = 0; edgeIdx < 3; ++edgeIdx)
+        {
+            for (uint32_t axis = 0; axis < 3; ++axis)
+                e[edgeIdx][axis] = (int64_t)lattice_coordinate(vertexKeys[edgeIdx + 1], axis) - (int64_t)lattice_coordinate(vertexKeys[0], axis);
+        }
+        return e[0][0] * (e[1][1] * e[2][2] - e[1][2] * e[2][1])
+            - e[0][1] * (e[1][0] * e[2][2] - e[1][2] * e[2][0])
+            + e[0][2] * (e[1][0] * e[2][1] - e[1][1] * e[2][0]);
+    }
 
-            // If the face is  not an external face, it has to have a neighbor
-            if (!is_on_external_face(faceCenters[eleID * 4 + 0]))
-                assert(actualNeighbors.x != UINT32_MAX);
+    bool same_bisection_edge(const std::vector<uint64_t>& vertexKeys, uint32_t element0, uint32_t element1)
+    {
+        // The bisection edge of an element goes from its third to its fourth vertex
+        const uint64_t* keys0 = &vertexKeys[4 * (uint64_t)element0];
+        const uint64_t* keys1 = &vertexKeys[4 * (uint64_t)element1];
+        return std::min(keys0[2], keys0[3]) == std::min(keys1[2], keys1[3]) && std::max(keys0[2], keys0[3]) == std::max(keys1[2], keys1[3]);
+    }
 
-            // If the face is  not an external face, it has to have a neighbor
-            if (!is_on_external_face(faceCenters[eleID * 4 + 1]))
-                assert(actualNeighbors.y != UINT32_MAX);
+    bool consistent_diamond_members(const LEBVolume& volume, const std::vector<uint64_t>& vertexKeys, uint32_t element0, uint32_t element1)
+    {
+        return equivalent_types(volume.typeArray[element0], volume.typeArray[element1])
+            && leb__FindMSB(volume.heapIDArray[element0]) == leb__FindMSB(volume.heapIDArray[element1])
+            && same_bisection_edge(vertexKeys, element0, element1);
+    }
 
-            // If the face is  not an external face, it has to have a neighbor
-            if (!is_on_external_face(faceCenters[eleID * 4 + 2]))
-                assert(actualNeighbors.z != UINT32_MAX);
+    bool validate_cubic_volume(const LEBVolume& volume, VolumeValidation& validation)
+    {
+        // The faces are identified by 4 * elementID + faceIdx + 1 on 32 bits
+        const uint32_t numElements = volume.totalNumElements;
+        assert_msg(numElements < (1u << 30), "Too many elements to validate the volume.");
+        validation = VolumeValidation();
+
+        // Lattice key of the vertices of every element, the checks are exact on them (and meaningless past the depth of the lattice)
+        std::vector<uint64_t> vertexKeys;
+        validation.deepElements = evaluate_vertex_keys(volume, vertexKeys);
+        if (validation.deepElements != 0)
+            return false;
+
+        // Orientation of the base tetrahedrons, the bisection preserves it
+        const uint32_t numBaseTetras = (uint32_t)volume.baseTypes.size();
+        std::vector<int64_t> baseOrientations(numBaseTetras);
+        for (uint32_t primitiveID = 0; primitiveID < numBaseTetras; ++primitiveID)
+        {
+            uint64_t baseKeys[4];
+            for (uint32_t vertexIdx = 0; vertexIdx < 4; ++vertexIdx)
+                baseKeys[vertexIdx] = lattice_vertex_key(volume.basePoints[4 * primitiveID + vertexIdx]);
+            baseOrientations[primitiveID] = lattice_determinant(baseKeys) < 0 ? -1 : 1;
+        }
 
-            // If the face is  not an external face, it has to have a neighbor
-            if (!is_on_external_face(faceCenters[eleID * 4 + 3]))
-                assert(actualNeighbors.w != UINT32_MAX);
+        // Count the elements that share every face (saturated at 255)
+        std::vector<uint64_t> faceTable(4 * (uint64_t)numElements + 1, 0);
+        std::vector<uint8_t> faceCounts(faceTable.size(), 0);
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1024)
+        for (int32_t elementID = 0; elementID < (int32_t)numElements; ++elementID)
+        {
+            if (volume.heapIDArray[elementID] == 0)
+                continue;
+
+            for (uint32_t faceIdx = 0; faceIdx < 4; ++faceIdx)
+            {
+                // Insert the face in the table
+                uint64_t key[3];
+                face_key(&vertexKeys[4 * (uint64_t)elementID], faceIdx, key);
+                uint32_t firstFaceID;
+                const uint64_t slot = insert_face(faceTable, vertexKeys, key, hash_face_key(key), 4 * elementID + faceIdx, firstFaceID);
+
+                // Increment the counter of the slot
+                std::atomic_ref<uint8_t> countRef(faceCounts[slot]);
+                uint8_t count = countRef.load(std::memory_order_relaxed);
+                while (count < UINT8_MAX && !countRef.compare_exchange_weak(count, (uint8_t)(count + 1), std::memory_order_relaxed));
+            }
         }
 
-        // Compare the actual neighbors to the ones we are suppose to have
-        for (uint32_t eleID = 0; eleID < cpuVolume.totalNumElements; ++eleID)
+        // Check every element against its faces, its neighbors and its diamond
+        const bool hasDiamonds = volume.diamondIDArray.size() == numElements;
+        int64_t numAllocated = 0, mismatchedNeighbors = 0, asymmetricNeighbors = 0, openFaces = 0, overSharedFaces = 0, inconsistentDiamonds = 0, invertedElements = 0;
+        uint64_t volumeSum = 0;
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1024) reduction(+: numAllocated, mismatchedNeighbors, asymmetricNeighbors, openFaces, overSharedFaces, inconsistentDiamonds, invertedElements, volumeSum)
+        for (int32_t elementID = 0; elementID < (int32_t)numElements; ++elementID)
         {
-            if (cpuVolume.heapIDArray[eleID] == 0)
+            // If unallocated, skip
+            const uint64_t heapID = volume.heapIDArray[elementID];
+            if (heapID == 0)
                 continue;
+            numAllocated++;
+
+            // The element must have the orientation of its base tetrahedron and contributes to the volume of the cube
+            const uint32_t depth = leb__FindMSB(heapID);
+            const uint32_t primitiveID = (uint32_t)((heapID >> (depth - volume.minimalDepth)) - (1ull << volume.minimalDepth));
+            const int64_t determinant = lattice_determinant(&vertexKeys[4 * (uint64_t)elementID]);
+            if (primitiveID >= numBaseTetras || determinant == 0 || (determinant < 0) != (baseOrientations[primitiveID] < 0))
+                invertedElements++;
+            volumeSum += (uint64_t)(determinant < 0 ? -determinant : determinant);
+
+            bool consistentDiamond = true;
+            const uint4& neighbors = volume.neighborsArray[elementID];
+            for (uint32_t faceIdx = 0; faceIdx < 4; ++faceIdx)
+            {
+                // Number of elements that share this face, the first of them accounts for it
+                uint64_t key[3];
+                face_key(&vertexKeys[4 * (uint64_t)elementID], faceIdx, key);
+                const uint64_t slot = find_face(faceTable, vertexKeys, key, hash_face_key(key));
+                const uint32_t faceCount = faceCounts[slot];
+                if ((uint32_t)faceTable[slot] - 1 == 4 * (uint32_t)elementID + faceIdx)
+                {
+                    if (faceCount > 2 || (faceCount == 2 && on_cube_boundary(key)))
+                        overSharedFaces++;
+                    else if (faceCount == 1 && !on_cube_boundary(key))
+                        openFaces++;
+                }
 
-            uint4 actualNeighbors = cpuVolume.neighborsArray[eleID];
-            uint4 practialNeighobors = neighborsArray[eleID];
+                // A missing neighbor is only valid if nobody else shares the face
+                const uint32_t neighbor = at(neighbors, faceIdx);
+                if (neighbor == UINT32_MAX)
+                {
+                    if (faceCount > 1)
+                        mismatchedNeighbors++;
+                    continue;
+                }
 
-            if ((practialNeighobors.x != actualNeighbors.x)
-                || (practialNeighobors.y != actualNeighbors.y)
-                || (practialNeighobors.z != actualNeighbors.z)
-                || (practialNeighobors.w != actualNeighbors.w))
+                // Otherwise the neighbor has to be allocated and share the face
+                if (neighbor >= numElements || neighbor == (uint32_t)elementID || volume.heapIDArray[neighbor] == 0)
+                {
+                    mismatchedNeighbors++;
+                    continue;
+                }
+                uint32_t neighborFace = 0;
+                while (neighborFace < 4 && !same_face(vertexKeys, 4 * neighbor + neighborFace, key))
+                    neighborFace++;
+                if (neighborFace == 4)
+                {
+                    mismatchedNeighbors++;
+                    continue;
+                }
+
+                // And point back to us through it
+                if (at(volume.neighborsArray[neighbor], neighborFace) != (uint32_t)elementID)
+                    asymmetricNeighbors++;
+
+                // The neighbors around our bisection edge that share it belong to our diamond
+                if (faceIdx >= 2 && same_bisection_edge(vertexKeys, elementID, neighbor))
+                {
+                    if (!consistent_diamond_members(volume, vertexKeys, elementID, neighbor) || (hasDiamonds && volume.diamondIDArray[neighbor] != volume.diamondIDArray[elementID]))
+                        consistentDiamond = false;
+                }
+            }
+
+            // The members of the diamond of the element (if maintained) must all share its bisection edge
+            if (hasDiamonds)
             {
-                /*
-                // Put on the stack as much info as possible
-                uint8_t cType = cpuVolume.typeArray[eleID];
-                uint4 neigh = cpuVolume.neighborsArray[eleID];
-                uint8_t n0Type = cpuVolume.typeArray[neigh.x];
-                uint8_t n1Type = cpuVolume.typeArray[neigh.y];
-                uint8_t n2Type = cpuVolume.typeArray[neigh.z];
-                uint8_t n3Type = cpuVolume.typeArray[neigh.w];
-                float3 f0 = faceCenters[eleID * 4 + 0];
-                float3 f1 = faceCenters[eleID * 4 + 1];
-                float3 f2 = faceCenters[eleID * 4 + 2];
-                float3 f3 = faceCenters[eleID * 4 + 3];
-                */
-                assert_fail_msg("Validation failure.");
+                const uint32_t diamondID = volume.diamondIDArray[elementID];
+                if (diamondID >= volume.diamondTable.size())
+                    consistentDiamond = false;
+                else
+                {
+                    const DiamondRecord& record = volume.diamondTable[diamondID];
+                    bool registered = false;
+                    for (uint32_t memberIdx = 0; memberIdx < std::min(record.numMembers, 8u); ++memberIdx)
+                    {
+                        const uint32_t member = record.members[memberIdx];
+                        registered |= member == (uint32_t)elementID;
+                        if (member >= numElements || volume.heapIDArray[member] == 0 || !consistent_diamond_members(volume, vertexKeys, elementID, member))
+                            consistentDiamond = false;
+                    }
+                    consistentDiamond &= registered;
+                }
             }
+            if (!consistentDiamond)
+                inconsistentDiamonds++;
         }
+
+        // Fill the report, the volumes sum exactly to the one of the cube when the elements tile it
+        const uint64_t cubeVolume = 6ull << 60;
+        validation.numElements = (uint64_t)numAllocated;
+        validation.mismatchedNeighbors = (uint64_t)mismatchedNeighbors;
+        validation.asymmetricNeighbors = (uint64_t)asymmetricNeighbors;
+        validation.openFaces = (uint64_t)openFaces;
+        validation.overSharedFaces = (uint64_t)overSharedFaces;
+        validation.inconsistentDiamonds = (uint64_t)inconsistentDiamonds;
+        validation.invertedElements = (uint64_t)invertedElements;
+        validation.volumeRatio = (double)volumeSum / (double)cubeVolume;
+        validation.tilesCube = volumeSum == cubeVolume;
+        return validation.tilesCube && mismatchedNeighbors == 0 && asymmetricNeighbors == 0 && openFaces == 0 && overSharedFaces == 0 && inconsistentDiamonds == 0 && invertedElements == 0;
     }
 }
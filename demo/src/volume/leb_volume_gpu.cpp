@@ -3,6 +3,11 @@
 #include "volume/leb_volume_gpu.h"
 #include "volume/volume_generation.h"
 #include "tools/stream.h"
+#include "tools/parallel.h"
+
+// External includes
+#include <algorithm>
+#include <math.h>
 
 // Mapping of the indices to the faces of the tetrahedrons, ORDER MATTERS HERE
 const uint3 g_TriangleIndices[4] = { uint3(0, 1, 2), uint3(3, 1, 0), uint3(1, 3, 2), uint3(3, 0, 2) };
@@ -73,12 +78,13 @@ namespace leb_volume
         lebVolumeGPU.tetraData.resize(lebVolume.totalNumElements);
         lebVolumeGPU.centerArray.resize(lebVolume.totalNumElements);
         lebVolumeGPU.densityArray.resize(lebVolume.totalNumElements);
+        lebVolumeGPU.heapIDArray.resize(lebVolume.totalNumElements);
 
         // Tracking outside faces
         uint32_t outsideFaceIndex = 0;
 
         // Process each element
-        #pragma omp parallel for num_threads(32)
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 256)
         for (int32_t eleID = 0; eleID < (int32_t)lebVolume.totalNumElements; ++eleID)
         {
             // Tetra positions
@@ -95,6 +101,7 @@ namespace leb_volume
             data.neighbors = lebVolume.neighborsArray[eleID];
             data.density = depth < maxDepth ? leb_volume::mean_density_element(gridVolume, depth, tetra) : leb_volume::evaluate_grid_value(gridVolume, center);
             lebVolumeGPU.centerArray[eleID] = center;
+            lebVolumeGPU.heapIDArray[eleID] = lebVolume.heapIDArray[eleID];
 
             // Compute and export the plane equations
             for (uint32_t idx = 0; idx < 4; ++idx)
@@ -156,6 +163,106 @@ namespace leb_volume
         return compressedSize;
     }
 
+    uint64_t encode_lattice_position(const float3& position, const float3& origin, double step)
+    {
+        // Lattice coordinates along every axis (the differences and the divisions by a power of two are exact in double)
+        const double offsets[3] = { (double)position.x - (double)origin.x, (double)position.y - (double)origin.y, (double)position.z - (double)origin.z };
+        uint64_t latticePosition = 0;
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            const double coordinate = offsets[axis] / step;
+            const uint64_t latticeCoordinate = (uint64_t)coordinate;
+            if ((double)latticeCoordinate != coordinate || latticeCoordinate >= (1ull << LATTICE_POSITION_BITS))
+                return UINT64_MAX;
+            latticePosition |= latticeCoordinate << (axis * LATTICE_POSITION_BITS);
+        }
+        return latticePosition;
+    }
+
+    float3 decode_lattice_position(uint64_t latticePosition, const float3& origin, double step)
+    {
+        const uint64_t axisMask = (1ull << LATTICE_POSITION_BITS) - 1;
+        return float3({ (float)(origin.x + (double)(latticePosition & axisMask) * step),
+                        (float)(origin.y + (double)((latticePosition >> LATTICE_POSITION_BITS) & axisMask) * step),
+                        (float)(origin.z + (double)((latticePosition >> (2 * LATTICE_POSITION_BITS)) & axisMask) * step) });
+    }
+
+    bool encode_positions(const std::vector<float3>& positionArray, PositionEncoding encoding, PackedPositions& packedPositions)
+    {
+        // Nothing to encode
+        packedPositions = PackedPositions();
+        if (encoding == PositionEncoding::Float32 || positionArray.size() == 0)
+            return encoding == PositionEncoding::Float32;
+
+        // Bounding box of the positions
+        float3 minPosition = positionArray[0];
+        float3 maxPosition = positionArray[0];
+        for (const float3& position : positionArray)
+        {
+            minPosition = min(minPosition, position);
+            maxPosition = max(maxPosition, position);
+        }
+
+        // The lattice covers the box with 2^LATTICE_POSITION_BITS steps of a power of two
+        const float3 extent = maxPosition - minPosition;
+        int exponent = 0;
+        frexp((double)std::max(std::max(extent.x, extent.y), extent.z), &exponent);
+        const double step = ldexp(1.0, exponent - LATTICE_POSITION_BITS);
+
+        // Encode every position, and make sure it decodes to the same value
+        const uint32_t numPositions = (uint32_t)positionArray.size();
+        std::vector<uint64_t> latticeArray(numPositions);
+        uint32_t numInvalid = 0;
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 4096) reduction(+: numInvalid)
+        for (int32_t posIdx = 0; posIdx < (int32_t)numPositions; ++posIdx)
+        {
+            const float3& position = positionArray[posIdx];
+            latticeArray[posIdx] = encode_lattice_position(position, minPosition, step);
+            const float3 decoded = decode_lattice_position(latticeArray[posIdx], minPosition, step);
+            numInvalid += latticeArray[posIdx] == UINT64_MAX || decoded.x != position.x || decoded.y != position.y || decoded.z != position.z;
+        }
+        if (numInvalid != 0)
+            return false;
+
+        // Fill the packed positions
+        packedPositions.encoding = encoding;
+        packedPositions.origin = minPosition;
+        packedPositions.step = (float)step;
+        if (encoding == PositionEncoding::Lattice)
+        {
+            packedPositions.latticeArray = std::move(latticeArray);
+            return true;
+        }
+
+        // Keep every vertex once (sorted by lattice position), and index them per tetrahedron
+        packedPositions.latticeArray = latticeArray;
+        std::sort(packedPositions.latticeArray.begin(), packedPositions.latticeArray.end());
+        packedPositions.latticeArray.erase(std::unique(packedPositions.latticeArray.begin(), packedPositions.latticeArray.end()), packedPositions.latticeArray.end());
+        packedPositions.indexArray.resize(numPositions);
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 4096)
+        for (int32_t posIdx = 0; posIdx < (int32_t)numPositions; ++posIdx)
+            packedPositions.indexArray[posIdx] = (uint32_t)(std::lower_bound(packedPositions.latticeArray.begin(), packedPositions.latticeArray.end(), latticeArray[posIdx]) - packedPositions.latticeArray.begin());
+        return true;
+    }
+
+    void decode_positions(const PackedPositions& packedPositions, std::vector<float3>& positionArray)
+    {
+        // Float positions are stored as is
+        if (packedPositions.encoding == PositionEncoding::Float32)
+            return;
+
+        // Decode every vertex of every tetrahedron
+        const bool indexed = packedPositions.encoding == PositionEncoding::IndexedLattice;
+        const uint32_t numPositions = (uint32_t)(indexed ? packedPositions.indexArray.size() : packedPositions.latticeArray.size());
+        positionArray.resize(numPositions);
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 4096)
+        for (int32_t posIdx = 0; posIdx < (int32_t)numPositions; ++posIdx)
+        {
+            const uint64_t latticePosition = packedPositions.latticeArray[indexed ? packedPositions.indexArray[posIdx] : posIdx];
+            positionArray[posIdx] = decode_lattice_position(latticePosition, packedPositions.origin, (double)packedPositions.step);
+        }
+    }
+
     void import_leb_volume_gpu(const char* path, LEBVolumeGPU& lebVolume)
     {
         // Vector that will hold our packed mesh 
@@ -191,10 +298,30 @@ namespace leb_volume
 
         // Debug data
         unpack_vector_bytes(binaryPtr, lebVolume.positionArray);
+
+        // Packed positions, written after the float ones (the older files stop here)
+        if (binaryPtr < binaryFile.data() + binaryFile.size())
+        {
+            PackedPositions packedPositions;
+            unpack_bytes(binaryPtr, packedPositions.encoding);
+            unpack_bytes(binaryPtr, packedPositions.origin);
+            unpack_bytes(binaryPtr, packedPositions.step);
+            unpack_vector_bytes(binaryPtr, packedPositions.latticeArray);
+            unpack_vector_bytes(binaryPtr, packedPositions.indexArray);
+            decode_positions(packedPositions, lebVolume.positionArray);
+        }
+
+        // HeapIDs, used to locate points (the older files stop before)
+        if (binaryPtr < binaryFile.data() + binaryFile.size())
+            unpack_vector_bytes(binaryPtr, lebVolume.heapIDArray);
     }
 
-    void export_leb_volume_gpu(const LEBVolumeGPU& lebVolume, const char* path)
+    void export_leb_volume_gpu(const LEBVolumeGPU& lebVolume, const char* path, PositionEncoding positionEncoding)
     {
+        // Encode the positions, they are kept as float if they are not on the lattice
+        PackedPositions packedPositions;
+        encode_positions(lebVolume.positionArray, positionEncoding, packedPositions);
+
         // Vector that will hold our packed mesh 
         std::vector<char> binaryFile;
 
@@ -214,8 +341,17 @@ namespace leb_volume
         pack_vector_bytes(binaryFile, lebVolume.rtasPositionArray);
         pack_vector_bytes(binaryFile, lebVolume.outsideElements);
 
-        // Debug data
-        pack_vector_bytes(binaryFile, lebVolume.positionArray);
+        // Debug data, the float positions are left empty when they are packed
+        const std::vector<float3> emptyPositions;
+        pack_vector_bytes(binaryFile, packedPositions.encoding == PositionEncoding::Float32 ? lebVolume.positionArray : emptyPositions);
+        pack_bytes(binaryFile, packedPositions.encoding);
+        pack_bytes(binaryFile, packedPositions.origin);
+        pack_bytes(binaryFile, packedPositions.step);
+        pack_vector_bytes(binaryFile, packedPositions.latticeArray);
+        pack_vector_bytes(binaryFile, packedPositions.indexArray);
+
+        // HeapIDs
+        pack_vector_bytes(binaryFile, lebVolume.heapIDArray);
 
         // Write to disk
         FILE* pFile;
@@ -0,0 +1,155 @@
+// Internal includes
+#include "volume/point_locator.h"
+#include "volume/leb_3d_eval.h"
+#include "math/operators.h"
+#include "tools/parallel.h"
+
+// External includes
+#include <algorithm>
+#include <cstring>
+
+namespace point_locator
+{
+    void build_base_planes(PointLocator& locator)
+    {
+        // Inward plane of every face of the base tetrahedrons (the face of a vertex is the one opposite to it)
+        const uint32_t numBaseTetras = (uint32_t)locator.baseTypes.size();
+        locator.basePlanes.resize(4 * numBaseTetras);
+        for (uint32_t primitiveID = 0; primitiveID < numBaseTetras; ++primitiveID)
+        {
+            const float3* p = &locator.basePoints[4 * primitiveID];
+            for (uint32_t vertexIdx = 0; vertexIdx < 4; ++vertexIdx)
+            {
+                const float3& p0 = p[(vertexIdx + 1) % 4];
+                const float3& p1 = p[(vertexIdx + 2) % 4];
+                const float3& p2 = p[(vertexIdx + 3) % 4];
+                const double e0[3] = { (double)p1.x - p0.x, (double)p1.y - p0.y, (double)p1.z - p0.z };
+                const double e1[3] = { (double)p2.x - p0.x, (double)p2.y - p0.y, (double)p2.z - p0.z };
+                double4 plane = { e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0], 0.0 };
+                plane.w = -(plane.x * p0.x + plane.y * p0.y + plane.z * p0.z);
+                if (plane.x * p[vertexIdx].x + plane.y * p[vertexIdx].y + plane.z * p[vertexIdx].z + plane.w < 0.0)
+                    plane = { -plane.x, -plane.y, -plane.z, -plane.w };
+                locator.basePlanes[4 * primitiveID + vertexIdx] = plane;
+            }
+        }
+    }
+
+    template<typename HeapIDArray>
+    void build_element_map(const HeapIDArray& heapIDs, uint32_t numElements, PointLocator& locator)
+    {
+        // Element of every heapID, and the range of depths the descent has to look them up in
+        locator.shallowestDepth = UINT32_MAX;
+        locator.maximalDepth = locator.minimalDepth;
+        locator.elementMap.clear();
+        locator.elementMap.reserve(numElements);
+        for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+        {
+            const uint64_t heapID = heapIDs[eleIdx];
+            const uint32_t depth = (uint32_t)leb__FindMSB(heapID);
+            locator.elementMap[heapID] = eleIdx;
+            locator.shallowestDepth = std::min(locator.shallowestDepth, depth);
+            locator.maximalDepth = std::max(locator.maximalDepth, depth);
+        }
+    }
+
+    void build_point_locator(const LEBVolume& lebVolume, PointLocator& locator)
+    {
+        // Base tetrahedrons
+        locator.minimalDepth = lebVolume.minimalDepth;
+        locator.basePoints = lebVolume.basePoints;
+        locator.baseTypes = lebVolume.baseTypes;
+        build_base_planes(locator);
+        build_element_map(lebVolume.heapIDArray, lebVolume.totalNumElements, locator);
+    }
+
+    void build_point_locator(uint32_t numElements, const uint64_t* heapIDs, PointLocator& locator)
+    {
+        // Base tetrahedrons of the cube
+        LEBVolume cubeVolume;
+        leb_volume::create_type0_cube(cubeVolume);
+        locator.minimalDepth = cubeVolume.minimalDepth;
+        locator.basePoints = cubeVolume.basePoints;
+        locator.baseTypes = cubeVolume.baseTypes;
+        build_base_planes(locator);
+        build_element_map(heapIDs, numElements, locator);
+    }
+
+    uint32_t locate_point(const PointLocator& locator, const float3& position)
+    {
+        const double target[3] = { position.x, position.y, position.z };
+
+        // Find the base tetrahedron that contains the position (the faces are inclusive)
+        const uint32_t numBaseTetras = (uint32_t)locator.baseTypes.size();
+        uint32_t primitiveID = 0;
+        for (; primitiveID < numBaseTetras; ++primitiveID)
+        {
+            const double4* planes = &locator.basePlanes[4 * primitiveID];
+            uint32_t faceIdx = 0;
+            while (faceIdx < 4 && planes[faceIdx].x * target[0] + planes[faceIdx].y * target[1] + planes[faceIdx].z * target[2] + planes[faceIdx].w >= 0.0)
+                faceIdx++;
+            if (faceIdx == 4)
+                break;
+        }
+        if (primitiveID == numBaseTetras)
+            return UINT32_MAX;
+
+        // Vertices of the current node
+        double vertices[4][3];
+        for (uint32_t vertexIdx = 0; vertexIdx < 4; ++vertexIdx)
+        {
+            const float3& basePoint = locator.basePoints[4 * primitiveID + vertexIdx];
+            vertices[vertexIdx][0] = basePoint.x;
+            vertices[vertexIdx][1] = basePoint.y;
+            vertices[vertexIdx][2] = basePoint.z;
+        }
+
+        // Descend the tree until we reach an element of the volume
+        uint64_t heapID = (1ull << locator.minimalDepth) + primitiveID;
+        uint8_t type = locator.baseTypes[primitiveID];
+        for (uint32_t depth = locator.minimalDepth; depth <= locator.maximalDepth; ++depth)
+        {
+            // No element is shallower than shallowestDepth
+            if (depth >= locator.shallowestDepth)
+            {
+                auto element = locator.elementMap.find(heapID);
+                if (element != locator.elementMap.end())
+                    return element->second;
+            }
+
+            // Both children share v0, v1 and the midpoint of v2 and v3, the first one keeps v2
+            double e0[3], e1[3], e2[3], e3[3];
+            for (uint32_t axis = 0; axis < 3; ++axis)
+            {
+                e0[axis] = vertices[1][axis] - vertices[0][axis];
+                e1[axis] = 0.5 * (vertices[2][axis] + vertices[3][axis]) - vertices[0][axis];
+                e2[axis] = vertices[2][axis] - vertices[0][axis];
+                e3[axis] = target[axis] - vertices[0][axis];
+            }
+            const double normal[3] = { e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0] };
+            const double side = (normal[0] * e3[0] + normal[1] * e3[1] + normal[2] * e3[2]) * (normal[0] * e2[0] + normal[1] * e2[1] + normal[2] * e2[2]);
+            const uint64_t bitValue = side < 0.0 ? 1 : 0;
+
+            // Vertices of the child, same rows as the splitting matrices
+            float coefficients[16];
+            leb__SplittingCoefficients(bitValue, type, coefficients);
+            double children[4][3];
+            for (uint32_t row = 0; row < 4; ++row)
+            {
+                const float* c = coefficients + 4 * row;
+                for (uint32_t axis = 0; axis < 3; ++axis)
+                    children[row][axis] = vertices[0][axis] * c[0] + vertices[1][axis] * c[1] + vertices[2][axis] * c[2] + vertices[3][axis] * c[3];
+            }
+            memcpy(vertices, children, sizeof(vertices));
+            type = leb__ChildType(type, bitValue);
+            heapID = 2 * heapID + bitValue;
+        }
+        return UINT32_MAX;
+    }
+
+    void locate_points(const PointLocator& locator, uint32_t numPositions, const float3* positions, uint32_t* elements)
+    {
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 64)
+        for (int32_t posIdx = 0; posIdx < (int32_t)numPositions; ++posIdx)
+            elements[posIdx] = locate_point(locator, positions[posIdx]);
+    }
+}
@@ -1,17 +1,31 @@
 // Internal includes
 #include "volume/volume_generation.h"
+#include "volume/leb_volume_gpu.h"
 #include "volume/grid_volume.h"
 #include "volume/leb_3d_cache.h"
 #include "tools/security.h"
+#include "tools/parallel.h"
 #include "math/operators.h"
 #include "rendering/frustum.h"
 #include "rendering/aabb.h"
 
+// External includes
+#include <algorithm>
+#include <queue>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Depths lost by the neighbors of an element every time their size doubles in the fitting estimate, and the number of elements over which they start to coarsen
+// (both fitted on the element counts of synthetic 64^3 to 256^3 grids at ratio thresholds 0.25 to 2)
+#define ESTIMATE_CLOSURE_SLOPE 1.25
+#define ESTIMATE_CLOSURE_SPREAD 1.5
+
+// Maximal number of balancing sweeps of the fitting estimate (the depths of the same grids converge within 28 sweeps)
+#define ESTIMATE_MAX_SWEEPS 32
+
 namespace leb_volume
 {
-    // Forward declarations
-    void recursive_split_element(LEBVolume& volume, uint32_t targetElement);
-
     // Function that allocates new elements
     uint32_t allocate_new_elements(LEBVolume& volume, uint32_t numElements)
     {
@@ -22,6 +36,7 @@ namespace leb_volume
         volume.modifArray.resize(prevElementCount + numElements);
         volume.depthArray.resize(prevElementCount + numElements);
         volume.tetraCacheArray.resize(prevElementCount + numElements);
+        volume.diamondIDArray.resize(prevElementCount + numElements);
         volume.totalNumElements += numElements;
         return prevElementCount;
     }
@@ -39,119 +54,54 @@ namespace leb_volume
             neighbors.w = newRef;
     }
 
-    bool check_diamond(LEBVolume& volume, uint32_t targetElement, uint32_t& rightElements, uint32_t& leftElements)
+    void split_element_cache(LEBVolume& volume, uint32_t element, uint32_t slot)
     {
-        // Reset the counters
-        rightElements = 0;
-        leftElements = 0;
-
-        // Get the type of the current element (this one will not be divded
-        uint8_t currentType = volume.typeArray[targetElement];
-
-        // Initialize the loop
-        uint32_t prevElement = targetElement;
-        uint32_t currentElement = volume.neighborsArray[prevElement].z;
-        bool firstTwin = true;
-
-        // Loop till we get back to the initial element
-        while (currentElement != targetElement && currentElement != UINT32_MAX)
+        // The children are the rows of the splitting matrix of the parent type applied to its vertices
+        const Tetrahedron parent = volume.tetraCacheArray[element];
+        const float3 midPoint = (parent.p[2] + parent.p[3]) * 0.5f;
+        Tetrahedron& child0 = volume.tetraCacheArray[element];
+        Tetrahedron& child1 = volume.tetraCacheArray[slot];
+        switch (volume.typeArray[element])
         {
-            rightElements++;
-            uint8_t type = volume.typeArray[currentElement];
-            if (!equivalent_types(type, currentType))
-            {
-                // We divide it
-                recursive_split_element(volume, currentElement);
-
-                // We need to find the index of the new element of the diamond (that potentially replaced this one
-                if (firstTwin)
-                    currentElement = volume.neighborsArray[prevElement].z;
-                else
-                    currentElement = volume.neighborsArray[prevElement].w;
-
-                // Make sure this one is valid
-                assert(currentElement != UINT32_MAX);
-            }
-
-            // Let's move to the next element
-            if (volume.neighborsArray[currentElement].z == prevElement)
-            {
-                firstTwin = false;
-                prevElement = currentElement;
-                currentElement = volume.neighborsArray[currentElement].w;
-            }
-            else
-            {
-                firstTwin = true;
-                prevElement = currentElement;
-                currentElement = volume.neighborsArray[currentElement].z;
-            }
+            case 0:
+            case 3:
+                child0 = { parent.p[1], midPoint, parent.p[2], parent.p[0] };
+                child1 = { parent.p[1], midPoint, parent.p[0], parent.p[3] };
+                break;
+            case 1:
+                child0 = { parent.p[1], midPoint, parent.p[2], parent.p[0] };
+                child1 = { parent.p[0], midPoint, parent.p[3], parent.p[1] };
+                break;
+            case 2:
+                child0 = { parent.p[0], midPoint, parent.p[1], parent.p[2] };
+                child1 = { parent.p[1], midPoint, parent.p[0], parent.p[3] };
+                break;
         }
 
-        // This means there is a discontinuity on the other side, we'll loop on this side
-        if (currentElement != targetElement)
-        {
-            prevElement = targetElement;
-            currentElement = volume.neighborsArray[targetElement].w;
-            firstTwin = false;
-            while (currentElement != UINT32_MAX)
-            {
-                leftElements++;
-                uint8_t type = volume.typeArray[currentElement];
-                if (!equivalent_types(type, currentType))
-                {
-                    // We divide it
-                    recursive_split_element(volume, currentElement);
-
-                    // We need to find the index of the new element of the diamond (that potentially replaced this one
-                    uint4 newNeighbors = volume.neighborsArray[prevElement];
-                    if (firstTwin)
-                        currentElement = newNeighbors.z;
-                    else
-                        currentElement = newNeighbors.w;
-
-                    // Make sure this one is valid
-                    assert(currentElement != UINT32_MAX);
-                }
-
-                // Let's move to the next element
-                if (volume.neighborsArray[currentElement].z == prevElement)
-                {
-                    firstTwin = false;
-                    prevElement = currentElement;
-                    currentElement = volume.neighborsArray[currentElement].w;
-                }
-                else
-                {
-                    firstTwin = true;
-                    prevElement = currentElement;
-                    currentElement = volume.neighborsArray[currentElement].z;
-                }
-            }
-            return false;
-        }
-        else
-            return true;
+        // One level deeper
+        volume.depthArray[element] = volume.depthArray[element] + 1;
+        volume.depthArray[slot] = volume.depthArray[element];
     }
 
-    void diamond_split(LEBVolume& volume, uint32_t targetElement)
+    void diamond_split(LEBVolume& volume, const uint32_t* members, uint32_t firstSlot, Diamond& diamond)
     {
         // Get the type of the current element
+        uint32_t targetElement = members[0];
         uint8_t currentType = volume.typeArray[targetElement];
 
         // Split the diamonds
         // 8 elements to process here
         if (currentType == 0)
         {
-            // Retrieve the 4 elements
-            uint32_t i0 = targetElement;
-            uint32_t i1 = volume.neighborsArray[targetElement].z;
-            uint32_t i2 = volume.neighborsArray[i1].w;
-            uint32_t i3 = volume.neighborsArray[i2].z;
-            uint32_t i4 = volume.neighborsArray[i3].w;
-            uint32_t i5 = volume.neighborsArray[i4].z;
-            uint32_t i6 = volume.neighborsArray[i5].w;
-            uint32_t i7 = volume.neighborsArray[i6].z;
+            // Retrieve the 8 elements, in the order of the ring
+            uint32_t i0 = members[0];
+            uint32_t i1 = members[1];
+            uint32_t i2 = members[2];
+            uint32_t i3 = members[3];
+            uint32_t i4 = members[4];
+            uint32_t i5 = members[5];
+            uint32_t i6 = members[6];
+            uint32_t i7 = members[7];
 
             // Just making sure we did the round trip
             assert(volume.neighborsArray[i0].w == i7);
@@ -167,7 +117,7 @@ namespace leb_volume
             assert(volume.typeArray[i7] == 0);
 
             // Allocate all the slots
-            uint32_t slot0 = allocate_new_elements(volume, 8);
+            uint32_t slot0 = firstSlot;
             uint32_t slot1 = slot0 + 1;
             uint32_t slot2 = slot1 + 1;
             uint32_t slot3 = slot2 + 1;
@@ -196,6 +146,16 @@ namespace leb_volume
             volume.modifArray[slot6] = volume.modifArray[i6];
             volume.modifArray[slot7] = volume.modifArray[i7];
 
+            // Derive the tetrahedrons of the children from their parent
+            split_element_cache(volume, i0, slot0);
+            split_element_cache(volume, i1, slot1);
+            split_element_cache(volume, i2, slot2);
+            split_element_cache(volume, i3, slot3);
+            split_element_cache(volume, i4, slot4);
+            split_element_cache(volume, i5, slot5);
+            split_element_cache(volume, i6, slot6);
+            split_element_cache(volume, i7, slot7);
+
             // Let's evaluate all the heap IDs
             volume.heapIDArray[i0] = volume.heapIDArray[i0] * 2;
             volume.heapIDArray[slot0] = volume.heapIDArray[i0] + 1;
@@ -304,7 +264,6 @@ namespace leb_volume
                 patch_neighbor(volume, nI7.y, i7, slot7);
 
             // Keep track of this diamond
-            Diamond diamond;
             diamond.size = 8;
             diamond.heapID[0] = volume.heapIDArray[i0] / 2;
             diamond.heapID[1] = volume.heapIDArray[i1] / 2;
@@ -314,27 +273,21 @@ namespace leb_volume
             diamond.heapID[5] = volume.heapIDArray[i5] / 2;
             diamond.heapID[6] = volume.heapIDArray[i6] / 2;
             diamond.heapID[7] = volume.heapIDArray[i7] / 2;
-            volume.diamonds.push_back(diamond);
         }
         // 6 elements to process here
         else if (currentType == 1 || currentType == 2)
         {
-            // Retrieve the 4 elements
-            uint32_t i0 = targetElement;
-
-            uint32_t i1 = volume.neighborsArray[i0].z;
+            // Retrieve the 6 elements, in the order of the ring
+            uint32_t i0 = members[0];
+            uint32_t i1 = members[1];
+            uint32_t i2 = members[2];
+            uint32_t i3 = members[3];
+            uint32_t i4 = members[4];
+            uint32_t i5 = members[5];
+
+            // Elements that reach the previous one of the ring through their first twin
             bool rev1 = volume.neighborsArray[i1].z == i0;
-
-            uint32_t i2 = rev1 ? volume.neighborsArray[i1].w : volume.neighborsArray[i1].z;
-            bool rev2 = volume.neighborsArray[i2].z == i1;
-
-            uint32_t i3 = rev2 ? volume.neighborsArray[i2].w : volume.neighborsArray[i2].z;
             bool rev3 = volume.neighborsArray[i3].z == i2;
-
-            uint32_t i4 = rev3 ? volume.neighborsArray[i3].w : volume.neighborsArray[i3].z;
-            bool rev4 = volume.neighborsArray[i4].z == i3;
-
-            uint32_t i5 = rev4 ? volume.neighborsArray[i4].w : volume.neighborsArray[i4].z;
             bool rev5 = volume.neighborsArray[i5].z == i4;
 
             // Just making sure we did the round trip
@@ -349,7 +302,7 @@ namespace leb_volume
             assert(volume.typeArray[i5] == 1 || volume.typeArray[i5] == 2);
 
             // Allocate all the slots
-            uint32_t slot0 = allocate_new_elements(volume, 6);
+            uint32_t slot0 = firstSlot;
             uint32_t slot1 = slot0 + 1;
             uint32_t slot2 = slot1 + 1;
             uint32_t slot3 = slot2 + 1;
@@ -371,6 +324,14 @@ namespace leb_volume
             volume.modifArray[slot4] = volume.modifArray[i4];
             volume.modifArray[slot5] = volume.modifArray[i5];
 
+            // Derive the tetrahedrons of the children from their parent
+            split_element_cache(volume, i0, slot0);
+            split_element_cache(volume, i1, slot1);
+            split_element_cache(volume, i2, slot2);
+            split_element_cache(volume, i3, slot3);
+            split_element_cache(volume, i4, slot4);
+            split_element_cache(volume, i5, slot5);
+
             // Let's evaluate all the heap IDs
             volume.heapIDArray[i0] = volume.heapIDArray[i0] * 2;
             volume.heapIDArray[slot0] = volume.heapIDArray[i0] + 1;
@@ -550,7 +511,6 @@ namespace leb_volume
                 patch_neighbor(volume, nI5.y, i5, slot5);
 
             // Keep track of this diamond
-            Diamond diamond;
             diamond.size = 6;
             diamond.heapID[0] = volume.heapIDArray[i0] / 2;
             diamond.heapID[1] = volume.heapIDArray[i1] / 2;
@@ -558,16 +518,15 @@ namespace leb_volume
             diamond.heapID[3] = volume.heapIDArray[i3] / 2;
             diamond.heapID[4] = volume.heapIDArray[i4] / 2;
             diamond.heapID[5] = volume.heapIDArray[i5] / 2;
-            volume.diamonds.push_back(diamond);
         }
         // 4 elements to process here
         else if (currentType == 3)
         {
-            // Retrieve the 4 elements
-            uint32_t i0 = targetElement;
-            uint32_t i1 = volume.neighborsArray[targetElement].z;
-            uint32_t i2 = volume.neighborsArray[i1].w;
-            uint32_t i3 = volume.neighborsArray[i2].z;
+            // Retrieve the 4 elements, in the order of the ring
+            uint32_t i0 = members[0];
+            uint32_t i1 = members[1];
+            uint32_t i2 = members[2];
+            uint32_t i3 = members[3];
 
             // Make sure all the types are the right ones
             assert(volume.typeArray[i0] == 3);
@@ -576,7 +535,7 @@ namespace leb_volume
             assert(volume.typeArray[i3] == 3);
 
             // Allocate all the slots
-            uint32_t slot0 = allocate_new_elements(volume, 4);
+            uint32_t slot0 = firstSlot;
             uint32_t slot1 = slot0 + 1;
             uint32_t slot2 = slot1 + 1;
             uint32_t slot3 = slot2 + 1;
@@ -591,6 +550,12 @@ namespace leb_volume
             volume.modifArray[slot2] = volume.modifArray[i2];
             volume.modifArray[slot3] = volume.modifArray[i3];
 
+            // Derive the tetrahedrons of the children from their parent
+            split_element_cache(volume, i0, slot0);
+            split_element_cache(volume, i1, slot1);
+            split_element_cache(volume, i2, slot2);
+            split_element_cache(volume, i3, slot3);
+
             // Let's evaluate all the heap IDs
             volume.heapIDArray[i0] = volume.heapIDArray[i0] * 2;
             volume.heapIDArray[slot0] = volume.heapIDArray[i0] + 1;
@@ -641,19 +606,18 @@ namespace leb_volume
                 patch_neighbor(volume, nI3.y, i3, slot3);
 
             // Keep track of this diamond
-            Diamond diamond;
             diamond.size = 4;
             diamond.heapID[0] = volume.heapIDArray[i0] / 2;
             diamond.heapID[1] = volume.heapIDArray[i1] / 2;
             diamond.heapID[2] = volume.heapIDArray[i2] / 2;
             diamond.heapID[3] = volume.heapIDArray[i3] / 2;
-            volume.diamonds.push_back(diamond);
         }
     }
 
-    void diamond_split_incomplete(LEBVolume& volume, uint32_t targetElement, uint32_t rightElements, uint32_t leftElements)
+    void diamond_split_incomplete(LEBVolume& volume, const uint32_t* members, uint32_t rightElements, uint32_t leftElements, uint32_t firstSlot, Diamond& diamond)
     {
         // Get the type of the current element
+        uint32_t targetElement = members[0];
         uint8_t currentType = volume.typeArray[targetElement];
 
         // Define our diamonds
@@ -670,40 +634,20 @@ namespace leb_volume
 
             // Our central element
             indices[elementIndex] = targetElement;
-            slots[elementIndex] = allocate_new_elements(volume, 1);
+            slots[elementIndex] = firstSlot;
 
-            // Set all the left elements
-            bool firstTwin = true;
+            // Set all the left elements, they follow the right ones in the members
             for (uint32_t eleIdx = 0; eleIdx < leftElements; ++eleIdx)
             {
-                // Previous index
-                uint32_t prevIndex = indices[elementIndex - eleIdx];
-
-                // Get the following index
-                indices[elementIndex - eleIdx - 1] = firstTwin ? volume.neighborsArray[prevIndex].w : volume.neighborsArray[prevIndex].z;
-
-                // Allocate the slot
-                slots[elementIndex - eleIdx - 1] = allocate_new_elements(volume, 1);
-
-                // Reverse the twin
-                firstTwin = !firstTwin;
+                indices[elementIndex - eleIdx - 1] = members[1 + rightElements + eleIdx];
+                slots[elementIndex - eleIdx - 1] = firstSlot + 1 + eleIdx;
             }
 
-            // Set all the left elements
-            firstTwin = true;
+            // Set all the right elements
             for (uint32_t eleIdx = 0; eleIdx < rightElements; ++eleIdx)
             {
-                // Previous index
-                uint32_t prevIndex = indices[elementIndex + eleIdx];
-
-                // Get the following index
-                indices[elementIndex + eleIdx + 1] = firstTwin ? volume.neighborsArray[prevIndex].z : volume.neighborsArray[prevIndex].w;
-
-                // Allocate the slot
-                slots[elementIndex + eleIdx + 1] = allocate_new_elements(volume, 1);
-
-                // Reverse the twin
-                firstTwin = !firstTwin;
+                indices[elementIndex + eleIdx + 1] = members[1 + eleIdx];
+                slots[elementIndex + eleIdx + 1] = firstSlot + 1 + leftElements + eleIdx;
             }
 
             // Update the data
@@ -713,6 +657,9 @@ namespace leb_volume
                 uint32_t ind = indices[eleIdx];
                 uint32_t slot = slots[eleIdx];
 
+                // Derive the tetrahedrons of the children from their parent
+                split_element_cache(volume, ind, slot);
+
                 // Update heapIDs
                 volume.heapIDArray[ind] = volume.heapIDArray[ind] * 2;
                 volume.heapIDArray[slot] = volume.heapIDArray[ind] + 1;
@@ -737,7 +684,7 @@ namespace leb_volume
             // UP (1 0 -1 / 0 1 -1)
             // DOWN (-1 0 1 / 0 -1 1)
 
-            firstTwin = elementIndex % 2 == 0;
+            bool firstTwin = elementIndex % 2 == 0;
             for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
             {
                 // Grab the index and the allocated slot
@@ -783,13 +730,11 @@ namespace leb_volume
             }
             /*
             // Keep track of this diamond
-            Diamond diamond;
             diamond.size = 8;
             for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
                 diamond.heapID[eleIdx] = volume.heapIDArray[indices[eleIdx]] / 2;
             for (uint32_t eleIdx = diamondSize; eleIdx < 8; ++eleIdx)
                 diamond.heapID[eleIdx] = volume.heapIDArray[indices[0]] / 2;
-            volume.diamonds.push_back(diamond);
             */
         }
         // 6 elements to process here
@@ -806,40 +751,20 @@ namespace leb_volume
 
             // Our central element
             indices[elementIndex] = targetElement;
-            slots[elementIndex] = allocate_new_elements(volume, 1);
+            slots[elementIndex] = firstSlot;
 
-            // Set all the left elements
-            bool firstTwin = true;
+            // Set all the left elements, they follow the right ones in the members
             for (uint32_t eleIdx = 0; eleIdx < leftElements; ++eleIdx)
             {
-                // Previous index
-                uint32_t prevIndex = indices[elementIndex - eleIdx];
-
-                // Get the following index
-                indices[elementIndex - eleIdx - 1] = firstTwin ? volume.neighborsArray[prevIndex].w : volume.neighborsArray[prevIndex].z;
-
-                // Allocate the slot
-                slots[elementIndex - eleIdx - 1] = allocate_new_elements(volume, 1);
-
-                // Reverse the twin
-                firstTwin = !firstTwin;
+                indices[elementIndex - eleIdx - 1] = members[1 + rightElements + eleIdx];
+                slots[elementIndex - eleIdx - 1] = firstSlot + 1 + eleIdx;
             }
 
-            // Set all the left elements
-            firstTwin = true;
+            // Set all the right elements
             for (uint32_t eleIdx = 0; eleIdx < rightElements; ++eleIdx)
             {
-                // Previous index
-                uint32_t prevIndex = indices[elementIndex + eleIdx];
-
-                // Get the following index
-                indices[elementIndex + eleIdx + 1] = firstTwin ? volume.neighborsArray[prevIndex].z : volume.neighborsArray[prevIndex].w;
-
-                // Allocate the slot
-                slots[elementIndex + eleIdx + 1] = allocate_new_elements(volume, 1);
-
-                // Reverse the twin
-                firstTwin = !firstTwin;
+                indices[elementIndex + eleIdx + 1] = members[1 + eleIdx];
+                slots[elementIndex + eleIdx + 1] = firstSlot + 1 + leftElements + eleIdx;
             }
 
             // Update the data
@@ -849,6 +774,9 @@ namespace leb_volume
                 uint32_t ind = indices[eleIdx];
                 uint32_t slot = slots[eleIdx];
 
+                // Derive the tetrahedrons of the children from their parent
+                split_element_cache(volume, ind, slot);
+
                 // Update heapIDs
                 volume.heapIDArray[ind] = volume.heapIDArray[ind] * 2;
                 volume.heapIDArray[slot] = volume.heapIDArray[ind] + 1;
@@ -869,7 +797,7 @@ namespace leb_volume
                 neighborArray[eleIdx] = volume.neighborsArray[ind];
             }
 
-            firstTwin = elementIndex % 2 == 0;
+            bool firstTwin = elementIndex % 2 == 0;
             for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
             {
                 // Grab the index and the allocated slot
@@ -914,27 +842,274 @@ namespace leb_volume
             }
 
             // Keep track of this diamond
-            Diamond diamond;
             diamond.size = 4;
             for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
                 diamond.heapID[eleIdx] = volume.heapIDArray[indices[eleIdx]] / 2;
             for (uint32_t eleIdx = diamondSize; eleIdx < 4; ++eleIdx)
                 diamond.heapID[eleIdx] = volume.heapIDArray[indices[0]] / 2;
-            volume.diamonds.push_back(diamond);
         }
     }
 
-    void recursive_split_element(LEBVolume& volume, uint32_t targetElement)
+    uint32_t complete_diamond_size(uint8_t type)
+    {
+        return type == 0 ? 8 : (type == 3 ? 4 : 6);
+    }
+
+    // Structure that describes a diamond split request
+    struct SplitCandidate
+    {
+        // Element that requested the split
+        uint32_t element;
+
+        // Elements of the diamond and the elements whose neighbors are patched by the split
+        uint32_t footprint[16];
+        uint32_t footprintSize;
+
+        // Layout of the diamond
+        uint32_t rightElements;
+        uint32_t leftElements;
+        bool complete;
+
+        // Non-conforming element that needs to be split first (UINT32_MAX if the diamond can be split)
+        uint32_t blocker;
+    };
+
+    uint32_t ring_neighbor_diamond(const LEBVolume& volume, uint32_t element, uint32_t neighbor)
+    {
+        // The elements of equivalent types around the bisection edge share it
+        if (neighbor == UINT32_MAX || !equivalent_types(volume.typeArray[neighbor], volume.typeArray[element]))
+            return UINT32_MAX;
+        return volume.diamondIDArray[neighbor];
+    }
+
+    uint32_t allocate_diamond(LEBVolume& volume, size_t firstReusable)
+    {
+        // Reuse a released record if possible (only the ones released from firstReusable on, the older ones can't be given back on a revert)
+        if (volume.freeDiamondIDs.size() > firstReusable)
+        {
+            const uint32_t diamondID = volume.freeDiamondIDs.back();
+            volume.freeDiamondIDs.pop_back();
+            return diamondID;
+        }
+
+        // Otherwise grow the table
+        const uint32_t diamondID = (uint32_t)volume.diamondTable.size();
+        volume.diamondTable.resize(diamondID + 1ull);
+        return diamondID;
+    }
+
+    void release_diamond(LEBVolume& volume, uint32_t diamondID)
+    {
+        volume.diamondTable[diamondID].numMembers = 0;
+        volume.freeDiamondIDs.push_back(diamondID);
+    }
+
+    void attach_to_diamond(LEBVolume& volume, uint32_t element, size_t firstReusable)
+    {
+        // Look for the diamonds of the two neighbors that share our bisection edge
+        const uint4& neighbors = volume.neighborsArray[element];
+        uint32_t diamondID = ring_neighbor_diamond(volume, element, neighbors.z);
+        uint32_t otherID = ring_neighbor_diamond(volume, element, neighbors.w);
+        if (diamondID == UINT32_MAX)
+            std::swap(diamondID, otherID);
+
+        if (diamondID == UINT32_MAX)
+        {
+            // First element of a new diamond
+            diamondID = allocate_diamond(volume, firstReusable);
+        }
+        else if (otherID != UINT32_MAX && otherID != diamondID)
+        {
+            // This element joins two parts of a ring that were separated by a non-conforming element
+            DiamondRecord& other = volume.diamondTable[otherID];
+            DiamondRecord& target = volume.diamondTable[diamondID];
+            for (uint32_t memberIdx = 0; memberIdx < other.numMembers; ++memberIdx)
+            {
+                target.members[target.numMembers++] = other.members[memberIdx];
+                volume.diamondIDArray[other.members[memberIdx]] = diamondID;
+            }
+            release_diamond(volume, otherID);
+        }
+
+        // Register the element
+        DiamondRecord& record = volume.diamondTable[diamondID];
+        assert(record.numMembers < 8);
+        record.members[record.numMembers++] = element;
+        volume.diamondIDArray[element] = diamondID;
+    }
+
+    void build_diamond_table(LEBVolume& volume)
+    {
+        volume.diamondTable.clear();
+        volume.freeDiamondIDs.clear();
+        volume.diamondIDArray.clear();
+        volume.diamondIDArray.resize(volume.totalNumElements);
+        for (uint32_t eleIdx = 0; eleIdx < volume.totalNumElements; ++eleIdx)
+            volume.diamondIDArray[eleIdx] = UINT32_MAX;
+        for (uint32_t eleIdx = 0; eleIdx < volume.totalNumElements; ++eleIdx)
+            attach_to_diamond(volume, eleIdx, 0);
+    }
+
+    void release_split_diamond(LEBVolume& volume, const SplitCandidate& candidate, uint32_t firstSlot, uint32_t diamondSize)
+    {
+        // The parents of the diamond became children, none of them has a diamond yet
+        release_diamond(volume, volume.diamondIDArray[candidate.element]);
+        for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
+        {
+            volume.diamondIDArray[candidate.footprint[eleIdx]] = UINT32_MAX;
+            volume.diamondIDArray[firstSlot + eleIdx] = UINT32_MAX;
+        }
+    }
+
+    void attach_split_children(LEBVolume& volume, const SplitCandidate& candidate, uint32_t firstSlot, uint32_t diamondSize, size_t firstReusable)
+    {
+        // The children always bisect an edge of their parent, they join the diamonds around these edges
+        for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
+        {
+            attach_to_diamond(volume, candidate.footprint[eleIdx], firstReusable);
+            attach_to_diamond(volume, firstSlot + eleIdx, firstReusable);
+        }
+    }
+
+    uint32_t find_diamond_member(const DiamondRecord& record, uint32_t element)
+    {
+        for (uint32_t memberIdx = 0; memberIdx < record.numMembers; ++memberIdx)
+        {
+            if (record.members[memberIdx] == element)
+                return memberIdx;
+        }
+        return UINT32_MAX;
+    }
+
+    bool gather_diamond(const LEBVolume& volume, SplitCandidate& candidate)
+    {
+        // Reset the candidate
+        const uint32_t targetElement = candidate.element;
+        candidate.footprintSize = 0;
+        candidate.rightElements = 0;
+        candidate.leftElements = 0;
+        candidate.complete = false;
+        candidate.blocker = UINT32_MAX;
+        candidate.footprint[candidate.footprintSize++] = targetElement;
+
+        // Get the type of the current element
+        uint8_t currentType = volume.typeArray[targetElement];
+
+        // The diamond table holds the elements of the ring (up to the non-conforming elements if it is incomplete), load their neighbors at once
+        const DiamondRecord& record = volume.diamondTable[volume.diamondIDArray[targetElement]];
+        uint4 memberNeighbors[8];
+        for (uint32_t memberIdx = 0; memberIdx < record.numMembers; ++memberIdx)
+            memberNeighbors[memberIdx] = volume.neighborsArray[record.members[memberIdx]];
+
+        // Neighbors of the diamond elements, in the order of the footprint
+        uint4 ringNeighbors[8];
+        ringNeighbors[0] = memberNeighbors[find_diamond_member(record, targetElement)];
+
+        // Walk the diamond on the first side, without modifying anything
+        uint32_t prevElement = targetElement;
+        uint32_t currentElement = ringNeighbors[0].z;
+        while (currentElement != targetElement && currentElement != UINT32_MAX)
+        {
+            // This element needs to be split before the diamond can be
+            const uint32_t memberIdx = find_diamond_member(record, currentElement);
+            if (memberIdx == UINT32_MAX)
+            {
+                assert(!equivalent_types(volume.typeArray[currentElement], currentType));
+                candidate.blocker = currentElement;
+                return false;
+            }
+            candidate.rightElements++;
+            ringNeighbors[candidate.footprintSize] = memberNeighbors[memberIdx];
+            candidate.footprint[candidate.footprintSize++] = currentElement;
+
+            // Let's move to the next element
+            const uint4& neighbors = memberNeighbors[memberIdx];
+            uint32_t nextElement = neighbors.z == prevElement ? neighbors.w : neighbors.z;
+            prevElement = currentElement;
+            currentElement = nextElement;
+        }
+        candidate.complete = currentElement == targetElement;
+
+        // This means there is a discontinuity on the other side, we'll loop on this side
+        if (!candidate.complete)
+        {
+            prevElement = targetElement;
+            currentElement = ringNeighbors[0].w;
+            while (currentElement != UINT32_MAX)
+            {
+                const uint32_t memberIdx = find_diamond_member(record, currentElement);
+                if (memberIdx == UINT32_MAX)
+                {
+                    assert(!equivalent_types(volume.typeArray[currentElement], currentType));
+                    candidate.blocker = currentElement;
+                    return false;
+                }
+                candidate.leftElements++;
+                ringNeighbors[candidate.footprintSize] = memberNeighbors[memberIdx];
+                candidate.footprint[candidate.footprintSize++] = currentElement;
+
+                // Let's move to the next element
+                const uint4& neighbors = memberNeighbors[memberIdx];
+                uint32_t nextElement = neighbors.z == prevElement ? neighbors.w : neighbors.z;
+                prevElement = currentElement;
+                currentElement = nextElement;
+            }
+        }
+        assert(candidate.footprintSize == record.numMembers);
+
+        // The split patches the neighbors on the external faces of the diamond
+        const uint32_t diamondSize = candidate.footprintSize;
+        for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
+        {
+            uint32_t external = ringNeighbors[eleIdx].y;
+            if (external != UINT32_MAX)
+                candidate.footprint[candidate.footprintSize++] = external;
+        }
+        return true;
+    }
+
+    void split_gathered_diamond(LEBVolume& volume, const SplitCandidate& candidate)
     {
-        // First we need to make sure that everyone in the diamond is of the same type
-        uint32_t rightElements = 0, leftElements = 0;
-        bool completeDiamond = check_diamond(volume, targetElement, rightElements, leftElements);
+        // Allocate the slots of the children
+        uint32_t diamondSize = candidate.complete ? complete_diamond_size(volume.typeArray[candidate.element]) : 1 + candidate.rightElements + candidate.leftElements;
+        uint32_t firstSlot = allocate_new_elements(volume, diamondSize);
 
         // Then we divide the diamond
-        if (completeDiamond)
-            diamond_split(volume, targetElement);
+        Diamond diamond = {};
+        if (candidate.complete)
+            diamond_split(volume, candidate.footprint, firstSlot, diamond);
         else
-            diamond_split_incomplete(volume, targetElement, rightElements, leftElements);
+            diamond_split_incomplete(volume, candidate.footprint, candidate.rightElements, candidate.leftElements, firstSlot, diamond);
+
+        // Keep track of the diamond
+        if (diamond.size != 0)
+            volume.diamonds.push_back(diamond);
+
+        // Update the diamond table
+        release_split_diamond(volume, candidate, firstSlot, diamondSize);
+        attach_split_children(volume, candidate, firstSlot, diamondSize, 0);
+    }
+
+    void split_element(LEBVolume& volume, uint32_t targetElement, std::vector<uint32_t>& splitStack)
+    {
+        // The stack holds the chain of elements to split, each one is blocked by the one above it
+        splitStack.clear();
+        splitStack.push_back(targetElement);
+        SplitCandidate candidate;
+        while (!splitStack.empty())
+        {
+            // Walk down the chain of non-conforming elements until we reach a diamond that can be split
+            candidate.element = splitStack.back();
+            if (!gather_diamond(volume, candidate))
+            {
+                splitStack.push_back(candidate.blocker);
+                continue;
+            }
+
+            // Split it, the element below it in the chain is evaluated again as it may have other blockers
+            split_gathered_diamond(volume, candidate);
+            splitStack.pop_back();
+        }
     }
 
     // Number of elements we allow
@@ -1038,10 +1213,34 @@ namespace leb_volume
         }
     }
 
-    bool should_subdivide_element(const LEBVolume& volume, uint32_t eleIdx, uint32_t depth, const GridVolume& gridVolume, const HeuristicCache& gridCache, const FittingParameters& fittingParams, const Frustum& frustum)
+    float heuristic_error(const float4& stats, const FittingParameters& fittingParams)
     {
-        // Get the camera relative position
-        const Tetrahedron& tetra = volume.tetraCacheArray[eleIdx];
+        float range = stats.w - stats.z;
+        return (range) / std::max(stats.x, fittingParams.minThreshold);
+    }
+
+    bool heuristic_requests_split(const float4& stats, const FittingParameters& fittingParams)
+    {
+        return (heuristic_error(stats, fittingParams) > fittingParams.ratioThreshold);
+    }
+
+    bool box_requests_split(const Tetrahedron& tetra, uint32_t depth, const HeuristicCache& gridCache, const FittingParameters& fittingParams)
+    {
+        // AABB of the element
+        const float3 boxMin = min(min(tetra.p[0], tetra.p[1]), min(tetra.p[2], tetra.p[3]));
+        const float3 boxMax = max(max(tetra.p[0], tetra.p[1]), max(tetra.p[2], tetra.p[3]));
+
+        // Variation of the densities over the whole box
+        const float2 stats = heuristic_cache::sample_box_statistics(gridCache, boxMin, boxMax, depth);
+        return sqrtf(stats.y) / std::max(stats.x, fittingParams.minThreshold) > fittingParams.varianceThreshold;
+    }
+
+    bool should_subdivide_tetrahedron(const Tetrahedron& tetra, uint32_t depth, const GridVolume& gridVolume, const HeuristicCache& gridCache, const FittingParameters& fittingParams, const Frustum& frustum)
+    {
+        // The elements whose center reads an empty cell are rejected before any other test (unless their AABB is evaluated too)
+        float3 center = (tetra.p[0] + tetra.p[1] + tetra.p[2] + tetra.p[3]) * 0.25;
+        if (fittingParams.varianceThreshold == 0.0f && !heuristic_cache::sample_occupancy(gridCache, center, depth))
+            return false;
 
         // Cull by frustrum if required
         if (fittingParams.frustumCull)
@@ -1085,101 +1284,1248 @@ namespace leb_volume
         }
 
         // Read one level lower than required
-        float3 center = (tetra.p[0] + tetra.p[1] + tetra.p[2] + tetra.p[3]) * 0.25;
         const float4& stats = heuristic_cache::sample_cache(gridCache, center, depth);
-        float range = stats.w - stats.z;
-        float v = (range) / std::max(stats.x, fittingParams.minThreshold);
-        return (v > fittingParams.ratioThreshold);
+        if (heuristic_requests_split(stats, fittingParams))
+            return true;
+
+        // A large element can straddle cells that the one at its center does not see
+        return fittingParams.varianceThreshold > 0.0f && box_requests_split(tetra, depth, gridCache, fittingParams);
     }
 
-    float mean_density_element(const GridVolume& gridVolume, uint32_t, const Tetrahedron& tetra)
+    bool should_subdivide_element(const LEBVolume& volume, uint32_t eleIdx, uint32_t depth, const GridVolume& gridVolume, const HeuristicCache& gridCache, const FittingParameters& fittingParams, const Frustum& frustum)
     {
-        // Mean value
-        float mean = 0.0;
-        for (uint32_t v = 0; v < g_MaxNumSamples; ++v)
-        {
-            float3 p = point_in_tetrahedron(tetra, v);
-            mean += evaluate_grid_value(gridVolume, p);
-        }
-        return (mean / g_MaxNumSamples);
+        return should_subdivide_tetrahedron(volume.tetraCacheArray[eleIdx], depth, gridVolume, gridCache, fittingParams, frustum);
     }
 
-    uint32_t fit_volume_to_grid(LEBVolume& lebVolume, const GridVolume& gridVolume, const HeuristicCache& heuristicCache, const FittingParameters& parameters)
+#if defined(__AVX2__)
+    uint32_t should_subdivide_elements_avx2(const LEBVolume& volume, const uint32_t* elements, uint32_t numElements, const GridVolume& gridVolume, const HeuristicCache& gridCache, const FittingParameters& fittingParams, const Frustum& frustum)
     {
-        // Extract the frustum from the view proj
-        Frustum frustum;
-        extract_planes_from_view_projection_matrix(parameters.viewProjectionMatrix, frustum);
+        // Transpose the vertices of the tetrahedrons and fetch the cache level of each lane (missing lanes replicate the last element)
+        alignas(32) float vertices[4][3][8];
+        alignas(32) int32_t levelShifts[8];
+        alignas(32) int32_t offsets[8];
+        alignas(32) int32_t strideY[8];
+        alignas(32) int32_t strideZ[8];
+        alignas(32) int32_t brickSizesLog2[8];
+        alignas(32) int32_t brickOffsets[8];
+        for (uint32_t laneIdx = 0; laneIdx < 8; ++laneIdx)
+        {
+            const uint32_t eleIdx = elements[std::min(laneIdx, numElements - 1)];
+            const Tetrahedron& tetra = volume.tetraCacheArray[eleIdx];
+            for (uint32_t vertIdx = 0; vertIdx < 4; ++vertIdx)
+            {
+                vertices[vertIdx][0][laneIdx] = tetra.p[vertIdx].x;
+                vertices[vertIdx][1][laneIdx] = tetra.p[vertIdx].y;
+                vertices[vertIdx][2][laneIdx] = tetra.p[vertIdx].z;
+            }
 
-        // Pre-compute the sample barycentrics
-        precompute_barycentrics();
-        Leb3DCache lebCache;
+            const uint32_t cacheLevel = heuristic_cache::cache_level(gridCache, volume.depthArray[eleIdx]);
+            offsets[laneIdx] = (int32_t)gridCache.offsets[cacheLevel];
+            levelShifts[laneIdx] = (int32_t)cacheLevel + 1;
+
+            // Strides of the cells (linear layout) or of the bricks (brick layouts)
+            const uint3& resolution = gridCache.resolutions[cacheLevel];
+            const uint32_t brickSizeLog2 = gridCache.layout == CacheLayout::Linear ? 0 : gridCache.brickSizesLog2[cacheLevel];
+            const uint32_t brickMask = (1 << brickSizeLog2) - 1;
+            strideY[laneIdx] = (int32_t)((resolution.x + brickMask) >> brickSizeLog2);
+            strideZ[laneIdx] = strideY[laneIdx] * (int32_t)((resolution.y + brickMask) >> brickSizeLog2);
+            brickSizesLog2[laneIdx] = (int32_t)brickSizeLog2;
+            brickOffsets[laneIdx] = gridCache.layout == CacheLayout::Sparse ? (int32_t)gridCache.brickOffsets[cacheLevel] : 0;
+        }
 
-        // Compute the right max depth
-        uint32_t maxDepth = uint32_t(log2f((float)gridVolume.resolution.x) * 3.0 + 6.0) - 2;
+        // Load the vertices
+        __m256 p[4][3];
+        for (uint32_t vertIdx = 0; vertIdx < 4; ++vertIdx)
+            for (uint32_t dim = 0; dim < 3; ++dim)
+                p[vertIdx][dim] = _mm256_load_ps(vertices[vertIdx][dim]);
 
-        // All the initial elements should be initialized with the right state
-        for (uint32_t eleIdx = 0; eleIdx < lebVolume.totalNumElements; ++eleIdx)
-            lebVolume.modifArray[eleIdx] = ELEMENT_INCLUDED | ELEMENT_INVALID_CACHE;
+        // Lanes that cover a non zero voxel (always true for the dense layouts)
+        __m256 occupied = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
 
-        // Subdivide the tetrahedrons untill it's good
-        while (true)
+        // Evaluate the voxel coordinates of the centers, then the cell of the cache level of every lane
+        const uint32_t gridResolution[3] = { gridCache.gridResolution.x, gridCache.gridResolution.y, gridCache.gridResolution.z };
+        const __m256i levelShift = _mm256_load_si256((const __m256i*)levelShifts);
+        __m256i coords[3];
+        for (uint32_t dim = 0; dim < 3; ++dim)
         {
-            // We loop through the elements, classify them in a parallel fashion, then do the subdivion in a monothread fashion
-            const uint32_t elementCount = lebVolume.totalNumElements;
-
-            #pragma omp parallel for num_threads(32)
-            for (int32_t eleIdx = 0; eleIdx < (int32_t)elementCount; ++eleIdx)
+            __m256 center = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(p[0][dim], p[1][dim]), p[2][dim]), p[3][dim]);
+            center = _mm256_mul_ps(center, _mm256_set1_ps(0.25f));
+            const __m256 normPos = _mm256_add_ps(center, _mm256_set1_ps(0.5f));
+            __m256i voxel = _mm256_cvttps_epi32(_mm256_mul_ps(normPos, _mm256_set1_ps((float)gridResolution[dim])));
+            voxel = _mm256_max_epi32(_mm256_min_epi32(voxel, _mm256_set1_epi32((int32_t)gridResolution[dim] - 1)), _mm256_setzero_si256());
+            coords[dim] = _mm256_srlv_epi32(voxel, levelShift);
+        }
+        __m256i index = _mm256_load_si256((const __m256i*)offsets);
+        if (gridCache.layout == CacheLayout::Linear)
+        {
+            index = _mm256_add_epi32(index, coords[0]);
+            index = _mm256_add_epi32(index, _mm256_mullo_epi32(coords[1], _mm256_load_si256((const __m256i*)strideY)));
+            index = _mm256_add_epi32(index, _mm256_mullo_epi32(coords[2], _mm256_load_si256((const __m256i*)strideZ)));
+        }
+        else
+        {
+            // Brick of the cell
+            const __m256i brickSizeLog2 = _mm256_load_si256((const __m256i*)brickSizesLog2);
+            __m256i brickIdx = _mm256_srlv_epi32(coords[0], brickSizeLog2);
+            brickIdx = _mm256_add_epi32(brickIdx, _mm256_mullo_epi32(_mm256_srlv_epi32(coords[1], brickSizeLog2), _mm256_load_si256((const __m256i*)strideY)));
+            brickIdx = _mm256_add_epi32(brickIdx, _mm256_mullo_epi32(_mm256_srlv_epi32(coords[2], brickSizeLog2), _mm256_load_si256((const __m256i*)strideZ)));
+
+            // Slot of the brick in the sparse layout, the lanes that fall in an empty brick never request a split (unless their AABB is evaluated too)
+            if (gridCache.layout == CacheLayout::Sparse)
             {
-                // Get it's depth
-                if ((lebVolume.modifArray[eleIdx] & (ELEMENT_INCLUDED)) == 0)
-                    continue;
-
-                // If the element was flagged as modified and is still included, update the caches
-                if ((lebVolume.modifArray[eleIdx] & (ELEMENT_INVALID_CACHE)) == ( ELEMENT_INVALID_CACHE))
+                brickIdx = _mm256_add_epi32(brickIdx, _mm256_load_si256((const __m256i*)brickOffsets));
+                brickIdx = _mm256_i32gather_epi32((const int32_t*)gridCache.brickTable.data(), brickIdx, 4);
+                if (fittingParams.varianceThreshold == 0.0f)
                 {
-                    // Grab heap ID
-                    const uint64_t heapID = lebVolume.heapIDArray[eleIdx];
+                    occupied = _mm256_castsi256_ps(_mm256_xor_si256(_mm256_cmpeq_epi32(brickIdx, _mm256_setzero_si256()), _mm256_set1_epi32(-1)));
+                    if ((_mm256_movemask_ps(occupied) & ((1u << numElements) - 1)) == 0)
+                        return 0;
+                }
+            }
+            index = _mm256_add_epi32(index, _mm256_sllv_epi32(brickIdx, _mm256_mullo_epi32(brickSizeLog2, _mm256_set1_epi32(3))));
 
-                    // Re-evaluate the depth
-                    lebVolume.depthArray[eleIdx] = (uint8_t)find_msb_64(heapID);
+            // Interleave the bits of the coordinates inside of the brick (the 32 bit offsets limit the bricks to 1024^3 cells anyway)
+            const __m256i brickMask = _mm256_sub_epi32(_mm256_sllv_epi32(_mm256_set1_epi32(1), brickSizeLog2), _mm256_set1_epi32(1));
+            __m256i morton = _mm256_setzero_si256();
+            for (uint32_t dim = 0; dim < 3; ++dim)
+            {
+                __m256i bits = _mm256_and_si256(coords[dim], brickMask);
+                bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_slli_epi32(bits, 16)), _mm256_set1_epi32(0x030000ff));
+                bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_slli_epi32(bits, 8)), _mm256_set1_epi32(0x0300f00f));
+                bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_slli_epi32(bits, 4)), _mm256_set1_epi32(0x030c30c3));
+                bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_slli_epi32(bits, 2)), _mm256_set1_epi32(0x09249249));
+                morton = _mm256_or_si256(morton, _mm256_slli_epi32(bits, dim));
+            }
+            index = _mm256_add_epi32(index, morton);
+        }
 
-                    // Update the posision
-                    leb_volume::evaluate_tetrahedron(lebVolume.heapIDArray[eleIdx], lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, lebCache, lebVolume.tetraCacheArray[eleIdx]);
+        // Lanes that have not been culled
+        __m256 visible = occupied;
 
-                    // Not modified anymore
-                    lebVolume.modifArray[eleIdx] &= ~(ELEMENT_INVALID_CACHE);
+        // Cull by frustrum if required (the min/max operand order matches std::min/std::max)
+        if (fittingParams.frustumCull)
+        {
+            // Evaluate the camera relative AABB
+            const float scale[3] = { gridVolume.scale.x, gridVolume.scale.y, gridVolume.scale.z };
+            const float camera[3] = { fittingParams.cameraPosition.x, fittingParams.cameraPosition.y, fittingParams.cameraPosition.z };
+            __m256 boxMin[3], boxMax[3];
+            for (uint32_t dim = 0; dim < 3; ++dim)
+            {
+                const __m256 s = _mm256_set1_ps(scale[dim]);
+                const __m256 c = _mm256_set1_ps(camera[dim]);
+                boxMin[dim] = boxMax[dim] = _mm256_sub_ps(_mm256_mul_ps(p[0][dim], s), c);
+                for (uint32_t vertIdx = 1; vertIdx < 4; ++vertIdx)
+                {
+                    const __m256 v = _mm256_sub_ps(_mm256_mul_ps(p[vertIdx][dim], s), c);
+                    boxMin[dim] = _mm256_min_ps(v, boxMin[dim]);
+                    boxMax[dim] = _mm256_max_ps(v, boxMax[dim]);
                 }
+            }
 
-                // Get it's depth
-                if (lebVolume.depthArray[eleIdx] >= maxDepth)
-                    continue;
-
-                // Request or exclude
-                if (should_subdivide_element(lebVolume, eleIdx, lebVolume.depthArray[eleIdx], gridVolume, heuristicCache, parameters, frustum))
-                    lebVolume.modifArray[eleIdx] |= ELEMENT_REQUESTED;
-                else
-                    lebVolume.modifArray[eleIdx] &= ~(ELEMENT_INCLUDED);
+            // Test the AABB against the side planes
+            const __m256 half = _mm256_set1_ps(0.5f);
+            __m256 center[3], extents[3];
+            for (uint32_t dim = 0; dim < 3; ++dim)
+            {
+                center[dim] = _mm256_mul_ps(_mm256_add_ps(boxMax[dim], boxMin[dim]), half);
+                extents[dim] = _mm256_mul_ps(_mm256_sub_ps(boxMax[dim], boxMin[dim]), half);
+            }
+            for (uint32_t planeIdx = 0; planeIdx < 4; ++planeIdx)
+            {
+                const Plane& plane = frustum.planes[planeIdx];
+                const float3 normalSign = sign(plane.normal);
+                const __m256 tx = _mm256_add_ps(center[0], _mm256_mul_ps(extents[0], _mm256_set1_ps(normalSign.x)));
+                const __m256 ty = _mm256_add_ps(center[1], _mm256_mul_ps(extents[1], _mm256_set1_ps(normalSign.y)));
+                const __m256 tz = _mm256_add_ps(center[2], _mm256_mul_ps(extents[2], _mm256_set1_ps(normalSign.z)));
+                __m256 dotProd = _mm256_mul_ps(tx, _mm256_set1_ps(plane.normal.x));
+                dotProd = _mm256_add_ps(dotProd, _mm256_mul_ps(ty, _mm256_set1_ps(plane.normal.y)));
+                dotProd = _mm256_add_ps(dotProd, _mm256_mul_ps(tz, _mm256_set1_ps(plane.normal.z)));
+                const __m256 outside = _mm256_cmp_ps(_mm256_add_ps(dotProd, _mm256_set1_ps(plane.d)), _mm256_setzero_ps(), _CMP_LT_OQ);
+                visible = _mm256_andnot_ps(outside, visible);
             }
 
-            // Non parallel retourine
-            uint32_t splitTriggered = 0;
-            for (uint32_t eleIdx = 0; eleIdx < elementCount; ++eleIdx)
+            // Cull by pixel size if required
+            if (fittingParams.pixelCull && _mm256_movemask_ps(visible) != 0)
             {
-                if ((lebVolume.modifArray[eleIdx] & ELEMENT_REQUESTED) == ELEMENT_REQUESTED)
+                // Project the 8 corners of the AABBs to screen
+                const float* m = fittingParams.viewProjectionMatrix.m;
+                __m256 minX = _mm256_set1_ps(FLT_MAX), minY = _mm256_set1_ps(FLT_MAX);
+                __m256 maxX = _mm256_set1_ps(-FLT_MAX), maxY = _mm256_set1_ps(-FLT_MAX);
+                for (uint32_t cornerIdx = 0; cornerIdx < 8; ++cornerIdx)
                 {
-                    recursive_split_element(lebVolume, eleIdx);
-                    splitTriggered++;
+                    const __m256 cx = (cornerIdx & 4) ? boxMax[0] : boxMin[0];
+                    const __m256 cy = (cornerIdx & 2) ? boxMax[1] : boxMin[1];
+                    const __m256 cz = (cornerIdx & 1) ? boxMax[2] : boxMin[2];
+
+                    // Same operation order as mul_transpose
+                    __m256 x = _mm256_mul_ps(_mm256_set1_ps(m[0]), cx);
+                    x = _mm256_add_ps(x, _mm256_mul_ps(_mm256_set1_ps(m[4]), cy));
+                    x = _mm256_add_ps(x, _mm256_mul_ps(_mm256_set1_ps(m[8]), cz));
+                    x = _mm256_add_ps(x, _mm256_set1_ps(m[12]));
+                    __m256 y = _mm256_mul_ps(_mm256_set1_ps(m[1]), cx);
+                    y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(m[5]), cy));
+                    y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(m[9]), cz));
+                    y = _mm256_add_ps(y, _mm256_set1_ps(m[13]));
+                    __m256 w = _mm256_mul_ps(_mm256_set1_ps(m[3]), cx);
+                    w = _mm256_add_ps(w, _mm256_mul_ps(_mm256_set1_ps(m[7]), cy));
+                    w = _mm256_add_ps(w, _mm256_mul_ps(_mm256_set1_ps(m[11]), cz));
+                    w = _mm256_add_ps(w, _mm256_set1_ps(m[15]));
+
+                    // Convert NDC to screen space
+                    x = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(x, w), half), half);
+                    y = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(y, w), half), half);
+
+                    // Update screen-space bounds
+                    minX = _mm256_min_ps(x, minX);
+                    minY = _mm256_min_ps(y, minY);
+                    maxX = _mm256_max_ps(x, maxX);
+                    maxY = _mm256_max_ps(y, maxY);
                 }
-            }
 
-            // How many splits during this round
-            if (splitTriggered == 0)
-                break;
+                // Does the AABB fit in a pixel?
+                const __m256 pixelSize = _mm256_set1_ps(fittingParams.pixelSize);
+                const __m256 sX = _mm256_mul_ps(_mm256_sub_ps(maxX, minX), _mm256_set1_ps((float)fittingParams.screenSize.x));
+                const __m256 sY = _mm256_mul_ps(_mm256_sub_ps(maxY, minY), _mm256_set1_ps((float)fittingParams.screenSize.y));
+                const __m256 subPixel = _mm256_and_ps(_mm256_cmp_ps(sX, pixelSize, _CMP_LT_OQ), _mm256_cmp_ps(sY, pixelSize, _CMP_LT_OQ));
+                visible = _mm256_andnot_ps(subPixel, visible);
+            }
         }
 
-        // Final number of primitives
+        // Gather the moments (a float4 spans two 8 byte strides)
+        __m256 mean, minValue, maxValue;
+        const __m256i strideIndex = _mm256_slli_epi32(index, 1);
+        if (gridCache.precision == CachePrecision::Float32)
+        {
+            const float* moments = &heuristic_cache::moment_buffer(gridCache)->x;
+            mean = _mm256_i32gather_ps(moments, strideIndex, 8);
+            minValue = _mm256_i32gather_ps(moments + 2, strideIndex, 8);
+            maxValue = _mm256_i32gather_ps(moments + 3, strideIndex, 8);
+        }
+        else
+        {
+            // A half4 spans two 4 byte strides, the first one holds the mean and the second one the min and max
+            const int32_t* moments = (const int32_t*)heuristic_cache::packed_moment_buffer(gridCache);
+            const __m256i meanPairs = _mm256_i32gather_epi32(moments, strideIndex, 4);
+            const __m256i rangePairs = _mm256_i32gather_epi32(moments + 1, strideIndex, 4);
+
+            // Pack the 16 bit values of the 8 lanes in order before decoding them
+            const __m256i lowHalves = _mm256_packus_epi32(_mm256_and_si256(meanPairs, _mm256_set1_epi32(0xffff)), _mm256_and_si256(rangePairs, _mm256_set1_epi32(0xffff)));
+            const __m256i meanMin = _mm256_permute4x64_epi64(lowHalves, 0xd8);
+            const __m256i maxHalves = _mm256_permute4x64_epi64(_mm256_packus_epi32(_mm256_srli_epi32(rangePairs, 16), _mm256_setzero_si256()), 0xd8);
+            mean = _mm256_cvtph_ps(_mm256_castsi256_si128(meanMin));
+            minValue = _mm256_cvtph_ps(_mm256_extracti128_si256(meanMin, 1));
+            maxValue = _mm256_cvtph_ps(_mm256_castsi256_si128(maxHalves));
+        }
+
+        // Evaluate the heuristic
+        const __m256 error = _mm256_div_ps(_mm256_sub_ps(maxValue, minValue), _mm256_max_ps(_mm256_set1_ps(fittingParams.minThreshold), mean));
+        const __m256 split = _mm256_and_ps(_mm256_cmp_ps(error, _mm256_set1_ps(fittingParams.ratioThreshold), _CMP_GT_OQ), visible);
+        const uint32_t laneMask = (1u << numElements) - 1;
+        uint32_t splitMask = (uint32_t)_mm256_movemask_ps(split) & laneMask;
+
+        // The visible lanes that pass the cell test can still be split by the statistics of their AABB
+        if (fittingParams.varianceThreshold > 0.0f)
+        {
+            const uint32_t candidates = (uint32_t)_mm256_movemask_ps(visible) & ~splitMask & laneMask;
+            for (uint32_t laneIdx = 0; laneIdx < numElements; ++laneIdx)
+            {
+                const uint32_t eleIdx = elements[laneIdx];
+                if (((candidates >> laneIdx) & 1) != 0 && box_requests_split(volume.tetraCacheArray[eleIdx], volume.depthArray[eleIdx], gridCache, fittingParams))
+                    splitMask |= 1u << laneIdx;
+            }
+        }
+        return splitMask;
+    }
+#endif
+
+    uint32_t should_subdivide_elements(const LEBVolume& volume, const uint32_t* elements, uint32_t numElements, const GridVolume& gridVolume, const HeuristicCache& gridCache, const FittingParameters& fittingParams, const Frustum& frustum)
+    {
+        assert(numElements > 0 && numElements <= 8);
+#if defined(__AVX2__)
+        // The gather offsets are 32 bit wide
+        if (heuristic_cache::num_cells(gridCache) < (1ull << 30))
+            return should_subdivide_elements_avx2(volume, elements, numElements, gridVolume, gridCache, fittingParams, frustum);
+#endif
+
+        // Scalar fallback
+        uint32_t splitMask = 0;
+        for (uint32_t laneIdx = 0; laneIdx < numElements; ++laneIdx)
+        {
+            const uint32_t eleIdx = elements[laneIdx];
+            if (should_subdivide_element(volume, eleIdx, volume.depthArray[eleIdx], gridVolume, gridCache, fittingParams, frustum))
+                splitMask |= 1u << laneIdx;
+        }
+        return splitMask;
+    }
+
+    DecisionFlips compare_cache_decisions(const LEBVolume& volume, const GridVolume& gridVolume, const HeuristicCache& referenceCache, const HeuristicCache& testedCache, const FittingParameters& fittingParams)
+    {
+        // Extract the frustum from the view proj
+        Frustum frustum;
+        extract_planes_from_view_projection_matrix(fittingParams.viewProjectionMatrix, frustum);
+
+        // Evaluate every element with both caches
+        uint64_t numLostSplits = 0, numExtraSplits = 0;
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 256) reduction(+: numLostSplits, numExtraSplits)
+        for (int32_t eleIdx = 0; eleIdx < (int32_t)volume.totalNumElements; ++eleIdx)
+        {
+            const uint32_t depth = volume.depthArray[eleIdx];
+            const bool reference = should_subdivide_element(volume, eleIdx, depth, gridVolume, referenceCache, fittingParams, frustum);
+            const bool tested = should_subdivide_element(volume, eleIdx, depth, gridVolume, testedCache, fittingParams, frustum);
+            numLostSplits += reference && !tested;
+            numExtraSplits += !reference && tested;
+        }
+
+        DecisionFlips flips;
+        flips.numElements = volume.totalNumElements;
+        flips.numLostSplits = numLostSplits;
+        flips.numExtraSplits = numExtraSplits;
+        return flips;
+    }
+
+    float mean_density_element(const GridVolume& gridVolume, uint32_t, const Tetrahedron& tetra)
+    {
+        // Mean value
+        float mean = 0.0;
+        for (uint32_t v = 0; v < g_MaxNumSamples; ++v)
+        {
+            float3 p = point_in_tetrahedron(tetra, v);
+            mean += evaluate_grid_value(gridVolume, p);
+        }
+        return (mean / g_MaxNumSamples);
+    }
+
+    // Saved state of an element modified by a budgeted split
+    struct ElementBackup
+    {
+        uint32_t element;
+        uint64_t heapID;
+        uint8_t type;
+        uint4 neighbors;
+        uint8_t modif;
+        uint8_t depth;
+        Tetrahedron tetra;
+    };
+
+    // Saved state of a diamond modified by a budgeted split
+    struct DiamondBackup
+    {
+        uint32_t diamondID;
+        DiamondRecord record;
+    };
+
+    void backup_diamond(const LEBVolume& volume, uint32_t diamondID, uint32_t prevTableSize, std::vector<DiamondBackup>& diamondBackups)
+    {
+        // The diamonds created during the split are simply released
+        if (diamondID < prevTableSize)
+            diamondBackups.push_back({ diamondID, volume.diamondTable[diamondID] });
+    }
+
+    // Element in the priority queue of the budgeted fitting
+    struct SplitRequest
+    {
+        float error;
+        uint64_t heapID;
+        uint32_t element;
+
+        bool operator<(const SplitRequest& other) const
+        {
+            // Ties are broken by heap ID so that the order doesn't depend on the element indices
+            return error < other.error || (error == other.error && heapID > other.heapID);
+        }
+    };
+
+    uint32_t count_outside_faces(const LEBVolume& volume, uint32_t element)
+    {
+        const uint4& neighbors = volume.neighborsArray[element];
+        return (neighbors.x == UINT32_MAX) + (neighbors.y == UINT32_MAX) + (neighbors.z == UINT32_MAX) + (neighbors.w == UINT32_MAX);
+    }
+
+    bool budgeted_split_element(LEBVolume& volume, uint32_t targetElement, uint64_t maxElements, uint64_t maxBytes, PositionEncoding positionEncoding, uint64_t& numOutsideFaces, std::vector<ElementBackup>& backups, std::vector<DiamondBackup>& diamondBackups, std::vector<uint32_t>& touchedElements)
+    {
+        // Keep track of the state before the split to be able to revert it
+        const uint32_t prevNumElements = volume.totalNumElements;
+        const size_t prevNumDiamonds = volume.diamonds.size();
+        const uint32_t prevTableSize = (uint32_t)volume.diamondTable.size();
+        const size_t prevNumFreeDiamonds = volume.freeDiamondIDs.size();
+        const uint64_t prevNumOutsideFaces = numOutsideFaces;
+        backups.clear();
+        diamondBackups.clear();
+        touchedElements.clear();
+
+        // Split the blocking elements first, using an explicit stack
+        std::vector<std::pair<uint32_t, uint64_t>> stack;
+        stack.push_back({ targetElement, volume.heapIDArray[targetElement] });
+        SplitCandidate candidate;
+        bool withinBudget = true;
+        while (!stack.empty() && withinBudget)
+        {
+            // This element was already split as part of another diamond
+            std::pair<uint32_t, uint64_t> current = stack.back();
+            if (volume.heapIDArray[current.first] != current.second)
+            {
+                stack.pop_back();
+                continue;
+            }
+
+            // A non-conforming element needs to be split first
+            candidate.element = current.first;
+            if (!gather_diamond(volume, candidate))
+            {
+                stack.push_back({ candidate.blocker, volume.heapIDArray[candidate.blocker] });
+                continue;
+            }
+
+            // Make sure the diamond fits in the element budget
+            uint32_t diamondSize = candidate.complete ? complete_diamond_size(volume.typeArray[candidate.element]) : 1 + candidate.rightElements + candidate.leftElements;
+            if (maxElements != 0 && volume.totalNumElements + diamondSize > maxElements)
+            {
+                withinBudget = false;
+                break;
+            }
+
+            // Save the elements modified by the split
+            for (uint32_t fIdx = 0; fIdx < candidate.footprintSize; ++fIdx)
+            {
+                uint32_t element = candidate.footprint[fIdx];
+                numOutsideFaces -= count_outside_faces(volume, element);
+                touchedElements.push_back(element);
+                if (element < prevNumElements)
+                    backups.push_back({ element, volume.heapIDArray[element], volume.typeArray[element], volume.neighborsArray[element], volume.modifArray[element], volume.depthArray[element], volume.tetraCacheArray[element] });
+            }
+
+            // Split the diamond
+            uint32_t firstSlot = allocate_new_elements(volume, diamondSize);
+            Diamond diamond = {};
+            if (candidate.complete)
+                diamond_split(volume, candidate.footprint, firstSlot, diamond);
+            else
+                diamond_split_incomplete(volume, candidate.footprint, candidate.rightElements, candidate.leftElements, firstSlot, diamond);
+            if (diamond.size != 0)
+                volume.diamonds.push_back(diamond);
+
+            // Update the diamond table, saving the split diamond and the ones the children can join
+            backup_diamond(volume, volume.diamondIDArray[candidate.element], prevTableSize, diamondBackups);
+            release_split_diamond(volume, candidate, firstSlot, diamondSize);
+            for (uint32_t eleIdx = 0; eleIdx < diamondSize; ++eleIdx)
+            {
+                const uint4& memberNeighbors = volume.neighborsArray[candidate.footprint[eleIdx]];
+                const uint4& slotNeighbors = volume.neighborsArray[firstSlot + eleIdx];
+                const uint32_t ringNeighbors[4] = { memberNeighbors.z, memberNeighbors.w, slotNeighbors.z, slotNeighbors.w };
+                for (uint32_t neighbor : ringNeighbors)
+                {
+                    if (neighbor != UINT32_MAX && volume.diamondIDArray[neighbor] != UINT32_MAX)
+                        backup_diamond(volume, volume.diamondIDArray[neighbor], prevTableSize, diamondBackups);
+                }
+            }
+            attach_split_children(volume, candidate, firstSlot, diamondSize, prevNumFreeDiamonds);
+
+            // Count the outside faces of the modified and new elements
+            for (uint32_t fIdx = 0; fIdx < candidate.footprintSize; ++fIdx)
+                numOutsideFaces += count_outside_faces(volume, candidate.footprint[fIdx]);
+            for (uint32_t eleIdx = firstSlot; eleIdx < firstSlot + diamondSize; ++eleIdx)
+            {
+                numOutsideFaces += count_outside_faces(volume, eleIdx);
+                touchedElements.push_back(eleIdx);
+            }
+            stack.pop_back();
+        }
+
+        // Make sure the split fits in the byte budget
+        if (withinBudget && maxBytes != 0)
+            withinBudget = evaluate_export_size(volume.totalNumElements, numOutsideFaces, positionEncoding) <= maxBytes;
+
+        // Revert everything if the budget is exceeded
+        if (!withinBudget)
+        {
+            for (int64_t bIdx = (int64_t)backups.size() - 1; bIdx >= 0; --bIdx)
+            {
+                const ElementBackup& backup = backups[bIdx];
+                volume.heapIDArray[backup.element] = backup.heapID;
+                volume.typeArray[backup.element] = backup.type;
+                volume.neighborsArray[backup.element] = backup.neighbors;
+                volume.modifArray[backup.element] = backup.modif;
+                volume.depthArray[backup.element] = backup.depth;
+                volume.tetraCacheArray[backup.element] = backup.tetra;
+            }
+            volume.totalNumElements = prevNumElements;
+            volume.heapIDArray.resize(prevNumElements);
+            volume.typeArray.resize(prevNumElements);
+            volume.neighborsArray.resize(prevNumElements);
+            volume.modifArray.resize(prevNumElements);
+            volume.depthArray.resize(prevNumElements);
+            volume.tetraCacheArray.resize(prevNumElements);
+            volume.diamonds.resize(prevNumDiamonds);
+
+            // Restore the diamond table
+            for (int64_t bIdx = (int64_t)diamondBackups.size() - 1; bIdx >= 0; --bIdx)
+            {
+                const DiamondBackup& backup = diamondBackups[bIdx];
+                volume.diamondTable[backup.diamondID] = backup.record;
+                for (uint32_t memberIdx = 0; memberIdx < backup.record.numMembers; ++memberIdx)
+                    volume.diamondIDArray[backup.record.members[memberIdx]] = backup.diamondID;
+            }
+            volume.diamondIDArray.resize(prevNumElements);
+            volume.diamondTable.resize(prevTableSize);
+            volume.freeDiamondIDs.resize(prevNumFreeDiamonds);
+            numOutsideFaces = prevNumOutsideFaces;
+        }
+        return withinBudget;
+    }
+
+    void fit_volume_to_budget(LEBVolume& lebVolume, const GridVolume& gridVolume, const HeuristicCache& heuristicCache, const FittingParameters& parameters, const Frustum& frustum, uint32_t maxDepth)
+    {
+        // Elements with the largest heuristic error first
+        std::priority_queue<SplitRequest> requests;
+        std::vector<ElementBackup> backups;
+        std::vector<DiamondBackup> diamondBackups;
+        std::vector<uint32_t> touchedElements;
+
+        // Initial state of the outside faces
+        uint64_t numOutsideFaces = 0;
+        for (uint32_t eleIdx = 0; eleIdx < lebVolume.totalNumElements; ++eleIdx)
+            numOutsideFaces += count_outside_faces(lebVolume, eleIdx);
+
+        // All the elements need to be evaluated initially
+        for (uint32_t eleIdx = 0; eleIdx < lebVolume.totalNumElements; ++eleIdx)
+        {
+            lebVolume.modifArray[eleIdx] |= ELEMENT_INVALID_CACHE;
+            touchedElements.push_back(eleIdx);
+        }
+
+        while (true)
+        {
+            // Queue the modified elements that request a split (their caches were derived by the split)
+            for (uint32_t element : touchedElements)
+            {
+                if ((lebVolume.modifArray[element] & ELEMENT_INVALID_CACHE) == 0)
+                    continue;
+                const uint64_t heapID = lebVolume.heapIDArray[element];
+                lebVolume.modifArray[element] &= ~(ELEMENT_INVALID_CACHE);
+
+                // Evaluate the heuristic
+                if (lebVolume.depthArray[element] >= maxDepth || !should_subdivide_element(lebVolume, element, lebVolume.depthArray[element], gridVolume, heuristicCache, parameters, frustum))
+                    continue;
+                const Tetrahedron& tetra = lebVolume.tetraCacheArray[element];
+                float3 center = (tetra.p[0] + tetra.p[1] + tetra.p[2] + tetra.p[3]) * 0.25;
+                requests.push({ heuristic_error(heuristic_cache::sample_cache(heuristicCache, center, lebVolume.depthArray[element]), parameters), heapID, element });
+            }
+
+            // Skip the requests of the elements that were split since they were queued
+            while (!requests.empty() && lebVolume.heapIDArray[requests.top().element] != requests.top().heapID)
+                requests.pop();
+            if (requests.empty())
+                break;
+
+            // Split the element with the largest error, stop as soon as the budget is reached
+            uint32_t element = requests.top().element;
+            requests.pop();
+            if (!budgeted_split_element(lebVolume, element, parameters.maxElements, parameters.maxBytes, parameters.positionEncoding, numOutsideFaces, backups, diamondBackups, touchedElements))
+                break;
+        }
+    }
+
+    uint32_t fit_volume_to_grid(LEBVolume& lebVolume, const GridVolume& gridVolume, const HeuristicCache& heuristicCache, const FittingParameters& parameters)
+    {
+        // Extract the frustum from the view proj
+        Frustum frustum;
+        extract_planes_from_view_projection_matrix(parameters.viewProjectionMatrix, frustum);
+
+        // Pre-compute the sample barycentrics
+        precompute_barycentrics();
+        Leb3DCache lebCache;
+
+        // Compute the right max depth
+        uint32_t maxDepth = evaluate_max_depth(gridVolume.resolution, parameters);
+
+        // All the initial elements should be initialized with the right state, the splits derive the caches of the children from there
+        const uint32_t batchSize = 256;
+        const int32_t numBatches = (int32_t)((lebVolume.totalNumElements + batchSize - 1) / batchSize);
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1)
+        for (int32_t batchIdx = 0; batchIdx < numBatches; ++batchIdx)
+        {
+            const uint32_t batchStart = batchIdx * batchSize;
+            const uint32_t numBatchElements = std::min(batchSize, lebVolume.totalNumElements - batchStart);
+            uint64_t heapIDs[batchSize];
+            for (uint32_t localIdx = 0; localIdx < numBatchElements; ++localIdx)
+            {
+                const uint32_t eleIdx = batchStart + localIdx;
+                heapIDs[localIdx] = lebVolume.heapIDArray[eleIdx];
+                lebVolume.modifArray[eleIdx] = ELEMENT_INCLUDED;
+                lebVolume.depthArray[eleIdx] = (uint8_t)find_msb_64(heapIDs[localIdx]);
+            }
+
+            // Decode the batch at once
+            Tetrahedron tetras[batchSize];
+            leb_volume::evaluate_tetrahedra(numBatchElements, heapIDs, lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, lebCache, tetras);
+            for (uint32_t localIdx = 0; localIdx < numBatchElements; ++localIdx)
+                lebVolume.tetraCacheArray[batchStart + localIdx] = tetras[localIdx];
+        }
+
+        // Group the initial elements by diamond
+        build_diamond_table(lebVolume);
+
+        // Split by decreasing error until the budget is reached
+        if (parameters.maxElements != 0 || parameters.maxBytes != 0)
+        {
+            fit_volume_to_budget(lebVolume, gridVolume, heuristicCache, parameters, frustum, maxDepth);
+            printf("    Total num Primitives %u\n", lebVolume.totalNumElements);
+            return maxDepth;
+        }
+
+        // Chain of the elements to split
+        std::vector<uint32_t> splitStack;
+
+        // Worklist of the elements that are still included (sorted by index)
+        std::vector<uint32_t> activeElements(lebVolume.totalNumElements);
+        std::vector<uint32_t> nextActiveElements;
+        for (uint32_t eleIdx = 0; eleIdx < lebVolume.totalNumElements; ++eleIdx)
+            activeElements[eleIdx] = eleIdx;
+
+        // Subdivide the tetrahedrons untill it's good
+        while (true)
+        {
+            // We loop through the active elements, classify them in a parallel fashion, then do the subdivion
+            const uint32_t elementCount = lebVolume.totalNumElements;
+            const uint32_t numActiveElements = (uint32_t)activeElements.size();
+
+            // The elements are classified by blocks of 8
+            const int32_t numBlocks = (int32_t)((numActiveElements + 7) / 8);
+            #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 32)
+            for (int32_t blockIdx = 0; blockIdx < numBlocks; ++blockIdx)
+            {
+                // Gather the elements of the block that need to be evaluated
+                uint32_t blockElements[8];
+                uint32_t numBlockElements = 0;
+                const uint32_t lastActiveIdx = std::min((uint32_t)blockIdx * 8 + 8, numActiveElements);
+                for (uint32_t activeIdx = (uint32_t)blockIdx * 8; activeIdx < lastActiveIdx; ++activeIdx)
+                {
+                    // Get it's depth
+                    const uint32_t eleIdx = activeElements[activeIdx];
+                    if ((lebVolume.modifArray[eleIdx] & (ELEMENT_INCLUDED)) == 0)
+                        continue;
+
+                    // Get it's depth, the element will never request a split
+                    if (lebVolume.depthArray[eleIdx] >= maxDepth)
+                    {
+                        lebVolume.modifArray[eleIdx] &= ~(ELEMENT_INCLUDED);
+                        continue;
+                    }
+                    blockElements[numBlockElements++] = eleIdx;
+                }
+                if (numBlockElements == 0)
+                    continue;
+
+                // Request or exclude
+                const uint32_t splitMask = should_subdivide_elements(lebVolume, blockElements, numBlockElements, gridVolume, heuristicCache, parameters, frustum);
+                for (uint32_t laneIdx = 0; laneIdx < numBlockElements; ++laneIdx)
+                {
+                    if (splitMask & (1u << laneIdx))
+                        lebVolume.modifArray[blockElements[laneIdx]] |= ELEMENT_REQUESTED;
+                    else
+                        lebVolume.modifArray[blockElements[laneIdx]] &= ~(ELEMENT_INCLUDED);
+                }
+            }
+
+            // Non parallel retourine
+            uint32_t splitTriggered = 0;
+            for (uint32_t eleIdx : activeElements)
+            {
+                if ((lebVolume.modifArray[eleIdx] & ELEMENT_REQUESTED) == ELEMENT_REQUESTED)
+                {
+                    split_element(lebVolume, eleIdx, splitStack);
+                    splitTriggered++;
+                }
+            }
+
+            // How many splits during this round
+            if (splitTriggered == 0)
+                break;
+
+            // The next worklist is made of the elements that are still included and of the new included ones
+            nextActiveElements.clear();
+            for (uint32_t eleIdx : activeElements)
+            {
+                if ((lebVolume.modifArray[eleIdx] & ELEMENT_INCLUDED) == ELEMENT_INCLUDED)
+                    nextActiveElements.push_back(eleIdx);
+            }
+            for (uint32_t eleIdx = elementCount; eleIdx < lebVolume.totalNumElements; ++eleIdx)
+            {
+                if ((lebVolume.modifArray[eleIdx] & ELEMENT_INCLUDED) == ELEMENT_INCLUDED)
+                    nextActiveElements.push_back(eleIdx);
+            }
+            std::swap(activeElements, nextActiveElements);
+        }
+
+        // Final number of primitives
         printf("    Total num Primitives %u\n", lebVolume.totalNumElements);
 
         return maxDepth;
     }
-}
\ No newline at end of file
+
+    // Diamond whose children can be collapsed back into their parents
+    struct MergeCandidate
+    {
+        // Even and odd child of every parent
+        uint32_t children[8][2];
+        uint32_t numParents;
+
+        // Largest heuristic error of the parents
+        float error;
+        uint64_t heapID;
+    };
+
+    bool merge_candidate_less(const MergeCandidate& a, const MergeCandidate& b)
+    {
+        return a.error < b.error || (a.error == b.error && a.heapID < b.heapID);
+    }
+
+    uint8_t parent_type(uint8_t childType, uint64_t parentHeapID)
+    {
+        // Inverse of the type sequence 0 -> (1, 2) -> 3 -> 0
+        if (childType == 1 || childType == 2)
+            return 0;
+        else if (childType == 0)
+            return 3;
+        else
+            return (parentHeapID & 1) == 0 ? 1 : 2;
+    }
+
+    bool gather_merge_diamond(const LEBVolume& volume, uint32_t targetElement, std::vector<uint8_t>& visited, MergeCandidate& candidate)
+    {
+        // The parent needs to be a valid element (find_msb_64 returns the depth plus one)
+        const uint64_t heapID = volume.heapIDArray[targetElement];
+        const uint32_t depth = find_msb_64(heapID) - 1;
+        if (depth <= volume.minimalDepth)
+        {
+            visited[targetElement] = 1;
+            return false;
+        }
+
+        // All the children of a diamond share the midpoint of the parents' bisection edge as their second vertex
+        Tetrahedron tetra;
+        evaluate_tetrahedron(heapID, volume.minimalDepth, volume.basePoints, volume.baseTypes, tetra);
+        const float3 midPoint = tetra.p[1];
+
+        // Collect all the elements around the midpoint through the faces that contain it (x, y and z)
+        uint32_t star[16];
+        uint32_t starSize = 0;
+        star[starSize++] = targetElement;
+        visited[targetElement] = 1;
+        bool valid = true;
+        for (uint32_t sIdx = 0; sIdx < starSize && valid; ++sIdx)
+        {
+            const uint4& neighbors = volume.neighborsArray[star[sIdx]];
+            const uint32_t faceNeighbors[3] = { neighbors.x, neighbors.y, neighbors.z };
+            for (uint32_t fIdx = 0; fIdx < 3 && valid; ++fIdx)
+            {
+                uint32_t neighbor = faceNeighbors[fIdx];
+                if (neighbor == UINT32_MAX || std::find(star, star + starSize, neighbor) != star + starSize)
+                    continue;
+
+                // The neighbor needs to be a child of the same diamond
+                uint64_t neighborHeapID = volume.heapIDArray[neighbor];
+                valid = find_msb_64(neighborHeapID) - 1 == depth && starSize < 16;
+                if (valid)
+                {
+                    evaluate_tetrahedron(neighborHeapID, volume.minimalDepth, volume.basePoints, volume.baseTypes, tetra);
+                    valid = length(tetra.p[1] - midPoint) < 1e-5f;
+                }
+                if (valid)
+                {
+                    star[starSize++] = neighbor;
+                    visited[neighbor] = 1;
+                }
+            }
+        }
+        if (!valid)
+            return false;
+
+        // Pair the siblings
+        candidate.numParents = 0;
+        for (uint32_t sIdx = 0; sIdx < starSize; ++sIdx)
+        {
+            uint64_t childHeapID = volume.heapIDArray[star[sIdx]];
+            if ((childHeapID & 1) != 0)
+                continue;
+            uint32_t sibling = UINT32_MAX;
+            for (uint32_t oIdx = 0; oIdx < starSize; ++oIdx)
+            {
+                if (volume.heapIDArray[star[oIdx]] == (childHeapID | 1))
+                    sibling = star[oIdx];
+            }
+            if (sibling == UINT32_MAX)
+                return false;
+            candidate.children[candidate.numParents][0] = star[sIdx];
+            candidate.children[candidate.numParents][1] = sibling;
+            candidate.numParents++;
+        }
+        if (2 * candidate.numParents != starSize)
+            return false;
+
+        // The parents need to be of equivalent types
+        uint8_t firstType = parent_type(volume.typeArray[candidate.children[0][0]], volume.heapIDArray[candidate.children[0][0]] / 2);
+        for (uint32_t pIdx = 1; pIdx < candidate.numParents; ++pIdx)
+        {
+            if (!equivalent_types(parent_type(volume.typeArray[candidate.children[pIdx][0]], volume.heapIDArray[candidate.children[pIdx][0]] / 2), firstType))
+                return false;
+        }
+        return true;
+    }
+
+    uint32_t merged_parent_index(const MergeCandidate& candidate, uint32_t element)
+    {
+        // The parent replaces its even child
+        for (uint32_t pIdx = 0; pIdx < candidate.numParents; ++pIdx)
+        {
+            if (candidate.children[pIdx][0] == element || candidate.children[pIdx][1] == element)
+                return candidate.children[pIdx][0];
+        }
+        return element;
+    }
+
+    void merge_diamond(LEBVolume& volume, const MergeCandidate& candidate, uint64_t& numOutsideFaces)
+    {
+        // Evaluate the neighbors of the parents before modifying anything
+        uint4 parentNeighbors[8];
+        uint8_t parentTypes[8];
+        for (uint32_t pIdx = 0; pIdx < candidate.numParents; ++pIdx)
+        {
+            numOutsideFaces -= count_outside_faces(volume, candidate.children[pIdx][0]) + count_outside_faces(volume, candidate.children[pIdx][1]);
+            const uint4& nA = volume.neighborsArray[candidate.children[pIdx][0]];
+            const uint4& nB = volume.neighborsArray[candidate.children[pIdx][1]];
+            parentTypes[pIdx] = parent_type(volume.typeArray[candidate.children[pIdx][0]], volume.heapIDArray[candidate.children[pIdx][0]] / 2);
+
+            // The external faces are the ones of the children, the ring faces are the ones of the neighboring parents
+            uint4& neighbors = parentNeighbors[pIdx];
+            neighbors.x = nA.w;
+            neighbors.y = nB.w;
+            if (parentTypes[pIdx] == 2)
+            {
+                neighbors.z = merged_parent_index(candidate, nA.z);
+                neighbors.w = merged_parent_index(candidate, nA.y);
+            }
+            else
+            {
+                neighbors.z = merged_parent_index(candidate, nA.x);
+                neighbors.w = merged_parent_index(candidate, nA.z);
+            }
+        }
+
+        // Replace the children by their parents
+        for (uint32_t pIdx = 0; pIdx < candidate.numParents; ++pIdx)
+        {
+            uint32_t childA = candidate.children[pIdx][0];
+            uint32_t childB = candidate.children[pIdx][1];
+
+            // The external neighbor of the odd child now points to the parent
+            uint32_t externalB = volume.neighborsArray[childB].w;
+            if (externalB != UINT32_MAX)
+                patch_neighbor(volume, externalB, childB, childA);
+
+            // The parent takes the slot of the even child
+            volume.heapIDArray[childA] = volume.heapIDArray[childA] / 2;
+            volume.typeArray[childA] = parentTypes[pIdx];
+            volume.neighborsArray[childA] = parentNeighbors[pIdx];
+            volume.depthArray[childA] = (uint8_t)find_msb_64(volume.heapIDArray[childA]);
+            volume.modifArray[childA] = 0;
+            evaluate_tetrahedron(volume.heapIDArray[childA], volume.minimalDepth, volume.basePoints, volume.baseTypes, volume.tetraCacheArray[childA]);
+            numOutsideFaces += count_outside_faces(volume, childA);
+
+            // The odd child is released
+            volume.heapIDArray[childB] = 0;
+            volume.typeArray[childB] = 0;
+            volume.neighborsArray[childB] = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+            volume.modifArray[childB] = 0;
+        }
+    }
+
+    void compact_volume(LEBVolume& volume)
+    {
+        // Evaluate the new index of every element
+        std::vector<uint32_t> remap(volume.totalNumElements, UINT32_MAX);
+        uint32_t numElements = 0;
+        for (uint32_t eleIdx = 0; eleIdx < volume.totalNumElements; ++eleIdx)
+        {
+            if (volume.heapIDArray[eleIdx] != 0)
+                remap[eleIdx] = numElements++;
+        }
+
+        // Move the elements (always to a lower index)
+        for (uint32_t eleIdx = 0; eleIdx < volume.totalNumElements; ++eleIdx)
+        {
+            uint32_t target = remap[eleIdx];
+            if (target == UINT32_MAX)
+                continue;
+            uint4 neighbors = volume.neighborsArray[eleIdx];
+            neighbors.x = neighbors.x != UINT32_MAX ? remap[neighbors.x] : UINT32_MAX;
+            neighbors.y = neighbors.y != UINT32_MAX ? remap[neighbors.y] : UINT32_MAX;
+            neighbors.z = neighbors.z != UINT32_MAX ? remap[neighbors.z] : UINT32_MAX;
+            neighbors.w = neighbors.w != UINT32_MAX ? remap[neighbors.w] : UINT32_MAX;
+            volume.heapIDArray[target] = volume.heapIDArray[eleIdx];
+            volume.typeArray[target] = volume.typeArray[eleIdx];
+            volume.neighborsArray[target] = neighbors;
+            volume.modifArray[target] = volume.modifArray[eleIdx];
+            volume.depthArray[target] = volume.depthArray[eleIdx];
+            volume.tetraCacheArray[target] = volume.tetraCacheArray[eleIdx];
+        }
+
+        // Release the unused elements
+        volume.totalNumElements = numElements;
+        volume.heapIDArray.resize(numElements);
+        volume.typeArray.resize(numElements);
+        volume.neighborsArray.resize(numElements);
+        volume.modifArray.resize(numElements);
+        volume.depthArray.resize(numElements);
+        volume.tetraCacheArray.resize(numElements);
+
+        // The diamond table is rebuilt by the next fitting
+        volume.diamondIDArray.clear();
+        volume.diamondTable.clear();
+        volume.freeDiamondIDs.clear();
+    }
+
+    bool within_budget(uint64_t numElements, uint64_t numOutsideFaces, const FittingParameters& parameters)
+    {
+        if (parameters.maxElements != 0 && numElements > parameters.maxElements)
+            return false;
+        if (parameters.maxBytes != 0 && evaluate_export_size(numElements, numOutsideFaces, parameters.positionEncoding) > parameters.maxBytes)
+            return false;
+        return true;
+    }
+
+    uint32_t coarsen_volume(LEBVolume& lebVolume, const GridVolume& gridVolume, const HeuristicCache& heuristicCache, const FittingParameters& parameters)
+    {
+        // Extract the frustum from the view proj
+        Frustum frustum;
+        extract_planes_from_view_projection_matrix(parameters.viewProjectionMatrix, frustum);
+        const uint32_t maxDepth = evaluate_max_depth(gridVolume.resolution, parameters);
+        const bool budgeted = parameters.maxElements != 0 || parameters.maxBytes != 0;
+
+        // Initial state of the outside faces
+        uint64_t numOutsideFaces = 0;
+        for (uint32_t eleIdx = 0; eleIdx < lebVolume.totalNumElements; ++eleIdx)
+            numOutsideFaces += count_outside_faces(lebVolume, eleIdx);
+
+        // Merge passes until nothing can be merged anymore, with a budget the diamonds of lowest error are merged until it is reached
+        uint64_t numElements = lebVolume.totalNumElements;
+        uint32_t numMerged = 0;
+        std::vector<uint8_t> visited;
+        std::vector<MergeCandidate> candidates;
+        while (!budgeted || !within_budget(numElements, numOutsideFaces, parameters))
+        {
+            // Gather the diamonds that can be merged, every element belongs to at most one of them
+            visited.assign(lebVolume.totalNumElements, 0);
+            candidates.clear();
+            for (uint32_t eleIdx = 0; eleIdx < lebVolume.totalNumElements; ++eleIdx)
+            {
+                if (visited[eleIdx] || lebVolume.heapIDArray[eleIdx] == 0)
+                    continue;
+                MergeCandidate candidate;
+                if (!gather_merge_diamond(lebVolume, eleIdx, visited, candidate))
+                    continue;
+
+                // Evaluate the heuristic on the parents
+                candidate.error = 0.0f;
+                candidate.heapID = lebVolume.heapIDArray[candidate.children[0][0]] / 2;
+                bool requested = false;
+                for (uint32_t pIdx = 0; pIdx < candidate.numParents; ++pIdx)
+                {
+                    uint64_t parentHeapID = lebVolume.heapIDArray[candidate.children[pIdx][0]] / 2;
+                    uint32_t parentDepth = find_msb_64(parentHeapID);
+                    Tetrahedron tetra;
+                    evaluate_tetrahedron(parentHeapID, lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, tetra);
+                    float3 center = (tetra.p[0] + tetra.p[1] + tetra.p[2] + tetra.p[3]) * 0.25;
+                    candidate.error = std::max(candidate.error, heuristic_error(heuristic_cache::sample_cache(heuristicCache, center, parentDepth), parameters));
+                    requested |= parentDepth < maxDepth && should_subdivide_tetrahedron(tetra, parentDepth, gridVolume, heuristicCache, parameters, frustum);
+                }
+
+                // Without a budget, only merge the parents that the fitting would not split
+                if (budgeted || !requested)
+                    candidates.push_back(candidate);
+            }
+            if (candidates.empty())
+                break;
+
+            // With a budget, merge the diamonds with the lowest error first until it is reached
+            if (budgeted)
+            {
+                std::sort(candidates.begin(), candidates.end(), merge_candidate_less);
+                for (const MergeCandidate& candidate : candidates)
+                {
+                    if (within_budget(numElements, numOutsideFaces, parameters))
+                        break;
+                    merge_diamond(lebVolume, candidate, numOutsideFaces);
+                    numElements -= candidate.numParents;
+                    numMerged++;
+                }
+            }
+            else
+            {
+                for (const MergeCandidate& candidate : candidates)
+                {
+                    merge_diamond(lebVolume, candidate, numOutsideFaces);
+                    numElements -= candidate.numParents;
+                }
+                numMerged += (uint32_t)candidates.size();
+            }
+        }
+
+        // Drop the debug diamonds and the released elements
+        lebVolume.diamonds.clear();
+        compact_volume(lebVolume);
+        return numMerged;
+    }
+
+    uint32_t evaluate_max_depth(const uint3& gridResolution, const FittingParameters& parameters)
+    {
+        if (parameters.maxDepth != 0)
+            return parameters.maxDepth;
+
+        // The largest axis of the grid drives the depth
+        const uint32_t maxResolution = std::max(std::max(gridResolution.x, gridResolution.y), gridResolution.z);
+        return uint32_t(log2f((float)maxResolution) * 3.0 + 6.0) - 2;
+    }
+
+    uint64_t evaluate_export_size(uint64_t numElements, uint64_t numOutsideFaces, PositionEncoding positionEncoding)
+    {
+        // Header and the sizes of the 10 vectors
+        uint64_t exportSize = sizeof(bool) + sizeof(float3) + sizeof(float4x4) + sizeof(float3) + 10 * sizeof(size_t);
+
+        // Per element data (tetra data, center, density and heap ID)
+        exportSize += numElements * (sizeof(TetraData) + sizeof(float3) + sizeof(float) + sizeof(uint64_t));
+
+        // Header of the packed positions
+        exportSize += sizeof(PositionEncoding) + sizeof(float3) + sizeof(float);
+
+        // Debug positions
+        if (positionEncoding == PositionEncoding::Float32)
+            exportSize += numElements * 4 * sizeof(float3);
+        else if (positionEncoding == PositionEncoding::Lattice)
+            exportSize += numElements * 4 * sizeof(uint64_t);
+        else
+        {
+            // The boundary of the cube holds 2 + F / 2 unique vertices and every other one split a diamond of at least 4 elements
+            const uint64_t maxNumVertices = (2 * numElements + 3 * numOutsideFaces + 16 + 7) / 8;
+            exportSize += numElements * 4 * sizeof(uint32_t) + maxNumVertices * sizeof(uint64_t);
+        }
+
+        // Outside interface data
+        exportSize += numOutsideFaces * (sizeof(uint3) + 3 * sizeof(float3) + sizeof(uint32_t));
+        return exportSize;
+    }
+
+    // Depths of the estimated leaves on a level of the cache, used to propagate the splits that keep the mesh conforming
+    struct DepthRaster
+    {
+        uint32_t level = 0;
+        uint3 resolution = { 0, 0, 0 };
+        // The cells are stored with a border of one cell on every side
+        uint64_t pitchY = 0;
+        uint64_t pitchZ = 0;
+        // Fitting depth of every cell
+        std::vector<float> depths;
+        // Depth that every cell imposes on its neighbors
+        std::vector<float> constraints;
+        // Cells that hold leaves finer than the raster, they are counted during the descent
+        std::vector<uint8_t> counted;
+        // Size of a cell relative to the cube
+        double cellSize = 0.0;
+    };
+
+    uint64_t raster_index(const DepthRaster& raster, uint32_t x, uint32_t y, uint32_t z)
+    {
+        return (x + 1) + raster.pitchY * (y + 1) + raster.pitchZ * (z + 1);
+    }
+
+    void count_estimated_cell(const HeuristicCache& heuristicCache, uint32_t level, uint32_t x, uint32_t y, uint32_t z, uint32_t depth, double& numElements, double& numOutsideFaces)
+    {
+        // Elements of the unit cube and triangles of one of its faces at this depth
+        const uint32_t lebDepth = depth - 1;
+        const double cubeElements = (double)(12ull << (lebDepth - 4));
+        const double faceTriangles = (double)(2ull << (2 * ((lebDepth - 4) / 3) + (lebDepth - 4) % 3));
+
+        // Fraction of the unit cube covered by the cell along every axis (the last cell of an odd axis covers a single voxel)
+        const uint3& gridRes = heuristicCache.gridResolution;
+        const uint3& resolution = heuristicCache.resolutions[level];
+        const uint32_t cellSize = 2 << level;
+        const double fractionX = (double)std::min(cellSize, gridRes.x - x * cellSize) / gridRes.x;
+        const double fractionY = (double)std::min(cellSize, gridRes.y - y * cellSize) / gridRes.y;
+        const double fractionZ = (double)std::min(cellSize, gridRes.z - z * cellSize) / gridRes.z;
+        numElements += cubeElements * fractionX * fractionY * fractionZ;
+
+        // Count the faces of the cell that are on the boundary of the volume
+        numOutsideFaces += ((x == 0) + (x == resolution.x - 1)) * faceTriangles * fractionY * fractionZ;
+        numOutsideFaces += ((y == 0) + (y == resolution.y - 1)) * faceTriangles * fractionX * fractionZ;
+        numOutsideFaces += ((z == 0) + (z == resolution.z - 1)) * faceTriangles * fractionX * fractionY;
+    }
+
+    void estimate_cell(const HeuristicCache& heuristicCache, const FittingParameters& parameters, uint32_t maxDepth, uint32_t level, uint32_t x, uint32_t y, uint32_t z, uint32_t depth, DepthRaster& raster, double& numElements, double& numOutsideFaces)
+    {
+        // All the elements of a cell read the same statistics, so they are split together
+        const float4& stats = heuristic_cache::cell_moments(heuristicCache, heuristic_cache::cell_index(heuristicCache, level, x, y, z));
+        while (depth < maxDepth && heuristic_requests_split(stats, parameters))
+        {
+            // Move to the next depth, if it reads a finer level, process the children cells (up to 8 on the border of the grid)
+            depth++;
+            uint32_t nextLevel = heuristic_cache::cache_level(heuristicCache, depth);
+            if (nextLevel != level)
+            {
+                const uint3& nextResolution = heuristicCache.resolutions[nextLevel];
+                for (uint32_t cIdx = 0; cIdx < 8; ++cIdx)
+                {
+                    const uint32_t childX = 2 * x + (cIdx & 1), childY = 2 * y + ((cIdx >> 1) & 1), childZ = 2 * z + (cIdx >> 2);
+                    if (childX < nextResolution.x && childY < nextResolution.y && childZ < nextResolution.z)
+                        estimate_cell(heuristicCache, parameters, maxDepth, nextLevel, childX, childY, childZ, depth, raster, numElements, numOutsideFaces);
+                }
+                return;
+            }
+        }
+
+        // A leaf finer than the raster is counted now, its cell of the raster only keeps the deepest leaf
+        if (level < raster.level)
+        {
+            count_estimated_cell(heuristicCache, level, x, y, z, depth, numElements, numOutsideFaces);
+            const uint32_t shift = raster.level - level;
+            const uint64_t cellIdx = raster_index(raster, x >> shift, y >> shift, z >> shift);
+            raster.depths[cellIdx] = std::max(raster.depths[cellIdx], (float)depth);
+            raster.counted[cellIdx] = 1;
+            return;
+        }
+
+        // Otherwise it covers a block of the raster
+        const uint32_t shift = level - raster.level;
+        for (uint32_t rz = z << shift; rz < std::min((z + 1) << shift, raster.resolution.z); ++rz)
+        {
+            for (uint32_t ry = y << shift; ry < std::min((y + 1) << shift, raster.resolution.y); ++ry)
+            {
+                for (uint32_t rx = x << shift; rx < std::min((x + 1) << shift, raster.resolution.x); ++rx)
+                    raster.depths[raster_index(raster, rx, ry, rz)] = (float)depth;
+            }
+        }
+    }
+
+    float closure_constraint(float depth, double cellSize)
+    {
+        // The neighbors of an element can grow linearly with the distance to it
+        const double elementsPerCell = cellSize * exp2((depth - 6.0) / 3.0);
+        return depth - (float)(ESTIMATE_CLOSURE_SLOPE * log2(1.0 + ESTIMATE_CLOSURE_SPREAD * elementsPerCell));
+    }
+
+    bool balance_raster_sweep(DepthRaster& raster, int64_t direction)
+    {
+        // Offsets of the 13 neighbors that precede a cell in the order of the sweep
+        int64_t offsets[13];
+        for (int32_t nIdx = 0; nIdx < 13; ++nIdx)
+            offsets[nIdx] = -direction * ((nIdx % 3 - 1) + (int64_t)raster.pitchY * ((nIdx / 3) % 3 - 1) + (int64_t)raster.pitchZ * (nIdx / 9 - 1));
+
+        const uint3& resolution = raster.resolution;
+        bool changed = false;
+        for (uint32_t sz = 0; sz < resolution.z; ++sz)
+        {
+            for (uint32_t sy = 0; sy < resolution.y; ++sy)
+            {
+                // Walk the row in the direction of the sweep, the border cells never constrain anything
+                const uint32_t y = direction > 0 ? sy : resolution.y - 1 - sy;
+                const uint32_t z = direction > 0 ? sz : resolution.z - 1 - sz;
+                int64_t cellIdx = (int64_t)raster_index(raster, direction > 0 ? 0 : resolution.x - 1, y, z);
+                for (uint32_t sx = 0; sx < resolution.x; ++sx, cellIdx += direction)
+                {
+                    float depth = raster.depths[cellIdx];
+                    for (int32_t nIdx = 0; nIdx < 13; ++nIdx)
+                        depth = std::max(depth, raster.constraints[cellIdx + offsets[nIdx]]);
+
+                    // Update the cell and the constraint it imposes
+                    if (depth > raster.depths[cellIdx])
+                    {
+                        raster.depths[cellIdx] = depth;
+                        raster.constraints[cellIdx] = closure_constraint(depth, raster.cellSize);
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return changed;
+    }
+
+    FittingEstimate estimate_fitting(const HeuristicCache& heuristicCache, const FittingParameters& parameters)
+    {
+        // Same maximal depth as the fitting
+        FittingEstimate estimate;
+        estimate.maxDepth = evaluate_max_depth(heuristicCache.gridResolution, parameters);
+
+        // The base cube has 24 elements at depth 5 (6 for the fitting), they all read the base level of the cache
+        const uint32_t baseDepth = 6;
+        const uint32_t baseLevel = heuristic_cache::cache_level(heuristicCache, baseDepth);
+        const uint3& baseResolution = heuristicCache.resolutions[baseLevel];
+
+        // The raster uses the finest level read by the fitting, unless it has more than 2^24 cells
+        DepthRaster raster;
+        raster.level = heuristic_cache::cache_level(heuristicCache, estimate.maxDepth);
+        while (raster.level < baseLevel && (uint64_t)heuristicCache.resolutions[raster.level].x * heuristicCache.resolutions[raster.level].y * heuristicCache.resolutions[raster.level].z > (1ull << 24))
+            raster.level++;
+        raster.resolution = heuristicCache.resolutions[raster.level];
+        raster.pitchY = raster.resolution.x + 2;
+        raster.pitchZ = raster.pitchY * (raster.resolution.y + 2);
+        const uint64_t numRasterCells = raster.pitchZ * (raster.resolution.z + 2);
+        raster.depths.assign(numRasterCells, 0.0f);
+        raster.constraints.assign(numRasterCells, 0.0f);
+        raster.counted.assign(numRasterCells, 0);
+
+        // Process the cells of the coarsest level in parallel, they cover disjoint blocks of the raster
+        const int32_t numCells = (int32_t)(baseResolution.x * baseResolution.y * baseResolution.z);
+        double numElements = 0.0, numOutsideFaces = 0.0;
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 64) reduction(+: numElements, numOutsideFaces)
+        for (int32_t cellIdx = 0; cellIdx < numCells; ++cellIdx)
+        {
+            uint32_t x = cellIdx % baseResolution.x;
+            uint32_t y = (cellIdx / baseResolution.x) % baseResolution.y;
+            uint32_t z = cellIdx / (baseResolution.x * baseResolution.y);
+            estimate_cell(heuristicCache, parameters, estimate.maxDepth, baseLevel, x, y, z, baseDepth, raster, numElements, numOutsideFaces);
+        }
+
+        // Propagate the conforming splits, a neighbor can only be about one cube level coarser per element width
+        const uint3& gridRes = heuristicCache.gridResolution;
+        raster.cellSize = (double)(2 << raster.level) / std::max(std::max(gridRes.x, gridRes.y), gridRes.z);
+        for (uint64_t cellIdx = 0; cellIdx < numRasterCells; ++cellIdx)
+        {
+            if (raster.depths[cellIdx] > 0.0f)
+                raster.constraints[cellIdx] = closure_constraint(raster.depths[cellIdx], raster.cellSize);
+        }
+        for (uint32_t sweepIdx = 0; sweepIdx < ESTIMATE_MAX_SWEEPS; ++sweepIdx)
+        {
+            const bool forwardChanged = balance_raster_sweep(raster, 1);
+            const bool backwardChanged = balance_raster_sweep(raster, -1);
+            if (!forwardChanged && !backwardChanged)
+                break;
+        }
+
+        // Count the cells of the raster at their balanced depth
+        #pragma omp parallel for num_threads(parallel_num_threads()) schedule(dynamic, 1) reduction(+: numElements, numOutsideFaces)
+        for (int32_t z = 0; z < (int32_t)raster.resolution.z; ++z)
+        {
+            for (uint32_t y = 0; y < raster.resolution.y; ++y)
+            {
+                for (uint32_t x = 0; x < raster.resolution.x; ++x)
+                {
+                    const uint64_t cellIdx = raster_index(raster, x, y, z);
+                    if (!raster.counted[cellIdx])
+                        count_estimated_cell(heuristicCache, raster.level, x, y, z, (uint32_t)ceilf(raster.depths[cellIdx] - 0.001f), numElements, numOutsideFaces);
+                }
+            }
+        }
+        estimate.numElements = (uint64_t)numElements;
+        estimate.numOutsideFaces = (uint64_t)numOutsideFaces;
+
+        // Per element data of the LEBVolume used during the fitting, every live diamond holds an element and the released ones are reused
+        estimate.cpuSize = estimate.numElements * (sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint4) + sizeof(Tetrahedron) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint32_t));
+        estimate.cpuSize += estimate.numElements * (sizeof(DiamondRecord) + sizeof(uint32_t));
+
+        // Size of the exported LEBVolumeGPU
+        estimate.gpuSize = evaluate_export_size(estimate.numElements, estimate.numOutsideFaces, parameters.positionEncoding);
+
+        // Heap ID, neighbors and density
+        estimate.compressedSize = estimate.numElements * (sizeof(uint64_t) + sizeof(uint4) + sizeof(uint32_t));
+        return estimate;
+    }
+}
@@ -0,0 +1,398 @@
+// Project includes
+#include "volume/grid_volume.h"
+#include "volume/leb_volume.h"
+#include "volume/volume_generation.h"
+#include "math/operators.h"
+#include "rendering/frustum.h"
+#include "tools/security.h"
+
+// System includes
+#define NOMINMAX
+#include <Windows.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <iostream>
+#include <vector>
+
+// Number of times every element is evaluated
+#define NUM_REPETITIONS 20
+
+// Line size of the simulated caches
+#define SIM_CACHE_LINE_SIZE_LOG2 6
+
+struct BenchmarkResult
+{
+    double scalarRate = 0.0;
+    double batchedRate = 0.0;
+    uint32_t numSplits = 0;
+    uint32_t numMismatches = 0;
+};
+
+BenchmarkResult benchmark_should_subdivide(const LEBVolume& lebVolume, const GridVolume& gridVolume, const HeuristicCache& heuristicCache, const FittingParameters& fittingParams)
+{
+    // Extract the frustum
+    Frustum frustum;
+    extract_planes_from_view_projection_matrix(fittingParams.viewProjectionMatrix, frustum);
+
+    // List of the evaluated elements
+    const uint32_t numElements = lebVolume.totalNumElements;
+    std::vector<uint32_t> elements(numElements);
+    for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+        elements[eleIdx] = eleIdx;
+    std::vector<uint8_t> scalarSplits(numElements), batchedSplits(numElements);
+
+    // One element at a time
+    BenchmarkResult result;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t repIdx = 0; repIdx < NUM_REPETITIONS; ++repIdx)
+    {
+        for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+            scalarSplits[eleIdx] = leb_volume::should_subdivide_element(lebVolume, eleIdx, lebVolume.depthArray[eleIdx], gridVolume, heuristicCache, fittingParams, frustum);
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    result.scalarRate = (double)numElements * NUM_REPETITIONS / std::chrono::duration<double>(stop - start).count();
+
+    // Blocks of 8 elements
+    start = std::chrono::high_resolution_clock::now();
+    for (uint32_t repIdx = 0; repIdx < NUM_REPETITIONS; ++repIdx)
+    {
+        for (uint32_t eleIdx = 0; eleIdx < numElements; eleIdx += 8)
+        {
+            const uint32_t numBlockElements = std::min(numElements - eleIdx, 8u);
+            const uint32_t splitMask = leb_volume::should_subdivide_elements(lebVolume, &elements[eleIdx], numBlockElements, gridVolume, heuristicCache, fittingParams, frustum);
+            for (uint32_t laneIdx = 0; laneIdx < numBlockElements; ++laneIdx)
+                batchedSplits[eleIdx + laneIdx] = (splitMask >> laneIdx) & 1;
+        }
+    }
+    stop = std::chrono::high_resolution_clock::now();
+    result.batchedRate = (double)numElements * NUM_REPETITIONS / std::chrono::duration<double>(stop - start).count();
+
+    // Both versions should take the same decisions
+    for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+    {
+        result.numSplits += scalarSplits[eleIdx];
+        result.numMismatches += scalarSplits[eleIdx] != batchedSplits[eleIdx];
+    }
+    return result;
+}
+
+// Set associative LRU cache
+struct CacheSimulator
+{
+    uint32_t numSets = 0;
+    uint32_t numWays = 0;
+    std::vector<uint64_t> tags;
+    uint64_t numMisses = 0;
+};
+
+CacheSimulator create_cache_simulator(uint32_t numSets, uint32_t numWays)
+{
+    CacheSimulator simulator;
+    simulator.numSets = numSets;
+    simulator.numWays = numWays;
+    simulator.tags.resize((uint64_t)numSets * numWays, UINT64_MAX);
+    return simulator;
+}
+
+void simulate_access(CacheSimulator& simulator, const void* address)
+{
+    // Look for the line in its set
+    const uint64_t line = (uint64_t)address >> SIM_CACHE_LINE_SIZE_LOG2;
+    uint64_t* set = simulator.tags.data() + (line % simulator.numSets) * simulator.numWays;
+    uint32_t wayIdx = 0;
+    while (wayIdx < simulator.numWays - 1 && set[wayIdx] != line)
+        wayIdx++;
+    simulator.numMisses += set[wayIdx] != line;
+
+    // The line becomes the most recently used one (the least recently used one is evicted on a miss)
+    for (; wayIdx > 0; --wayIdx)
+        set[wayIdx] = set[wayIdx - 1];
+    set[0] = line;
+}
+
+struct LayoutResult
+{
+    double buildTime = 0.0;
+    uint64_t cacheSize = 0;
+    double fitTime = 0.0;
+    double sampleRate = 0.0;
+    uint32_t numElements = 0;
+    uint64_t numL1Misses = 0;
+    uint64_t numL2Misses = 0;
+};
+
+LayoutResult benchmark_cache_layout(const GridVolume& gridVolume, CacheLayout layout, CachePrecision precision = CachePrecision::Float32)
+{
+    // Build the cache
+    LayoutResult result;
+    HeuristicCache heuristicCache;
+    auto start = std::chrono::high_resolution_clock::now();
+    heuristic_cache::build_heuristic_cache(gridVolume, heuristicCache, layout, precision);
+    auto stop = std::chrono::high_resolution_clock::now();
+    result.buildTime = std::chrono::duration<double>(stop - start).count();
+    result.cacheSize = heuristicCache.momentArray.size() * sizeof(float4) + heuristicCache.packedMomentArray.size() * sizeof(half4) + heuristicCache.brickTable.size() * sizeof(uint32_t);
+
+    // Fit the volume
+    LEBVolume lebVolume;
+    leb_volume::create_type0_cube(lebVolume);
+    FittingParameters fittingParams = { false, false };
+    start = std::chrono::high_resolution_clock::now();
+    leb_volume::fit_volume_to_grid(lebVolume, gridVolume, heuristicCache, fittingParams);
+    stop = std::chrono::high_resolution_clock::now();
+    result.fitTime = std::chrono::duration<double>(stop - start).count();
+    result.numElements = lebVolume.totalNumElements;
+
+    // Sample the cache for every element in the order of the fitting loop
+    volatile float checksum = 0.0f;
+    start = std::chrono::high_resolution_clock::now();
+    for (uint32_t repIdx = 0; repIdx < NUM_REPETITIONS; ++repIdx)
+    {
+        for (uint32_t eleIdx = 0; eleIdx < result.numElements; ++eleIdx)
+        {
+            const Tetrahedron& tetra = lebVolume.tetraCacheArray[eleIdx];
+            const float3 center = (tetra.p[0] + tetra.p[1] + tetra.p[2] + tetra.p[3]) * 0.25;
+            checksum = checksum + heuristic_cache::sample_cache(heuristicCache, center, lebVolume.depthArray[eleIdx]).x;
+        }
+    }
+    stop = std::chrono::high_resolution_clock::now();
+    result.sampleRate = (double)result.numElements * NUM_REPETITIONS / std::chrono::duration<double>(stop - start).count();
+
+    // Replay the same reads through a simulated 32 KiB L1 and 1 MiB L2
+    CacheSimulator l1Simulator = create_cache_simulator(64, 8);
+    CacheSimulator l2Simulator = create_cache_simulator(1024, 16);
+    for (uint32_t eleIdx = 0; eleIdx < result.numElements; ++eleIdx)
+    {
+        const Tetrahedron& tetra = lebVolume.tetraCacheArray[eleIdx];
+        const float3 normPos = (tetra.p[0] + tetra.p[1] + tetra.p[2] + tetra.p[3]) * 0.25 + float3({ 0.5, 0.5, 0.5 });
+        const uint32_t level = heuristic_cache::cache_level(heuristicCache, lebVolume.depthArray[eleIdx]);
+        const uint3& gridRes = heuristicCache.gridResolution;
+        const uint32_t voxelX = std::min(uint32_t(normPos.x * gridRes.x), gridRes.x - 1);
+        const uint32_t voxelY = std::min(uint32_t(normPos.y * gridRes.y), gridRes.y - 1);
+        const uint32_t voxelZ = std::min(uint32_t(normPos.z * gridRes.z), gridRes.z - 1);
+        const uint64_t cellIdx = heuristic_cache::cell_index(heuristicCache, level, voxelX >> (level + 1), voxelY >> (level + 1), voxelZ >> (level + 1));
+        const void* address = precision == CachePrecision::Float16 ? (const void*)&heuristicCache.packedMomentArray[cellIdx] : (const void*)&heuristicCache.momentArray[cellIdx];
+        simulate_access(l1Simulator, address);
+        simulate_access(l2Simulator, address);
+    }
+    result.numL1Misses = l1Simulator.numMisses;
+    result.numL2Misses = l2Simulator.numMisses;
+    return result;
+}
+
+void display_layout_result(const char* name, const LayoutResult& result)
+{
+    std::cout << name << " layout: build " << result.buildTime << " s, " << result.cacheSize / (1024.0 * 1024.0) << " MiB, fit " << result.fitTime << " s (" << result.numElements << " elements), sampling "
+        << result.sampleRate / 1e6 << " M elements/s, simulated misses " << 100.0 * result.numL1Misses / result.numElements << "% L1, "
+        << 100.0 * result.numL2Misses / result.numElements << "% L2." << std::endl;
+}
+
+void display_flips(const char* name, const DecisionFlips& flips)
+{
+    std::cout << name << ": " << flips.numLostSplits << " lost splits and " << flips.numExtraSplits << " extra splits out of " << flips.numElements << " elements ("
+        << 100.0 * (flips.numLostSplits + flips.numExtraSplits) / flips.numElements << "%)." << std::endl;
+}
+
+struct DecodeResult
+{
+    double scalarRate = 0.0;
+    double batchedRate = 0.0;
+    double latticeRate = 0.0;
+    uint32_t numMismatches = 0;
+    uint32_t numLatticeMismatches = 0;
+};
+
+DecodeResult benchmark_decode(const LEBVolume& lebVolume)
+{
+    // Contiguous copy of the heapIDs
+    Leb3DCache lebCache;
+    const uint32_t numElements = lebVolume.totalNumElements;
+    std::vector<uint64_t> heapIDs(numElements);
+    for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+        heapIDs[eleIdx] = lebVolume.heapIDArray[eleIdx];
+    std::vector<Tetrahedron> scalarTetras(numElements), batchedTetras(numElements), latticeTetras(numElements);
+
+    // One heapID at a time, through the cached matrices
+    DecodeResult result;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t repIdx = 0; repIdx < NUM_REPETITIONS; ++repIdx)
+    {
+        for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+            leb_volume::evaluate_tetrahedron(heapIDs[eleIdx], lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, lebCache, scalarTetras[eleIdx]);
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    result.scalarRate = (double)numElements * NUM_REPETITIONS / std::chrono::duration<double>(stop - start).count();
+
+    // Batches of 256 heapIDs, the path used by evaluate_positions and the fitting
+    start = std::chrono::high_resolution_clock::now();
+    for (uint32_t repIdx = 0; repIdx < NUM_REPETITIONS; ++repIdx)
+    {
+        for (uint32_t eleIdx = 0; eleIdx < numElements; eleIdx += 256)
+            leb_volume::evaluate_tetrahedra(std::min(numElements - eleIdx, 256u), &heapIDs[eleIdx], lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, lebCache, &batchedTetras[eleIdx]);
+    }
+    stop = std::chrono::high_resolution_clock::now();
+    result.batchedRate = (double)numElements * NUM_REPETITIONS / std::chrono::duration<double>(stop - start).count();
+
+    // Batched integer lattice (exact, used for the vertex keys of the face matching and the validation)
+    start = std::chrono::high_resolution_clock::now();
+    for (uint32_t repIdx = 0; repIdx < NUM_REPETITIONS; ++repIdx)
+        leb_volume::evaluate_tetrahedra(numElements, heapIDs.data(), lebVolume.minimalDepth, lebVolume.basePoints, lebVolume.baseTypes, latticeTetras.data());
+    stop = std::chrono::high_resolution_clock::now();
+    result.latticeRate = (double)numElements * NUM_REPETITIONS / std::chrono::duration<double>(stop - start).count();
+
+    // All the versions should produce the same positions
+    for (uint32_t eleIdx = 0; eleIdx < numElements; ++eleIdx)
+    {
+        result.numMismatches += memcmp(&scalarTetras[eleIdx], &batchedTetras[eleIdx], sizeof(Tetrahedron)) != 0;
+        result.numLatticeMismatches += memcmp(&scalarTetras[eleIdx], &latticeTetras[eleIdx], sizeof(Tetrahedron)) != 0;
+    }
+    return result;
+}
+
+void display_decode_result(const DecodeResult& result)
+{
+    std::cout << "Decode: scalar " << result.scalarRate / 1e6 << " M elements/s, batched " << result.batchedRate / 1e6 << " M elements/s (x"
+        << result.batchedRate / result.scalarRate << "), lattice " << result.latticeRate / 1e6 << " M elements/s (x" << result.latticeRate / result.scalarRate << "), "
+        << result.numMismatches << " batched and " << result.numLatticeMismatches << " lattice mismatches." << std::endl;
+}
+
+struct CoarsenResult
+{
+    uint32_t numFineElements = 0;
+    uint32_t numMerged = 0;
+    uint32_t numCoarsenedElements = 0;
+    uint32_t numFittedElements = 0;
+    double coarsenTime = 0.0;
+    double fitTime = 0.0;
+    double volumeRatio = 0.0;
+    bool valid = false;
+    bool sameElements = false;
+};
+
+std::vector<std::pair<uint64_t, uint8_t>> sorted_elements(const LEBVolume& lebVolume)
+{
+    std::vector<std::pair<uint64_t, uint8_t>> elements(lebVolume.totalNumElements);
+    for (uint32_t eleIdx = 0; eleIdx < lebVolume.totalNumElements; ++eleIdx)
+        elements[eleIdx] = { lebVolume.heapIDArray[eleIdx], lebVolume.typeArray[eleIdx] };
+    std::sort(elements.begin(), elements.end());
+    return elements;
+}
+
+CoarsenResult benchmark_coarsen(const GridVolume& gridVolume, const HeuristicCache& heuristicCache, float fineRatio, float coarseRatio)
+{
+    // Fine fitting
+    CoarsenResult result;
+    FittingParameters fineParams = { false, false };
+    fineParams.ratioThreshold = fineRatio;
+    LEBVolume coarsenedVolume;
+    leb_volume::create_type0_cube(coarsenedVolume);
+    leb_volume::fit_volume_to_grid(coarsenedVolume, gridVolume, heuristicCache, fineParams);
+    result.numFineElements = coarsenedVolume.totalNumElements;
+
+    // Collapse it to the coarse threshold and validate the result
+    FittingParameters coarseParams = { false, false };
+    coarseParams.ratioThreshold = coarseRatio;
+    auto start = std::chrono::high_resolution_clock::now();
+    result.numMerged = leb_volume::coarsen_volume(coarsenedVolume, gridVolume, heuristicCache, coarseParams);
+    auto stop = std::chrono::high_resolution_clock::now();
+    result.coarsenTime = std::chrono::duration<double>(stop - start).count();
+    result.numCoarsenedElements = coarsenedVolume.totalNumElements;
+    VolumeValidation validation;
+    result.valid = leb_volume::validate_cubic_volume(coarsenedVolume, validation);
+    result.volumeRatio = validation.volumeRatio;
+
+    // Direct fitting at the coarse threshold
+    LEBVolume fittedVolume;
+    leb_volume::create_type0_cube(fittedVolume);
+    start = std::chrono::high_resolution_clock::now();
+    leb_volume::fit_volume_to_grid(fittedVolume, gridVolume, heuristicCache, coarseParams);
+    stop = std::chrono::high_resolution_clock::now();
+    result.fitTime = std::chrono::duration<double>(stop - start).count();
+    result.numFittedElements = fittedVolume.totalNumElements;
+
+    // Both should hold the same elements, in a different order
+    result.sameElements = sorted_elements(coarsenedVolume) == sorted_elements(fittedVolume);
+    return result;
+}
+
+void display_coarsen_result(const CoarsenResult& result)
+{
+    std::cout << "Coarsening: " << result.numFineElements << " elements to " << result.numCoarsenedElements << " (" << result.numMerged << " merged diamonds) in " << result.coarsenTime
+        << " s, " << (result.valid ? "valid" : "invalid") << ", volume ratio " << result.volumeRatio << ", direct fit " << result.numFittedElements << " elements in " << result.fitTime
+        << " s, " << (result.sameElements ? "same elements." : "different elements.") << std::endl;
+}
+
+void display_result(const char* name, const BenchmarkResult& result)
+{
+    std::cout << name << ": scalar " << result.scalarRate / 1e6 << " M elements/s, batched " << result.batchedRate / 1e6 << " M elements/s (x"
+        << result.batchedRate / result.scalarRate << "), " << result.numSplits << " splits, " << result.numMismatches << " mismatches." << std::endl;
+}
+
+int CALLBACK main(HINSTANCE, HINSTANCE, PWSTR, int)
+{
+    // Check the parameter count
+    assert_msg(__argc == 2, "Unexpected parameters to the call. Expected <project_dir>.");
+
+    // Project directory
+    const std::string& projectDir = __argv[1];
+
+    // Volume that holds our intial structure
+    LEBVolume lebVolume;
+    leb_volume::create_type0_cube(lebVolume);
+
+    // Import the grid
+    GridVolume gridVolume;
+    grid_volume::import_grid_volume((projectDir + "/volumes/wdas_cloud_grid.bin").c_str(), gridVolume);
+    std::cout << "Grid volume imported." << std::endl;
+
+    // Cache
+    HeuristicCache heuristicCache;
+    heuristic_cache::build_heuristic_cache(gridVolume, heuristicCache);
+    std::cout << "Heuristic cache built." << std::endl;
+
+    // Fit the volume to get a representative set of elements
+    FittingParameters fittingParams = { false, false };
+    leb_volume::fit_volume_to_grid(lebVolume, gridVolume, heuristicCache, fittingParams);
+    std::cout << "LEB3D volume generated." << std::endl;
+
+    // Decode the positions of the elements from their heapIDs
+    display_decode_result(benchmark_decode(lebVolume));
+
+    // Coarsening a fine fitting should give the same elements as fitting at the coarse threshold
+    display_coarsen_result(benchmark_coarsen(gridVolume, heuristicCache, 0.5f, 2.0f));
+
+    // Lower the threshold so that part of the elements request a split
+    fittingParams.ratioThreshold *= 0.5f;
+
+    // Evaluate without culling
+    display_result("No culling", benchmark_should_subdivide(lebVolume, gridVolume, heuristicCache, fittingParams));
+
+    // Camera in front of the volume looking down the z axis (the view matrix is the identity in camera relative space)
+    fittingParams.frustumCull = true;
+    fittingParams.pixelCull = true;
+    fittingParams.cameraPosition = { 0.0f, 0.0f, -gridVolume.scale.z };
+    fittingParams.viewProjectionMatrix = projection_matrix(0.3f, 0.01f, 10.0f * gridVolume.scale.z, 16.0f / 9.0f);
+    fittingParams.screenSize = { 1920, 1080 };
+    display_result("Frustum and pixel culling", benchmark_should_subdivide(lebVolume, gridVolume, heuristicCache, fittingParams));
+
+    // Compare the layouts of the cache on the fitting loop
+    display_layout_result("Linear", benchmark_cache_layout(gridVolume, CacheLayout::Linear));
+    display_layout_result("Morton", benchmark_cache_layout(gridVolume, CacheLayout::Morton));
+    display_layout_result("Sparse", benchmark_cache_layout(gridVolume, CacheLayout::Sparse));
+    display_layout_result("Linear half precision", benchmark_cache_layout(gridVolume, CacheLayout::Linear, CachePrecision::Float16));
+
+    // Count the decisions that the half precision moments flip, with and without culling
+    HeuristicCache packedCache;
+    heuristic_cache::build_heuristic_cache(gridVolume, packedCache, CacheLayout::Linear, CachePrecision::Float16);
+    display_flips("Half precision with culling", leb_volume::compare_cache_decisions(lebVolume, gridVolume, heuristicCache, packedCache, fittingParams));
+    fittingParams.frustumCull = false;
+    fittingParams.pixelCull = false;
+    display_flips("Half precision without culling", leb_volume::compare_cache_decisions(lebVolume, gridVolume, heuristicCache, packedCache, fittingParams));
+
+    // Evaluate the statistics of the AABBs of the elements as well
+    heuristic_cache::build_summed_area_tables(heuristicCache);
+    fittingParams.varianceThreshold = 0.5f;
+    display_result("Box statistics", benchmark_should_subdivide(lebVolume, gridVolume, heuristicCache, fittingParams));
+    return 0;
+}
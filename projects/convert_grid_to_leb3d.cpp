@@ -5,20 +5,32 @@
 #include "volume/volume_generation.h"
 #include "math/operators.h"
 #include "tools/security.h"
+#include "tools/parallel.h"
 
 // System includes
 #define NOMINMAX
 #include <Windows.h>
 #include <string>
 #include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
 
 int CALLBACK main(HINSTANCE, HINSTANCE, PWSTR, int)
 {
+    // Optional number of threads (LEB3D_NUM_THREADS or every logical core otherwise)
+    int32_t firstArg = 2;
+    if (__argc > 3 && std::string(__argv[2]) == "--threads")
+    {
+        set_parallel_num_threads((uint32_t)atoi(__argv[3]));
+        firstArg = 4;
+    }
+
     // Check the parameter count
-    assert_msg(__argc == 2, "Not enough parameters to the call. One parameter expected <project_dir>.");
+    assert_msg(__argc == firstArg || (__argc > firstArg + 1 && std::string(__argv[firstArg]) == "--estimate"), "Unexpected parameters to the call. Expected <project_dir> [--threads <count>] [--estimate <ratio[,min[,maxDepth]]>...].");
 
     // Project directory
     const std::string& projectDir = __argv[1];
+    const bool estimateOnly = __argc > firstArg;
 
     // Volume that holds our intial structure
     LEBVolume lebVolume;
@@ -30,16 +42,62 @@ int CALLBACK main(HINSTANCE, HINSTANCE, PWSTR, int)
     grid_volume::import_grid_volume((projectDir + "/volumes/wdas_cloud_grid.bin").c_str(), gridVolume);
     std::cout << "Grid volume imported." << std::endl;
 
-    // Cache
+    // Cache, mapped from the file of a previous run on the same grid or built and saved next to the grid
     HeuristicCache heuristicCache;
-    heuristic_cache::build_heuristic_cache(gridVolume, heuristicCache);
-    std::cout << "Heuristic cache built." << std::endl;
+    const std::string cachePath = projectDir + "/volumes/wdas_cloud_grid_cache.bin";
+    const uint64_t gridHash = grid_volume::hash_grid_volume(gridVolume);
+    if (heuristic_cache::import_heuristic_cache(cachePath.c_str(), gridHash, heuristicCache))
+        std::cout << "Heuristic cache mapped." << std::endl;
+    else
+    {
+        heuristic_cache::build_heuristic_cache(gridVolume, heuristicCache);
+        heuristic_cache::export_heuristic_cache(heuristicCache, gridHash, cachePath.c_str());
+        std::cout << "Heuristic cache built." << std::endl;
+    }
+
+    // Only predict the output for every set of parameters
+    if (estimateOnly)
+    {
+        for (int32_t argIdx = firstArg + 1; argIdx < __argc; ++argIdx)
+        {
+            // Parse the parameters
+            FittingParameters estimateParams = { false, false };
+            if (sscanf(__argv[argIdx], "%f,%f,%u", &estimateParams.ratioThreshold, &estimateParams.minThreshold, &estimateParams.maxDepth) < 1)
+            {
+                std::cout << "Invalid parameters " << __argv[argIdx] << ", expected ratio[,min[,maxDepth]]." << std::endl;
+                continue;
+            }
+            estimateParams.positionEncoding = PositionEncoding::IndexedLattice;
+
+            // Estimate and display
+            FittingEstimate estimate = leb_volume::estimate_fitting(heuristicCache, estimateParams);
+            std::cout << "Ratio " << estimateParams.ratioThreshold << ", min " << estimateParams.minThreshold << ", max depth " << estimate.maxDepth << ": "
+                << estimate.numElements << " elements, " << estimate.gpuSize << " bytes exported, " << estimate.compressedSize << " bytes compressed, "
+                << estimate.cpuSize << " bytes during the fitting." << std::endl;
+        }
+        heuristic_cache::release_heuristic_cache(heuristicCache);
+        return 0;
+    }
 
     // Subdivide the volume
     FittingParameters fittingParams = { false, false };
+    fittingParams.positionEncoding = PositionEncoding::IndexedLattice;
     uint32_t maxDepth = leb_volume::fit_volume_to_grid(lebVolume, gridVolume, heuristicCache, fittingParams);
     std::cout << "LEB3D volume generated." << std::endl;
 
+    // Validate the volume before exporting it
+    VolumeValidation validation;
+    const bool validVolume = leb_volume::validate_cubic_volume(lebVolume, validation);
+    std::cout << "LEB3D validation: " << validation.numElements << " elements, " << validation.deepElements << " too deep elements, " << validation.mismatchedNeighbors << " mismatched neighbors, "
+        << validation.asymmetricNeighbors << " asymmetric neighbors, " << validation.openFaces << " open faces, " << validation.overSharedFaces << " over-shared faces, "
+        << validation.inconsistentDiamonds << " inconsistent diamonds, " << validation.invertedElements << " inverted elements, volume ratio " << validation.volumeRatio << "." << std::endl;
+    if (!validVolume)
+    {
+        std::cout << "LEB3D validation failed, the volume is not exported." << std::endl;
+        heuristic_cache::release_heuristic_cache(heuristicCache);
+        return 1;
+    }
+
     // Export the volume
     LEBVolumeGPU lebVolumeGPU;
     uint64_t compressedSize = leb_volume::convert_to_leb_volume_to_gpu(lebVolume, gridVolume, fittingParams, maxDepth, lebVolumeGPU);
@@ -48,8 +106,9 @@ int CALLBACK main(HINSTANCE, HINSTANCE, PWSTR, int)
     // Display the compressed size
     std::cout << "LEB3D compressed size " << compressedSize << " bytes." << std::endl;
 
-    // Export to disk
-    leb_volume::export_leb_volume_gpu(lebVolumeGPU, (projectDir + "/volumes/wdas_cloud_leb.bin").c_str());
+    // Export to disk, with the positions on the lattice
+    leb_volume::export_leb_volume_gpu(lebVolumeGPU, (projectDir + "/volumes/wdas_cloud_leb.bin").c_str(), fittingParams.positionEncoding);
     std::cout << "LEB3D GPU exported." << std::endl;
+    heuristic_cache::release_heuristic_cache(heuristicCache);
     return 0;
 }
\ No newline at end of file